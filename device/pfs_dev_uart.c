@@ -21,6 +21,17 @@ STATIC int uart_read (struct pfs_file *fd, char *buffer, int length);
 STATIC int uart_write (struct pfs_file *fd, char *buffer, int length);
 STATIC int uart_ioctl (struct pfs_file *fd, unsigned long request, void *argp);
 
+// Place the receive interrupt handlers in RAM, so that they can be left
+// enabled while flash is being written (see ffs_pico_keep_irq)
+#ifndef PFS_DEV_UART_RAM
+#define PFS_DEV_UART_RAM    0
+#endif
+#if PFS_DEV_UART_RAM
+#define UART_IRQ_FUNC(func) __not_in_flash_func(func)
+#else
+#define UART_IRQ_FUNC(func) func
+#endif
+
 #define NDATA   512     // Length of serial receive buffer (must be a power of 2)
 
 STATIC struct pfs_dev_uart
@@ -46,7 +57,7 @@ STATIC const struct pfs_v_file uart_v_file =
     uart_ioctl      // ioctl
     };
 
-STATIC void uart_input (struct pfs_dev_uart *pud)
+STATIC void UART_IRQ_FUNC(uart_input) (struct pfs_dev_uart *pud)
     {
     critical_section_enter_blocking (&pud->ucs);
     int wend = ( pud->rptr - 1 ) & ( NDATA - 1 );
@@ -64,12 +75,12 @@ STATIC void uart_input (struct pfs_dev_uart *pud)
     critical_section_exit (&pud->ucs);
     }
 
-STATIC void irq_uart0 (void)
+STATIC void UART_IRQ_FUNC(irq_uart0) (void)
     {
     if ( uart_dev[0] != NULL ) uart_input (uart_dev[0]);
     }
 
-STATIC void irq_uart1 (void)
+STATIC void UART_IRQ_FUNC(irq_uart1) (void)
     {
     if ( uart_dev[1] != NULL ) uart_input (uart_dev[1]);
     }
@@ -1392,6 +1392,31 @@ static FRESULT fill_last_frag (
 
 
 #if !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Keep a partial free cluster count up to date           */
+/*-----------------------------------------------------------------------*/
+
+static void tally_free (
+	FATFS* fs,		/* Filesystem object */
+	DWORD clst,		/* First cluster allocated or freed */
+	DWORD ncl,		/* Number of clusters */
+	int freed		/* 1:Clusters freed, 0:Clusters allocated */
+)
+{
+	DWORD n;
+
+
+	if (fs->free_clst <= fs->n_fatent - 2 || clst >= fs->scan_clst) return;	/* No scan in progress, or not counted yet */
+	n = (clst + ncl > fs->scan_clst) ? fs->scan_clst - clst : ncl;	/* Clusters already counted by f_scanfree() */
+	if (freed) {
+		fs->scan_free += n;
+	} else {
+		fs->scan_free -= n;
+	}
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* FAT handling - Remove a cluster chain                                 */
 /*-----------------------------------------------------------------------*/
@@ -1434,6 +1459,7 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 			fs->free_clst++;
 			fs->fsi_flag |= 1;
 		}
+		tally_free(fs, clst, 1, 1);
 #if FF_FS_EXFAT || FF_USE_TRIM
 		if (ecl + 1 == nxt) {	/* Is next cluster contiguous? */
 			ecl = nxt;
@@ -1577,6 +1603,7 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 		fs->last_clst = ncl;
 		if (fs->free_clst <= fs->n_fatent - 2) fs->free_clst--;
 		fs->fsi_flag |= 1;
+		tally_free(fs, ncl, 1, 0);
 	} else {
 		ncl = (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;	/* Failed. Generate error status */
 	}
@@ -3452,6 +3479,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 
 #if !FF_FS_READONLY
 		fs->last_clst = fs->free_clst = 0xFFFFFFFF;		/* Initialize cluster allocation information */
+		fs->scan_clst = 0;
 #endif
 		fmt = FS_EXFAT;			/* FAT sub-type */
 	} else
@@ -3511,6 +3539,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 #if !FF_FS_READONLY
 		/* Get FSInfo if available */
 		fs->last_clst = fs->free_clst = 0xFFFFFFFF;		/* Initialize cluster allocation information */
+		fs->scan_clst = 0;
 		fs->fsi_flag = 0x80;
 #if (FF_FS_NOFSINFO & 3) != 3
 		if (fmt == FS_FAT32				/* Allow to update FSInfo only if BPB_FSInfo32 == 1 */
@@ -4835,6 +4864,111 @@ FRESULT f_getfree (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Count Free Clusters a Part at a Time                                  */
+/*-----------------------------------------------------------------------*/
+/* Each call counts the free entries in the next nsect sectors of the FAT
+/  (or allocation bitmap), so that the count can be built up in the
+/  background instead of stalling the first f_getfree(). Clusters allocated
+/  or freed between calls are accounted for. If the allocation hint is not
+/  known, it is set to the first free cluster found. nsect = 0 discards the
+/  count, which may have come from a stale FSInfo sector, and starts again. */
+
+FRESULT f_scanfree (
+	const TCHAR* path,	/* Logical drive number */
+	UINT nsect,			/* Number of FAT or bitmap sectors to scan (0:restart the count) */
+	DWORD* nclst		/* Pointer to return number of free clusters (0xFFFFFFFF:scan not complete) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst, ecl, stat;
+	FFOBJID obj;
+
+
+	/* Get logical drive */
+	res = mount_volume(&path, &fs, 0);
+	if (res == FR_OK) {
+		if (nsect == 0) {					/* Forget the count and any scan in progress */
+			fs->free_clst = 0xFFFFFFFF;
+			fs->scan_clst = 0;
+		}
+		if (fs->free_clst > fs->n_fatent - 2) {	/* Free cluster count not known yet? */
+			if (fs->scan_clst < 2) {			/* Start the scan */
+				fs->scan_clst = 2;
+				fs->scan_free = 0;
+			}
+			switch (fs->fs_type) {				/* Number of entries in nsect sectors */
+			case FS_FAT12:	ecl = nsect * SS(fs) * 2 / 3; break;
+			case FS_FAT16:	ecl = nsect * SS(fs) / 2; break;
+			case FS_FAT32:	ecl = nsect * SS(fs) / 4; break;
+			default:		ecl = nsect * SS(fs) * 8;
+			}
+			ecl += fs->scan_clst;
+			if (ecl > fs->n_fatent || ecl < fs->scan_clst) ecl = fs->n_fatent;
+			obj.fs = fs;
+			for (clst = fs->scan_clst; clst < ecl; clst++) {
+#if FF_FS_EXFAT
+				if (fs->fs_type == FS_EXFAT) {	/* exFAT: Test the bit in the allocation bitmap */
+					res = move_window(fs, fs->bitbase + (clst - 2) / 8 / SS(fs));
+					if (res != FR_OK) break;
+					stat = (fs->win[(clst - 2) / 8 % SS(fs)] >> ((clst - 2) % 8)) & 1;
+				} else
+#endif
+				{								/* FAT12/16/32: Test the FAT entry */
+					stat = get_fat(&obj, clst);
+					if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+					if (stat == 1) { res = FR_INT_ERR; break; }
+				}
+				if (stat == 0) {
+					if (fs->last_clst == 0xFFFFFFFF) fs->last_clst = clst - 1;	/* Suggest allocating from here */
+					fs->scan_free++;
+				}
+			}
+			fs->scan_clst = clst;
+			if (res == FR_OK && clst >= fs->n_fatent) {	/* Scan complete */
+				fs->free_clst = fs->scan_free;	/* Now free_clst is valid */
+				fs->fsi_flag |= 1;				/* FAT32: FSInfo is to be updated */
+			}
+		}
+		*nclst = (fs->free_clst <= fs->n_fatent - 2) ? fs->free_clst : 0xFFFFFFFF;
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get the Cluster Following the Current One of a File                   */
+/*-----------------------------------------------------------------------*/
+/* Used to read ahead across a cluster boundary. The FAT sector is usually
+/  already in the volume window or the disk cache. */
+
+FRESULT f_nextclust (
+	FIL* fp,		/* Pointer to the file object */
+	DWORD* nclst	/* Pointer to return the next cluster (0:end of the chain) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst;
+
+
+	*nclst = 0;
+	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
+	if (res == FR_OK) res = (FRESULT)fp->err;
+	if (res == FR_OK && fp->clust >= 2) {
+		clst = get_fat(&fp->obj, fp->clust);	/* Follow the cluster chain */
+		if (clst == 0xFFFFFFFF) res = FR_DISK_ERR;
+		else if (clst >= 2 && clst < fs->n_fatent) *nclst = clst;
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Truncate File                                                         */
 /*-----------------------------------------------------------------------*/
@@ -5563,6 +5697,7 @@ FRESULT f_expand (
 				fs->free_clst -= tcl;
 				fs->fsi_flag |= 1;
 			}
+			tally_free(fs, scl, tcl, 0);
 		}
 	}
 
@@ -7,8 +7,76 @@
 #include "ff.h"
 #include <stdlib.h>
 
+#ifdef SD_SPI_MODEL
+#include "sd_spi_hw.h"		/* Host build, mutex emulation */
+#else
+#include "pico/mutex.h"
+#endif
+
+/* The LFN pool and volume mutexes are created together, the first time
+/  any of them is needed. A single statically initialised mutex guards this,
+/  so that two cores, or two tasks, never race to initialise them.
+*/
+
+#if FF_FS_REENTRANT || (FF_USE_LFN == 3 && FF_LFN_POOL > 0)
+auto_init_mutex(ff_init_mtx);
+static int ff_ready;
+
+#if FF_USE_LFN == 3 && FF_LFN_POOL > 0
+static void lfn_pool_init (void);
+#endif
+#if FF_FS_REENTRANT
+static void sync_init (void);
+#endif
+
+static void ff_sys_init (void)
+{
+	mutex_enter_blocking(&ff_init_mtx);
+	if (!ff_ready) {
+#if FF_USE_LFN == 3 && FF_LFN_POOL > 0
+		lfn_pool_init();
+#endif
+#if FF_FS_REENTRANT
+		sync_init();
+#endif
+		ff_ready = 1;
+	}
+	mutex_exit(&ff_init_mtx);
+}
+#endif
+
+
+
 #if FF_USE_LFN == 3	/* Dynamic memory allocation */
 
+/* LFN working buffers are taken from a static pool, so that opening files
+/  and reading directories does not churn the heap. A buffer is claimed by
+/  locking its mutex without waiting.
+*/
+
+#define LFN_POOL_SIZE	((FF_MAX_LFN + 1) * 2 + (FF_FS_EXFAT ? (FF_MAX_LFN + 44U) / 15 * 32 : 0))
+
+#if FF_LFN_POOL > 0
+static struct ff_lfn {
+	mutex_t	mtx;
+	DWORD	buf[(LFN_POOL_SIZE + 3) / 4];
+} ff_lfn[FF_LFN_POOL];
+#endif
+
+static DWORD lfn_hits;		/* Allocations served from the pool */
+static DWORD lfn_misses;	/* Allocations which used the heap */
+
+
+#if FF_LFN_POOL > 0
+static void lfn_pool_init (void)
+{
+	UINT i;
+
+	for (i = 0; i < FF_LFN_POOL; i++) mutex_init(&ff_lfn[i].mtx);
+}
+#endif
+
+
 /*------------------------------------------------------------------------*/
 /* Allocate a memory block                                                */
 /*------------------------------------------------------------------------*/
@@ -18,6 +86,20 @@ void* ff_memalloc (	/* Returns pointer to the allocated memory block (null if no
 	UINT msize		/* Number of bytes to allocate */
 )
 {
+#if FF_LFN_POOL > 0
+	UINT i;
+
+	ff_sys_init();	/* f_mkfs() and f_fdisk() may allocate before any mount */
+	if (msize <= LFN_POOL_SIZE) {
+		for (i = 0; i < FF_LFN_POOL; i++) {
+			if (mutex_try_enter(&ff_lfn[i].mtx, NULL)) {
+				lfn_hits++;
+				return ff_lfn[i].buf;
+			}
+		}
+	}
+#endif
+	lfn_misses++;
 	return malloc(msize);	/* Allocate a new memory block with POSIX API */
 }
 
@@ -30,15 +112,61 @@ void ff_memfree (
 	void* mblock	/* Pointer to the memory block to free (nothing to do if null) */
 )
 {
+#if FF_LFN_POOL > 0
+	UINT i;
+
+	for (i = 0; i < FF_LFN_POOL; i++) {
+		if (mblock == ff_lfn[i].buf) {
+			mutex_exit(&ff_lfn[i].mtx);
+			return;
+		}
+	}
+#endif
 	free(mblock);	/* Free the memory block with POSIX API */
 }
 
+
+/*------------------------------------------------------------------------*/
+/* LFN Buffer Statistics                                                  */
+/*------------------------------------------------------------------------*/
+
+void ff_lfn_stats (
+	DWORD* hits,		/* Buffers taken from the pool */
+	DWORD* misses		/* Blocks allocated from the heap */
+)
+{
+	*hits = lfn_hits;
+	*misses = lfn_misses;
+}
+
 #endif
 
 
 
 #if FF_FS_REENTRANT	/* Mutal exclusion */
 
+/* Each volume is protected by a Pico SDK mutex, which may be waited for
+/  from either core. The timeout (FF_FS_TIMEOUT) is in milliseconds.
+/  FatFs never requests the same volume twice, so the mutex need not be
+/  recursive.
+*/
+
+static struct ff_sync {
+	mutex_t	mtx;
+	DWORD	grants;		/* Number of times the volume has been locked */
+	DWORD	waits;		/* Number of those that found the volume already locked */
+	DWORD	timeouts;	/* Number of requests that timed out */
+} ff_sync[FF_VOLUMES];
+
+
+static void sync_init (void)
+{
+	UINT i;
+
+	for (i = 0; i < FF_VOLUMES; i++) mutex_init(&ff_sync[i].mtx);
+}
+
+
 /*------------------------------------------------------------------------*/
 /* Create a Synchronization Object                                        */
 /*------------------------------------------------------------------------*/
@@ -47,35 +175,14 @@ void ff_memfree (
 /  When a 0 is returned, the f_mount() function fails with FR_INT_ERR.
 */
 
-//const osMutexDef_t Mutex[FF_VOLUMES];	/* Table of CMSIS-RTOS mutex */
-
-
 int ff_cre_syncobj (	/* 1:Function succeeded, 0:Could not create the sync object */
 	BYTE vol,			/* Corresponding volume (logical drive number) */
 	FF_SYNC_t* sobj		/* Pointer to return the created sync object */
 )
 {
-	/* Win32 */
-	*sobj = CreateMutex(NULL, FALSE, NULL);
-	return (int)(*sobj != INVALID_HANDLE_VALUE);
-
-	/* uITRON */
-//	T_CSEM csem = {TA_TPRI,1,1};
-//	*sobj = acre_sem(&csem);
-//	return (int)(*sobj > 0);
-
-	/* uC/OS-II */
-//	OS_ERR err;
-//	*sobj = OSMutexCreate(0, &err);
-//	return (int)(err == OS_NO_ERR);
-
-	/* FreeRTOS */
-//	*sobj = xSemaphoreCreateMutex();
-//	return (int)(*sobj != NULL);
-
-	/* CMSIS-RTOS */
-//	*sobj = osMutexCreate(&Mutex[vol]);
-//	return (int)(*sobj != NULL);
+	ff_sys_init();
+	*sobj = &ff_sync[vol];
+	return 1;
 }
 
 
@@ -91,23 +198,8 @@ int ff_del_syncobj (	/* 1:Function succeeded, 0:Could not delete due to an error
 	FF_SYNC_t sobj		/* Sync object tied to the logical drive to be deleted */
 )
 {
-	/* Win32 */
-	return (int)CloseHandle(sobj);
-
-	/* uITRON */
-//	return (int)(del_sem(sobj) == E_OK);
-
-	/* uC/OS-II */
-//	OS_ERR err;
-//	OSMutexDel(sobj, OS_DEL_ALWAYS, &err);
-//	return (int)(err == OS_NO_ERR);
-
-	/* FreeRTOS */
-//  vSemaphoreDelete(sobj);
-//	return 1;
-
-	/* CMSIS-RTOS */
-//	return (int)(osMutexDelete(sobj) == osOK);
+	/* The mutex is kept for the next mount of the volume */
+	return 1;
 }
 
 
@@ -122,22 +214,16 @@ int ff_req_grant (	/* 1:Got a grant to access the volume, 0:Could not get a gran
 	FF_SYNC_t sobj	/* Sync object to wait */
 )
 {
-	/* Win32 */
-	return (int)(WaitForSingleObject(sobj, FF_FS_TIMEOUT) == WAIT_OBJECT_0);
-
-	/* uITRON */
-//	return (int)(wai_sem(sobj) == E_OK);
-
-	/* uC/OS-II */
-//	OS_ERR err;
-//	OSMutexPend(sobj, FF_FS_TIMEOUT, &err));
-//	return (int)(err == OS_NO_ERR);
-
-	/* FreeRTOS */
-//	return (int)(xSemaphoreTake(sobj, FF_FS_TIMEOUT) == pdTRUE);
-
-	/* CMSIS-RTOS */
-//	return (int)(osMutexWait(sobj, FF_FS_TIMEOUT) == osOK);
+	struct ff_sync *sync = (struct ff_sync *) sobj;
+	bool wait = !mutex_try_enter(&sync->mtx, NULL);
+
+	if (wait && !mutex_enter_timeout_ms(&sync->mtx, FF_FS_TIMEOUT)) {
+		sync->timeouts++;	/* Not locked, so may miss a count */
+		return 0;
+	}
+	sync->grants++;
+	if (wait) sync->waits++;
+	return 1;
 }
 
 
@@ -151,21 +237,24 @@ void ff_rel_grant (
 	FF_SYNC_t sobj	/* Sync object to be signaled */
 )
 {
-	/* Win32 */
-	ReleaseMutex(sobj);
-
-	/* uITRON */
-//	sig_sem(sobj);
+	mutex_exit(&((struct ff_sync *) sobj)->mtx);
+}
 
-	/* uC/OS-II */
-//	OSMutexPost(sobj);
 
-	/* FreeRTOS */
-//	xSemaphoreGive(sobj);
+/*------------------------------------------------------------------------*/
+/* Volume Lock Statistics                                                 */
+/*------------------------------------------------------------------------*/
 
-	/* CMSIS-RTOS */
-//	osMutexRelease(sobj);
+void ff_lock_stats (
+	BYTE vol,			/* Logical drive number */
+	DWORD* grants,		/* Times the volume has been locked */
+	DWORD* waits,		/* Times a request had to wait for another user */
+	DWORD* timeouts		/* Requests which timed out */
+)
+{
+	*grants = ff_sync[vol].grants;
+	*waits = ff_sync[vol].waits;
+	*timeouts = ff_sync[vol].timeouts;
 }
 
 #endif
-
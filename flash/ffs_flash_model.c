@@ -0,0 +1,220 @@
+/* ffs_flash_model.c - Software model of the Pico flash memory */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Implements the Pico SDK flash routines used by ffs_pico.c for a host
+// build, so that the flash block device and littlefs can be exercised
+// and benchmarked without a Pico. Each program or erase call advances a
+// simulated clock, which time_us_64 () returns.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ffs_flash_model.h"
+
+static FFS_MODEL_CONFIG ffm_cfg;
+static FFS_MODEL_STATS ffm_stats;
+static uint8_t *ffm_data = NULL;
+static uint ffm_ncut;               // Calls made since the power cut was set
+static uint32_t ffm_seed;           // Random state for interrupted writes
+static uint32_t ffm_irq_enabled = 0;
+static xip_ctrl_hw_t ffm_xip_ctrl;
+xip_ctrl_hw_t *xip_ctrl_hw = &ffm_xip_ctrl;
+static systick_hw_t ffm_systick;
+systick_hw_t *systick_hw = &ffm_systick;
+
+static uint32_t ffm_random (void)
+    {
+    ffm_seed = ffm_seed * 1103515245 + 12345;
+    return ffm_seed >> 8;
+    }
+
+// Count a program or erase call. Returns false if the power is off, or
+// is cut during this call, in which case *pncut is set to the number of
+// units (pages or sectors) completed, and the power stays off
+static bool ffm_call (uint nunit, uint *pncut)
+    {
+    *pncut = nunit;
+    if ( ffm_stats.bCut ) return false;
+    ++ffm_stats.ncall;
+    ffm_stats.time_ns += 1000ull * ffm_cfg.call_us;
+    if (( ffm_cfg.cut_after == 0 ) || ( ++ffm_ncut < ffm_cfg.cut_after )) return true;
+    ffm_stats.bCut = true;
+    *pncut = ffm_random () % nunit;
+    return false;
+    }
+
+static bool ffm_valid (uint32_t offs, size_t count, uint align)
+    {
+    if (( ffm_data == NULL ) || ( count == 0 ) || ( offs % align != 0 ) || ( count % align != 0 )
+        || ( offs + count > ffm_cfg.size ))
+        {
+        ++ffm_stats.nalign;
+        return false;
+        }
+    return true;
+    }
+
+static void ffm_program (uint8_t *dst, const uint8_t *src, size_t count)
+    {
+    for (size_t i = 0; i < count; ++i)
+        {
+        if ( src[i] & ~dst[i] ) ++ffm_stats.nbits;
+        dst[i] &= src[i];
+        }
+    }
+
+void flash_range_erase (uint32_t flash_offs, size_t count)
+    {
+    uint ncut;
+    if ( ! ffm_valid (flash_offs, count, FLASH_SECTOR_SIZE) ) return;
+    bool bPower = ffm_call (count / FLASH_SECTOR_SIZE, &ncut);
+    if ( ffm_stats.bCut && ( ncut == count / FLASH_SECTOR_SIZE )) return;
+    uint32_t end = flash_offs + ncut * FLASH_SECTOR_SIZE;
+    while ( flash_offs < end )
+        {
+        // As the boot ROM, use block erases for aligned 64KB blocks
+        uint32_t len = FLASH_SECTOR_SIZE;
+        if (( flash_offs % FLASH_BLOCK_SIZE == 0 ) && ( end - flash_offs >= FLASH_BLOCK_SIZE ))
+            {
+            len = FLASH_BLOCK_SIZE;
+            ++ffm_stats.nblock;
+            ffm_stats.time_ns += 1000ull * ffm_cfg.block_us;
+            }
+        else
+            {
+            ++ffm_stats.nsector;
+            ffm_stats.time_ns += 1000ull * ffm_cfg.sector_us;
+            }
+        memset (&ffm_data[flash_offs], 0xFF, len);
+        flash_offs += len;
+        }
+    if ( ! bPower )
+        {
+        // Interrupted erase: the sector is left partly erased
+        uint8_t *sect = &ffm_data[flash_offs];
+        for (int i = 0; i < FLASH_SECTOR_SIZE; ++i)
+            {
+            if ( ffm_random () & 1 ) sect[i] = 0xFF;
+            }
+        }
+    }
+
+void flash_range_program (uint32_t flash_offs, const uint8_t *data, size_t count)
+    {
+    uint ncut;
+    if ( ! ffm_valid (flash_offs, count, FLASH_PAGE_SIZE) ) return;
+    bool bPower = ffm_call (count / FLASH_PAGE_SIZE, &ncut);
+    if ( ffm_stats.bCut && ( ncut == count / FLASH_PAGE_SIZE )) return;
+    size_t len = ncut * FLASH_PAGE_SIZE;
+    ffm_program (&ffm_data[flash_offs], data, len);
+    ffm_stats.npage += ncut;
+    ffm_stats.time_ns += 1000ull * ffm_cfg.page_us * ncut;
+    if ( ! bPower )
+        {
+        // Interrupted program: only some bits of the page are cleared
+        uint8_t *page = &ffm_data[flash_offs + len];
+        data += len;
+        for (int i = 0; i < FLASH_PAGE_SIZE; ++i)
+            {
+            if ( ffm_random () & 1 ) page[i] &= data[i];
+            }
+        }
+    }
+
+uint32_t save_and_disable_interrupts (void)
+    {
+    return 0;
+    }
+
+void restore_interrupts (uint32_t status)
+    {
+    }
+
+bool irq_is_enabled (uint num)
+    {
+    return ( ffm_irq_enabled & ( 1u << num )) != 0;
+    }
+
+void irq_set_enabled (uint num, bool enabled)
+    {
+    if ( enabled ) ffm_irq_enabled |= 1u << num;
+    else ffm_irq_enabled &= ~( 1u << num );
+    }
+
+uint64_t time_us_64 (void)
+    {
+    return ffm_stats.time_ns / 1000;
+    }
+
+void ffs_model_defaults (FFS_MODEL_CONFIG *cfg)
+    {
+    cfg->size = 2 * 1024 * 1024;
+    cfg->call_us = 20;
+    cfg->page_us = 400;
+    cfg->sector_us = 45000;
+    cfg->block_us = 150000;
+    cfg->cut_after = 0;
+    cfg->seed = 1;
+    }
+
+void ffs_model_config (const FFS_MODEL_CONFIG *cfg)
+    {
+    uint size = ffm_cfg.size;
+    ffm_cfg = *cfg;
+    ffm_cfg.size = size;
+    ffm_ncut = 0;
+    ffm_seed = cfg->seed;
+    }
+
+bool ffs_model_create (const FFS_MODEL_CONFIG *cfg)
+    {
+    free (ffm_data);
+    ffm_data = (uint8_t *) malloc (cfg->size);
+    if ( ffm_data == NULL ) return false;
+    memset (ffm_data, 0xFF, cfg->size);
+    ffm_cfg = *cfg;
+    ffs_model_config (cfg);
+    ffs_model_reset_stats ();
+    return true;
+    }
+
+void ffs_model_power_on (void)
+    {
+    ffm_stats.bCut = false;
+    ffm_cfg.cut_after = 0;
+    }
+
+uint8_t *ffs_model_data (void)
+    {
+    return ffm_data;
+    }
+
+bool ffs_model_save (const char *psFile)
+    {
+    FILE *f = fopen (psFile, "wb");
+    if ( f == NULL ) return false;
+    bool bOK = ( fwrite (ffm_data, 1, ffm_cfg.size, f) == ffm_cfg.size );
+    return ( fclose (f) == 0 ) && bOK;
+    }
+
+bool ffs_model_load (const char *psFile)
+    {
+    FILE *f = fopen (psFile, "rb");
+    if ( f == NULL ) return false;
+    bool bOK = ( fread (ffm_data, 1, ffm_cfg.size, f) == ffm_cfg.size );
+    fclose (f);
+    return bOK;
+    }
+
+void ffs_model_stats (FFS_MODEL_STATS *stats)
+    {
+    *stats = ffm_stats;
+    }
+
+void ffs_model_reset_stats (void)
+    {
+    bool bCut = ffm_stats.bCut;
+    memset (&ffm_stats, 0, sizeof (ffm_stats));
+    ffm_stats.bCut = bCut;
+    }
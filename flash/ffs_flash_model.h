@@ -0,0 +1,108 @@
+/* ffs_flash_model.h - Software model of the Pico flash memory */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Defining FFS_FLASH_MODEL builds ffs_pico.c for a host computer, with
+// the Pico SDK flash routines implemented by ffs_flash_model.c. The model
+// enforces NOR flash semantics (programming only clears bits, erasing
+// sets a whole sector to 0xFF), keeps a simulated clock advanced by
+// program and erase times, and can cut the power during any command.
+
+#ifndef FFS_FLASH_MODEL_H
+#define FFS_FLASH_MODEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef unsigned int uint;
+
+// Pico SDK definitions used by ffs_pico.c
+#define FLASH_PAGE_SIZE     (1u << 8)
+#define FLASH_SECTOR_SIZE   (1u << 12)
+#define FLASH_BLOCK_SIZE    (1u << 16)
+#define XIP_BASE            ((uintptr_t) ffs_model_data ())
+#define XIP_NOALLOC_BASE    XIP_BASE
+#define NUM_IRQS            32
+#define __not_in_flash_func(func)   func
+static inline void __dmb (void) {}
+static inline void __sev (void) {}
+static inline void __wfe (void) {}
+
+// The host build is single threaded, so the mutex only counts nesting
+typedef struct
+    {
+    int         count;
+    } recursive_mutex_t;
+#define auto_init_recursive_mutex(name) static recursive_mutex_t name = { 0 }
+static inline void recursive_mutex_enter_blocking (recursive_mutex_t *mtx) { ++mtx->count; }
+static inline void recursive_mutex_exit (recursive_mutex_t *mtx) { --mtx->count; }
+
+typedef struct
+    {
+    uint32_t    ctr_hit;
+    uint32_t    ctr_acc;
+    } xip_ctrl_hw_t;
+extern xip_ctrl_hw_t *xip_ctrl_hw;
+
+typedef struct
+    {
+    uint32_t    csr;
+    } systick_hw_t;
+extern systick_hw_t *systick_hw;
+
+void flash_range_erase (uint32_t flash_offs, size_t count);
+void flash_range_program (uint32_t flash_offs, const uint8_t *data, size_t count);
+uint32_t save_and_disable_interrupts (void);
+void restore_interrupts (uint32_t status);
+bool irq_is_enabled (uint num);
+void irq_set_enabled (uint num, bool enabled);
+uint64_t time_us_64 (void);
+
+typedef struct
+    {
+    uint    size;           // Flash size in bytes (multiple of FLASH_SECTOR_SIZE)
+    uint    call_us;        // Fixed cost of each flash call (leaving and re-entering XIP)
+    uint    page_us;        // Time to program a page
+    uint    sector_us;      // Time to erase a 4KB sector
+    uint    block_us;       // Time to erase an aligned 64KB block
+    uint    cut_after;      // Cut the power during this program or erase call (0 = never)
+    uint    seed;           // Seed for the state of data being written when the power is cut
+    } FFS_MODEL_CONFIG;
+
+typedef struct
+    {
+    uint64_t    time_ns;    // Simulated elapsed time
+    uint        ncall;      // Program and erase calls
+    uint        npage;      // Pages programmed
+    uint        nsector;    // Sectors erased individually
+    uint        nblock;     // 64KB blocks erased
+    uint        nbits;      // Attempts to program a 0 bit back to 1
+    uint        nalign;     // Calls rejected for misalignment or range
+    bool        bCut;       // Power has been cut
+    } FFS_MODEL_STATS;
+
+// Fill a configuration with the defaults: 2MB flash, typical QSPI NOR timing
+void ffs_model_defaults (FFS_MODEL_CONFIG *cfg);
+
+// Create (or recreate) the simulated flash. The data is initially erased
+bool ffs_model_create (const FFS_MODEL_CONFIG *cfg);
+
+// Change the timing and power cut settings, keeping the data
+void ffs_model_config (const FFS_MODEL_CONFIG *cfg);
+
+// Restore the power after a cut. Program and erase calls made while the
+// power was off are ignored
+void ffs_model_power_on (void);
+
+// Direct access to the simulated flash contents
+uint8_t *ffs_model_data (void);
+
+// Save the flash contents to a file, or load them from one
+bool ffs_model_save (const char *psFile);
+bool ffs_model_load (const char *psFile);
+
+void ffs_model_stats (FFS_MODEL_STATS *stats);
+void ffs_model_reset_stats (void);
+
+#endif
@@ -0,0 +1,192 @@
+/* ffs_nor.c - External SPI NOR flash block device for the LFS filesystem */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Unlike the Pico's own flash, the program is not executing from this
+// chip, so it can be written with interrupts enabled and without
+// stalling either core. A program or erase is started and left to
+// complete in the background: the busy status is only polled before the
+// next command.
+
+#include <stdlib.h>
+#include <string.h>
+#include <lfs.h>
+#include "nor_spi_hw.h"
+#include "ffs_nor.h"
+
+#ifndef STATIC
+#define STATIC  static
+#endif
+
+#ifndef NOR_SPI_FREQ
+#define NOR_SPI_FREQ    25000   // SPI clock (kHz)
+#endif
+#ifndef FFS_NOR_CACHE_SIZE
+#define FFS_NOR_CACHE_SIZE  1024    // littlefs read and program cache (multiple of NOR_PAGE_SIZE)
+#endif
+
+#define NOR_PAGE_SIZE       256
+#define NOR_SECTOR_SIZE     4096
+#define NOR_MAX_SIZE        0x1000000   // Limit of three byte addresses
+#define NOR_TIMEOUT_US      2000000     // Longest wait for a program or erase to complete
+
+#define NOR_CMD_WRITE_ENABLE    0x06
+#define NOR_CMD_READ_STATUS     0x05
+#define NOR_CMD_PAGE_PROGRAM    0x02
+#define NOR_CMD_SECTOR_ERASE    0x20
+#define NOR_CMD_FAST_READ       0x0B
+#define NOR_CMD_JEDEC_ID        0x9F
+#define NOR_CMD_RELEASE_PD      0xAB
+
+#define NOR_STATUS_BUSY         0x01
+
+STATIC int ffs_nor_read (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
+STATIC int ffs_nor_prog (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
+STATIC int ffs_nor_erase (const struct lfs_config *cfg, lfs_block_t block);
+STATIC int ffs_nor_sync (const struct lfs_config *cfg);
+
+STATIC bool nor_busy = false;       // A program or erase may be in progress
+STATIC int nor_ncfg = 0;            // Configurations sharing the chip and SPI hardware
+
+// Send a command, with a three byte address if bAddr, leaving the chip selected
+STATIC void nor_command (uint8_t cmd, bool bAddr, uint32_t addr)
+    {
+    uint8_t buf[4];
+    buf[0] = cmd;
+    buf[1] = addr >> 16;
+    buf[2] = addr >> 8;
+    buf[3] = addr;
+    nor_spi_chpsel (true);
+    nor_spi_write (buf, bAddr ? 4 : 1);
+    }
+
+// Wait for the previous program or erase to complete. Returns false if
+// the chip is still busy after NOR_TIMEOUT_US
+STATIC bool nor_wait (void)
+    {
+    if ( ! nor_busy ) return true;
+    uint8_t status;
+    uint32_t t0 = time_us_32 ();
+    nor_command (NOR_CMD_READ_STATUS, false, 0);
+    do
+        {
+        nor_spi_read (&status, 1);
+        }
+    while (( status & NOR_STATUS_BUSY ) && ( time_us_32 () - t0 < NOR_TIMEOUT_US ));
+    nor_spi_chpsel (false);
+    if ( status & NOR_STATUS_BUSY ) return false;
+    nor_busy = false;
+    return true;
+    }
+
+// Start a program or erase command
+STATIC bool nor_write_command (uint8_t cmd, uint32_t addr, const uint8_t *data, size_t len)
+    {
+    if ( ! nor_wait () ) return false;
+    nor_command (NOR_CMD_WRITE_ENABLE, false, 0);
+    nor_spi_chpsel (false);
+    nor_command (cmd, true, addr);
+    if ( len > 0 ) nor_spi_write (data, len);
+    nor_spi_chpsel (false);
+    nor_busy = true;
+    return true;
+    }
+
+uint32_t ffs_nor_id (void)
+    {
+    uint8_t id[3];
+    if ( ! nor_spi_load () ) return 0;
+    nor_spi_freq (NOR_SPI_FREQ);
+    if ( ! nor_wait () ) return 0;
+    nor_command (NOR_CMD_RELEASE_PD, false, 0);
+    nor_spi_chpsel (false);
+    nor_command (NOR_CMD_JEDEC_ID, false, 0);
+    nor_spi_read (id, 3);
+    nor_spi_chpsel (false);
+    uint32_t jedec = ( id[0] << 16 ) | ( id[1] << 8 ) | id[2];
+    if (( jedec == 0 ) || ( jedec == 0xFFFFFF )) return 0;
+    return jedec;
+    }
+
+int ffs_nor_createcfg (struct lfs_config *cfg, int offset, int size)
+    {
+    if (( offset < 0 ) || ( offset % NOR_SECTOR_SIZE != 0 ) || ( size < NOR_SECTOR_SIZE )
+        || ( offset + size > NOR_MAX_SIZE )) return -1;
+    uint32_t jedec = ffs_nor_id ();
+    if ( jedec == 0 ) return -1;
+    // The last byte of the identifier is log2 of the capacity in bytes
+    uint cap = jedec & 0xFF;
+    if (( cap < 24 ) && ( offset + size > ( 1 << cap ))) return -1;
+    uint32_t *base = (uint32_t *) malloc (sizeof (uint32_t));
+    if ( base == NULL ) return -1;
+    ++nor_ncfg;
+    *base = offset;
+    memset (cfg, 0, sizeof (struct lfs_config));
+    cfg->context = base;
+    cfg->read = ffs_nor_read;
+    cfg->prog = ffs_nor_prog;
+    cfg->erase = ffs_nor_erase;
+    cfg->sync = ffs_nor_sync;
+    cfg->read_size = 1;
+    cfg->prog_size = NOR_PAGE_SIZE;
+    cfg->block_size = NOR_SECTOR_SIZE;
+    cfg->block_count = size / NOR_SECTOR_SIZE;
+    cfg->cache_size = FFS_NOR_CACHE_SIZE;
+    cfg->lookahead_size = 32;
+    cfg->block_cycles = 256;
+    return 0;
+    }
+
+int ffs_nor_destroy (const struct lfs_config *cfg)
+    {
+    int iRes = nor_wait () ? 0 : -1;
+    free (cfg->context);
+    // Other volumes may share the chip
+    if (( nor_ncfg > 0 ) && ( --nor_ncfg == 0 )) nor_spi_unload ();
+    return iRes;
+    }
+
+STATIC int ffs_nor_read (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+    {
+    uint32_t addr = *((uint32_t *) cfg->context) + block * cfg->block_size + off;
+    uint8_t dummy = 0;
+    LFS_ASSERT (block < cfg->block_count);
+    if ( ! nor_wait () ) return LFS_ERR_IO;
+    nor_command (NOR_CMD_FAST_READ, true, addr);
+    nor_spi_write (&dummy, 1);
+    nor_spi_read ((uint8_t *) buffer, size);
+    nor_spi_chpsel (false);
+    return 0;
+    }
+
+// Program each page of the data in turn. The chip accepts one page per
+// command, so each page must finish before the next is sent. Only the
+// last is left to complete in the background
+STATIC int ffs_nor_prog (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+    {
+    uint32_t addr = *((uint32_t *) cfg->context) + block * cfg->block_size + off;
+    const uint8_t *data = (const uint8_t *) buffer;
+    LFS_ASSERT (off % cfg->prog_size == 0);
+    LFS_ASSERT (size % cfg->prog_size == 0);
+    LFS_ASSERT (block < cfg->block_count);
+    while ( size > 0 )
+        {
+        if ( ! nor_write_command (NOR_CMD_PAGE_PROGRAM, addr, data, NOR_PAGE_SIZE) ) return LFS_ERR_IO;
+        addr += NOR_PAGE_SIZE;
+        data += NOR_PAGE_SIZE;
+        size -= NOR_PAGE_SIZE;
+        }
+    return 0;
+    }
+
+STATIC int ffs_nor_erase (const struct lfs_config *cfg, lfs_block_t block)
+    {
+    uint32_t addr = *((uint32_t *) cfg->context) + block * cfg->block_size;
+    LFS_ASSERT (block < cfg->block_count);
+    return nor_write_command (NOR_CMD_SECTOR_ERASE, addr, NULL, 0) ? 0 : LFS_ERR_IO;
+    }
+
+STATIC int ffs_nor_sync (const struct lfs_config *cfg)
+    {
+    return nor_wait () ? 0 : LFS_ERR_IO;
+    }
@@ -0,0 +1,30 @@
+/* ffs_nor.h - External SPI NOR flash block device for the LFS filesystem */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef FFS_NOR_H
+#define FFS_NOR_H
+
+#include <lfs.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Create a configuration for a block device on an external SPI NOR flash
+// chip. Returns zero if successful, or -1 if the chip does not respond,
+// the area is not sector aligned, or there is not enough memory
+int ffs_nor_createcfg (struct lfs_config *cfg, int offset, int size);
+
+// Clean up memory associated with block device, and release the PIO and DMA
+int ffs_nor_destroy (const struct lfs_config *cfg);
+
+// JEDEC manufacturer and device identifier of the chip (0 if not found)
+uint32_t ffs_nor_id (void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
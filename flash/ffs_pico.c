@@ -6,97 +6,524 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <stdlib.h>
 #include <lfs.h>
+#include <ffs_pico.h>
+#ifdef FFS_FLASH_MODEL
+#include "ffs_flash_model.h"    // Host build, using the flash model
+#else
 #include <hardware/flash.h>
 #include <hardware/sync.h>
+#include <hardware/irq.h>
+#include <hardware/structs/xip_ctrl.h>
+#include <hardware/structs/systick.h>
+#include <pico/time.h>
 #ifdef PICO_MCLOCK
 #include <pico/multicore.h>
 #endif
+#ifdef LFS_THREADSAFE
+#include <pico/mutex.h>
+#endif
+#endif
+#if defined (PICO_MCLOCK) && defined (PICO_MCFLAG)
+#error Define only one of PICO_MCLOCK and PICO_MCFLAG
+#endif
 
 #ifndef STATIC
 #define STATIC  static
 #endif
 
+#ifndef FFS_BLOCK_SIZE
+#define FFS_BLOCK_SIZE  FLASH_SECTOR_SIZE   // littlefs block size (multiple of FLASH_SECTOR_SIZE)
+#endif
+#if FFS_BLOCK_SIZE % FLASH_SECTOR_SIZE != 0
+#error FFS_BLOCK_SIZE must be a multiple of FLASH_SECTOR_SIZE
+#endif
+#ifndef FFS_CACHE_SIZE
+#define FFS_CACHE_SIZE  1024    // littlefs read and program cache (multiple of FLASH_PAGE_SIZE)
+#endif
+#ifndef FFS_LOOKAHEAD_SIZE
+#define FFS_LOOKAHEAD_SIZE  32  // littlefs allocation look ahead (bytes, multiple of 8)
+#endif
+#ifndef FFS_BLOCK_CYCLES
+#define FFS_BLOCK_CYCLES    256 // Erase cycles before littlefs moves metadata
+#endif
+#ifndef FFS_PROG_BUFFER
+#define FFS_PROG_BUFFER FLASH_SECTOR_SIZE   // Contiguous pages programmed together (0 = program each call)
+#endif
+
+#ifndef FFS_BLOCK_ERASE
+#define FFS_BLOCK_ERASE 1       // Erase aligned 64KB blocks with one command, unless IRQs are kept
+#endif
+
+#ifndef FFS_STATS
+#define FFS_STATS       1       // Count erases and programs of each block, and time flash operations
+#endif
+
+#ifndef FFS_NOALLOC_MIN
+#define FFS_NOALLOC_MIN 256     // Reads of at least this many bytes bypass the XIP cache (0 = never)
+#endif
+
+// Alias of the flash which is read through the XIP cache without allocating
+// cache lines (RP2040), or bypassing the cache altogether
+#ifdef XIP_NOALLOC_BASE
+#define FFS_NOALLOC_OFFSET  ( XIP_NOALLOC_BASE - XIP_BASE )
+#else
+#define FFS_NOALLOC_OFFSET  ( XIP_NOCACHE_NOALLOC_BASE - XIP_BASE )
+#endif
+
+#if NUM_IRQS > 32
+typedef uint64_t irq_mask_t;
+#else
+typedef uint32_t irq_mask_t;
+#endif
+
+#define FFS_SYST_TICKINT    0x02    // SysTick exception enable in SYST_CSR
+
+// Interrupt state saved while flash is busy
+struct ffs_pico_irq
+    {
+    bool        keep;       // Some IRQs kept enabled, so only the others were masked
+    uint32_t    ints;       // Saved interrupt state, if all were disabled
+    irq_mask_t  masked;     // IRQs masked in the NVIC, if some were kept
+    uint32_t    tickint;    // SysTick exception enable, if some IRQs were kept
+    };
+
 STATIC int ffs_pico_read (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
 STATIC int ffs_pico_prog (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
 STATIC int ffs_pico_erase (const struct lfs_config *cfg, lfs_block_t block);
 STATIC int ffs_pico_sync (const struct lfs_config *cfg);
 
+// State of a flash storage area, pointed to by the lfs_config context
+struct ffs_pico_dev
+    {
+    uint8_t *   mem;        // Start of the area in the XIP window
+    uint8_t *   erased;     // Bit map of blocks erased and not programmed since
+    uint8_t *   used;       // Bit map of blocks in use by littlefs
+#if FFS_STATS
+    uint32_t *  nerase;     // Erases of each block
+    uint32_t *  nprog;      // Program calls for each block
+    uint32_t    nskip;      // Erases not needed, block erased in advance
+#endif
+    };
+
+#if FFS_STATS
+// Timing of flash commands, for all areas of the flash
+STATIC uint32_t tm_nerase = 0;
+STATIC uint64_t tm_erase_us = 0;
+STATIC uint32_t tm_erase_max = 0;
+STATIC uint32_t tm_nprog = 0;
+STATIC uint64_t tm_prog_bytes = 0;
+STATIC uint64_t tm_prog_us = 0;
+STATIC uint32_t tm_prog_max = 0;
+#endif
+
+#define BIT_TEST(map, n)    ( (map)[(n) >> 3] & ( 1 << ( (n) & 7 )))
+#define BIT_SET(map, n)     (map)[(n) >> 3] |= ( 1 << ( (n) & 7 ))
+#define BIT_CLR(map, n)     (map)[(n) >> 3] &= ~( 1 << ( (n) & 7 ))
+
+#if FFS_PROG_BUFFER > 0
+// Pages programmed by littlefs are collected here while they are contiguous,
+// so that a run of pages is written with a single call to the flash routines
+STATIC uint32_t prog_offs;      // Flash offset of the pending data
+STATIC uint32_t prog_len = 0;   // Number of bytes pending
+STATIC uint8_t prog_buf[FFS_PROG_BUFFER];
+#endif
+
+// Interrupts left enabled while flash is programmed or erased
+STATIC irq_mask_t irq_keep = 0;
+
+// Number of calls to the SDK flash routines, each of which invalidates
+// the whole XIP cache
+STATIC uint32_t xip_flushes = 0;
+
+void ffs_pico_xip_stats (uint32_t *flushes, uint32_t *hits, uint32_t *accesses)
+    {
+    // The hardware counters saturate, so are cleared each time
+    *flushes = xip_flushes;
+    *hits = xip_ctrl_hw->ctr_hit;
+    *accesses = xip_ctrl_hw->ctr_acc;
+    xip_ctrl_hw->ctr_hit = 0;
+    xip_ctrl_hw->ctr_acc = 0;
+    xip_flushes = 0;
+    }
+
+#if defined (PICO_MCLOCK)
+// The other core is locked out at the first flash operation and, when
+// littlefs is built with LFS_THREADSAFE, kept out until littlefs syncs at
+// the end of the burst of programs and erases. It is not kept out until
+// the littlefs call returns, since littlefs may then call malloc or free
+// while the parked core holds the heap lock
+STATIC int mc_depth = 0;            // Nesting of littlefs calls in progress (changed holding ffs_lfs_mutex)
+STATIC bool mc_locked = false;      // Other core is locked out
+STATIC uint64_t mc_start;           // Time of lockout
+STATIC uint32_t mc_count = 0;       // Number of lockouts
+STATIC uint64_t mc_total = 0;       // Total time locked out (us)
+STATIC uint32_t mc_max = 0;         // Longest lockout (us)
+
+STATIC void ffs_pico_lockout (void)
+    {
+    if ( mc_locked ) return;
+    multicore_lockout_start_blocking ();
+    mc_locked = true;
+    mc_start = time_us_64 ();
+    }
+
+// Let the other core run again. Unless bEnd, only outside littlefs calls
+STATIC void ffs_pico_release (bool bEnd)
+    {
+    if (( ! mc_locked ) || (( mc_depth > 0 ) && ! bEnd )) return;
+    multicore_lockout_end_blocking ();
+    mc_locked = false;
+    uint32_t t = time_us_64 () - mc_start;
+    ++mc_count;
+    mc_total += t;
+    if ( t > mc_max ) mc_max = t;
+    }
+
+#endif
+
+#ifdef LFS_THREADSAFE
+// littlefs calls these around each API call, so that volumes may be used
+// from both cores or from several tasks. One mutex serves all volumes, as
+// they share the flash and the lockout state
+auto_init_recursive_mutex (ffs_lfs_mutex);
+
+STATIC int ffs_pico_lock (const struct lfs_config *cfg)
+    {
+    recursive_mutex_enter_blocking (&ffs_lfs_mutex);
+#if defined (PICO_MCLOCK)
+    ++mc_depth;
+#endif
+    return 0;
+    }
+
+STATIC int ffs_pico_unlock (const struct lfs_config *cfg)
+    {
+#if defined (PICO_MCLOCK)
+    --mc_depth;
+    ffs_pico_release (false);
+#endif
+    recursive_mutex_exit (&ffs_lfs_mutex);
+    return 0;
+    }
+#endif
+
+#if defined (PICO_MCFLAG)
+// Instead of being locked out, the other core runs from RAM and brackets
+// any use of flash with ffs_pico_xip_enter and ffs_pico_xip_exit. Each
+// side sets its own flag before testing the other's, so they cannot both
+// proceed
+STATIC volatile bool xip_busy = false;      // Flash is being written
+STATIC volatile bool xip_in_use = false;    // Other core is using flash
+
+void __not_in_flash_func(ffs_pico_xip_enter) (void)
+    {
+    while (true)
+        {
+        xip_in_use = true;
+        __dmb ();
+        if ( ! xip_busy ) return;
+        xip_in_use = false;
+        __dmb ();
+        __sev ();
+        while ( xip_busy ) __wfe ();
+        }
+    }
+
+void __not_in_flash_func(ffs_pico_xip_exit) (void)
+    {
+    __dmb ();
+    xip_in_use = false;
+    __sev ();
+    }
+
+STATIC void ffs_pico_xip_claim (void)
+    {
+    xip_busy = true;
+    __dmb ();
+    while ( xip_in_use ) __wfe ();
+    }
+
+STATIC void ffs_pico_xip_free (void)
+    {
+    __dmb ();
+    xip_busy = false;
+    __sev ();
+    }
+#endif
+
+void ffs_pico_lockout_stats (uint32_t *count, uint64_t *total_us, uint32_t *max_us)
+    {
+#if defined (PICO_MCLOCK)
+    *count = mc_count;
+    *total_us = mc_total;
+    *max_us = mc_max;
+#else
+    *count = 0;
+    *total_us = 0;
+    *max_us = 0;
+#endif
+    }
+
 int ffs_pico_createcfg (struct lfs_config *cfg, int offset, int size)
     {
     if ( offset % FLASH_PAGE_SIZE != 0 ) return -1;
+    int nblock = size / FFS_BLOCK_SIZE;
+    int nmap = ( nblock + 7 ) / 8;
+#if FFS_STATS
+    int ncount = nblock * sizeof (uint32_t);
+#else
+    int ncount = 0;
+#endif
+    int nsize = sizeof (struct ffs_pico_dev) + 2 * ncount + 2 * nmap;
+    struct ffs_pico_dev *dev = (struct ffs_pico_dev *) malloc (nsize);
+    if ( dev == NULL ) return -1;
+    memset (dev, 0, nsize);
+    dev->mem = (uint8_t *) (XIP_BASE + offset);
+#if FFS_STATS
+    dev->nerase = (uint32_t *) &dev[1];
+    dev->nprog = dev->nerase + nblock;
+#endif
+    dev->erased = (uint8_t *) &dev[1] + 2 * ncount;
+    dev->used = dev->erased + nmap;
     memset (cfg, 0, sizeof (struct lfs_config));
-    cfg->context = (void *) (XIP_BASE + offset);
+    cfg->context = dev;
     cfg->read = ffs_pico_read;
     cfg->prog = ffs_pico_prog;
     cfg->erase = ffs_pico_erase;
     cfg->sync = ffs_pico_sync;
+#ifdef LFS_THREADSAFE
+    cfg->lock = ffs_pico_lock;
+    cfg->unlock = ffs_pico_unlock;
+#endif
     cfg->read_size = 1;
     cfg->prog_size = FLASH_PAGE_SIZE;
-    cfg->block_size = FLASH_SECTOR_SIZE;
-    cfg->block_count = size / FLASH_SECTOR_SIZE;
-    cfg->cache_size = FLASH_PAGE_SIZE;
-    cfg->cache_size = 256;
-    cfg->lookahead_size = 32;
-    cfg->block_cycles = 256;
+    cfg->block_size = FFS_BLOCK_SIZE;
+    cfg->block_count = nblock;
+    cfg->cache_size = FFS_CACHE_SIZE;
+    cfg->lookahead_size = FFS_LOOKAHEAD_SIZE;
+    cfg->block_cycles = FFS_BLOCK_CYCLES;
 	return 0;
     }
 
+
+void ffs_pico_keep_irq (uint irq, bool keep)
+    {
+    if ( irq >= NUM_IRQS ) return;
+    if ( keep ) irq_keep |= ((irq_mask_t) 1) << irq;
+    else irq_keep &= ~(((irq_mask_t) 1) << irq);
+    }
+
+// Disable interrupts before using flash. If some IRQs are to be kept,
+// only the others are masked in the NVIC, along with the SysTick exception.
+// Which was done is recorded, so that ffs_pico_irq_on undoes the same
+// even if ffs_pico_keep_irq is called in between
+STATIC void ffs_pico_irq_off (struct ffs_pico_irq *irqs)
+    {
+    uint32_t ints = save_and_disable_interrupts ();
+    irqs->keep = ( irq_keep != 0 );
+    irqs->ints = ints;
+    irqs->masked = 0;
+    if ( ! irqs->keep ) return;
+    for (uint irq = 0; irq < NUM_IRQS; ++irq)
+        {
+        irq_mask_t bit = ((irq_mask_t) 1) << irq;
+        if ((( irq_keep & bit ) == 0 ) && irq_is_enabled (irq))
+            {
+            irq_set_enabled (irq, false);
+            irqs->masked |= bit;
+            }
+        }
+    irqs->tickint = systick_hw->csr & FFS_SYST_TICKINT;
+    systick_hw->csr &= ~FFS_SYST_TICKINT;
+    restore_interrupts (ints);
+    }
+
+STATIC void ffs_pico_irq_on (const struct ffs_pico_irq *irqs)
+    {
+    if ( ! irqs->keep )
+        {
+        restore_interrupts (irqs->ints);
+        return;
+        }
+    systick_hw->csr |= irqs->tickint;
+    for (uint irq = 0; irq < NUM_IRQS; ++irq)
+        {
+        if ( irqs->masked & (((irq_mask_t) 1) << irq) ) irq_set_enabled (irq, true);
+        }
+    }
+
+// Program flash with interrupts disabled (and the other core stalled)
+STATIC void ffs_pico_program (uint32_t offs, const uint8_t *data, uint32_t size)
+    {
+    struct ffs_pico_irq irqs;
+#if defined (PICO_MCLOCK)
+    ffs_pico_lockout ();
+#elif defined (PICO_MCFLAG)
+    ffs_pico_xip_claim ();
+#endif
+	ffs_pico_irq_off (&irqs);
+#if FFS_STATS
+	uint64_t t0 = time_us_64 ();
+#endif
+	flash_range_program (offs, data, size);
+	++xip_flushes;
+#if FFS_STATS
+	uint32_t t = time_us_64 () - t0;
+	++tm_nprog;
+	tm_prog_bytes += size;
+	tm_prog_us += t;
+	if ( t > tm_prog_max ) tm_prog_max = t;
+#endif
+	ffs_pico_irq_on (&irqs);
+#if defined (PICO_MCLOCK)
+    ffs_pico_release (false);
+#elif defined (PICO_MCFLAG)
+    ffs_pico_xip_free ();
+#endif
+    }
+
+// Erase flash with interrupts disabled (and the other core stalled). Each
+// aligned 64KB block is erased with a single block erase command, which
+// is much faster than erasing its sectors separately, but takes 150ms to
+// 2s with interrupts masked. So if any IRQs are kept enabled, the caller
+// wants short latency and only sector erases are used. Interrupts are
+// serviced between blocks and sectors
+STATIC void ffs_pico_clear (uint32_t offs, uint32_t size)
+    {
+    struct ffs_pico_irq irqs;
+    uint32_t end = offs + size;
+    while ( offs < end )
+        {
+#if defined (PICO_MCLOCK)
+        ffs_pico_lockout ();
+#elif defined (PICO_MCFLAG)
+        ffs_pico_xip_claim ();
+#endif
+        ffs_pico_irq_off (&irqs);
+        uint32_t len = FLASH_SECTOR_SIZE;
+#if FFS_BLOCK_ERASE
+        if (( ! irqs.keep ) && ( offs % FLASH_BLOCK_SIZE == 0 ) && ( end - offs >= FLASH_BLOCK_SIZE ))
+            len = FLASH_BLOCK_SIZE;
+#endif
+#if FFS_STATS
+        uint64_t t0 = time_us_64 ();
+#endif
+        flash_range_erase (offs, len);
+        ++xip_flushes;
+#if FFS_STATS
+        uint32_t t = time_us_64 () - t0;
+        ++tm_nerase;
+        tm_erase_us += t;
+        if ( t > tm_erase_max ) tm_erase_max = t;
+#endif
+        ffs_pico_irq_on (&irqs);
+#if defined (PICO_MCLOCK)
+        ffs_pico_release (false);
+#elif defined (PICO_MCFLAG)
+        ffs_pico_xip_free ();
+#endif
+        offs += len;
+        }
+    }
+
+STATIC void ffs_pico_flush (void)
+    {
+#if FFS_PROG_BUFFER > 0
+    if ( prog_len > 0 )
+        {
+        ffs_pico_program (prog_offs, prog_buf, prog_len);
+        prog_len = 0;
+        }
+#endif
+    }
+
+int ffs_pico_destroy (const struct lfs_config *cfg)
+    {
+    ffs_pico_flush ();
+    free (cfg->context);
+    return 0;
+    }
+
 STATIC int ffs_pico_read (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
     {
-    uint8_t *ffs_mem  = (uint8_t *) cfg->context;
+    struct ffs_pico_dev *dev = (struct ffs_pico_dev *) cfg->context;
+    uint8_t *ffs_mem  = dev->mem;
 
 	// check if read is valid
 	LFS_ASSERT (off  % cfg->read_size == 0);
 	LFS_ASSERT (size % cfg->read_size == 0);
 	LFS_ASSERT (block < cfg->block_count);
 
-	// read data
-	memcpy (buffer, &ffs_mem[block*cfg->block_size + off], size);
+	// read data. Larger reads are file data, which would otherwise evict
+	// code from the XIP cache
+	const uint8_t *src = &ffs_mem[block*cfg->block_size + off];
+#if FFS_PROG_BUFFER > 0
+	uint32_t offs = src - (uint8_t *)XIP_BASE;
+	if (( prog_len > 0 ) && ( offs < prog_offs + prog_len ) && ( offs + size > prog_offs )) ffs_pico_flush ();
+#endif
+#if FFS_NOALLOC_MIN > 0
+	if ( size >= FFS_NOALLOC_MIN ) src += FFS_NOALLOC_OFFSET;
+#endif
+	memcpy (buffer, src, size);
 
 	return 0;
     }
 
 STATIC int ffs_pico_prog (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
     {
-    uint8_t *ffs_mem  = (uint8_t *) cfg->context;
+    struct ffs_pico_dev *dev = (struct ffs_pico_dev *) cfg->context;
+    uint8_t *ffs_mem  = dev->mem;
 
 	// check if write is valid
 	LFS_ASSERT (off  % cfg->prog_size == 0);
 	LFS_ASSERT (size % cfg->prog_size == 0);
 	LFS_ASSERT (block < cfg->block_count);
 
-	// program data
-#if defined (PICO_MCLOCK)
-    multicore_lockout_start_blocking ();
+	// program data, adding it to the pending run if it follows on
+	BIT_CLR (dev->erased, block);
+#if FFS_STATS
+	++dev->nprog[block];
 #endif
-	uint32_t ints = save_and_disable_interrupts ();
-	flash_range_program (&ffs_mem[block*cfg->block_size + off]
-		-(uint8_t *)XIP_BASE, buffer, size);
-	restore_interrupts (ints);
-#if defined (PICO_MCLOCK)
-    multicore_lockout_end_blocking ();
+	uint32_t offs = &ffs_mem[block*cfg->block_size + off] - (uint8_t *)XIP_BASE;
+#if FFS_PROG_BUFFER > 0
+	if (( prog_len > 0 ) && (( offs != prog_offs + prog_len ) || ( prog_len + size > FFS_PROG_BUFFER )))
+		ffs_pico_flush ();
+	if ( size <= FFS_PROG_BUFFER )
+		{
+		if ( prog_len == 0 ) prog_offs = offs;
+		memcpy (&prog_buf[prog_len], buffer, size);
+		prog_len += size;
+		return 0;
+		}
 #endif
+	ffs_pico_program (offs, buffer, size);
 
 	return 0;
     }
 
 STATIC int ffs_pico_erase (const struct lfs_config *cfg, lfs_block_t block)
     {
-    uint8_t *ffs_mem  = (uint8_t *) cfg->context;
+    struct ffs_pico_dev *dev = (struct ffs_pico_dev *) cfg->context;
+    uint8_t *ffs_mem  = dev->mem;
 
 	// check if erase is valid
 	LFS_ASSERT (block < cfg->block_count);
+	ffs_pico_flush ();
 
-#if defined (PICO_MCLOCK)
-    multicore_lockout_start_blocking ();
+	// nothing to do if the block was erased in advance
+	if ( BIT_TEST (dev->erased, block) )
+		{
+#if FFS_STATS
+		++dev->nskip;
 #endif
-	uint32_t ints = save_and_disable_interrupts ();
-	flash_range_erase (&ffs_mem[block*cfg->block_size]
-		-(uint8_t *)XIP_BASE, cfg->block_size);
-	restore_interrupts (ints);
-#if defined (PICO_MCLOCK)
-    multicore_lockout_end_blocking ();
+		return 0;
+		}
+	ffs_pico_clear (&ffs_mem[block*cfg->block_size] - (uint8_t *)XIP_BASE, cfg->block_size);
+	BIT_SET (dev->erased, block);
+#if FFS_STATS
+	++dev->nerase[block];
 #endif
 
 	return 0;
@@ -104,6 +531,163 @@ STATIC int ffs_pico_erase (const struct lfs_config *cfg, lfs_block_t block)
 
 STATIC int ffs_pico_sync (const struct lfs_config *cfg)
     {
-	// sync does nothing because we aren't backed by anything real
+	// write any pages still pending
+	ffs_pico_flush ();
+#if defined (PICO_MCLOCK)
+	// End of a burst of flash operations
+	ffs_pico_release (true);
+#endif
 	return 0;
     }
+
+STATIC int ffs_pico_mark_used (void *data, lfs_block_t block)
+    {
+    struct ffs_pico_dev *dev = (struct ffs_pico_dev *) data;
+    BIT_SET (dev->used, block);
+    return 0;
+    }
+
+// Test whether a block is already blank
+STATIC bool ffs_pico_blank (const uint8_t *mem, uint32_t size)
+    {
+    const uint32_t *ptr = (const uint32_t *) ( mem + FFS_NOALLOC_OFFSET );
+    for (int i = 0; i < size / 4; ++i)
+        {
+        if ( ptr[i] != 0xFFFFFFFF ) return false;
+        }
+    return true;
+    }
+
+STATIC int ffs_pico_erase_free (const struct lfs_config *cfg, lfs_t *lfs, int nmax)
+    {
+    struct ffs_pico_dev *dev = (struct ffs_pico_dev *) cfg->context;
+    ffs_pico_flush ();
+
+    // Find the blocks in use. Blocks which littlefs allocates between calls
+    // are erased by littlefs (clearing the erased flag) before being used
+    memset (dev->used, 0, ( cfg->block_count + 7 ) / 8);
+    int r = lfs_fs_traverse (lfs, ffs_pico_mark_used, dev);
+    if ( r < 0 ) return r;
+
+    // Free blocks which together make up an aligned 64KB flash block are
+    // erased with one block erase command
+    lfs_block_t nrun = ( cfg->block_size < FLASH_BLOCK_SIZE ) ? FLASH_BLOCK_SIZE / cfg->block_size : 1;
+    int ndone = 0;
+    int nleft = 0;
+    for (lfs_block_t block = 0; block < cfg->block_count; ++block)
+        {
+        if ( BIT_TEST (dev->used, block) || BIT_TEST (dev->erased, block) ) continue;
+        uint8_t *mem = &dev->mem[block*cfg->block_size];
+        if ( ffs_pico_blank (mem, cfg->block_size) )
+            {
+            BIT_SET (dev->erased, block);
+            }
+        else if (( nmax == 0 ) || ( ndone < nmax ))
+            {
+            lfs_block_t nblk = 1;
+            if (( nrun > 1 ) && (( mem - (uint8_t *)XIP_BASE ) % FLASH_BLOCK_SIZE == 0 )
+                && ( block + nrun <= cfg->block_count ) && (( nmax == 0 ) || ( ndone + (int) nrun <= nmax )))
+                {
+                nblk = nrun;
+                for (lfs_block_t i = 1; i < nrun; ++i)
+                    {
+                    if ( BIT_TEST (dev->used, block + i) ) nblk = 1;
+                    }
+                }
+            ffs_pico_clear (mem - (uint8_t *)XIP_BASE, nblk * cfg->block_size);
+            for (lfs_block_t i = 0; i < nblk; ++i)
+                {
+                BIT_SET (dev->erased, block + i);
+#if FFS_STATS
+                ++dev->nerase[block + i];
+#endif
+                }
+            ndone += nblk;
+            block += nblk - 1;
+            }
+        else
+            {
+            ++nleft;
+            }
+        }
+    return nleft;
+    }
+
+int ffs_pico_preerase (const struct lfs_config *cfg, lfs_t *lfs, int nmax)
+    {
+    if ( cfg->erase != ffs_pico_erase ) return LFS_ERR_INVAL;
+#ifdef LFS_THREADSAFE
+    // No other littlefs call may allocate a block between the traverse and
+    // the erases. The mutex is taken directly, rather than by ffs_pico_lock,
+    // so that each erase still has its own short lockout of the other core
+    recursive_mutex_enter_blocking (&ffs_lfs_mutex);
+#endif
+    int r = ffs_pico_erase_free (cfg, lfs, nmax);
+#ifdef LFS_THREADSAFE
+    recursive_mutex_exit (&ffs_lfs_mutex);
+#endif
+    return r;
+    }
+
+int ffs_pico_stats (const struct lfs_config *cfg, struct ffs_pico_stats *stats)
+    {
+#if FFS_STATS
+    if ( cfg->erase != ffs_pico_erase ) return LFS_ERR_INVAL;
+    struct ffs_pico_dev *dev = (struct ffs_pico_dev *) cfg->context;
+    memset (stats, 0, sizeof (struct ffs_pico_stats));
+    stats->erase_min = 0xFFFFFFFF;
+    for (lfs_block_t block = 0; block < cfg->block_count; ++block)
+        {
+        uint32_t n = dev->nerase[block];
+        stats->nerase += n;
+        stats->nprog += dev->nprog[block];
+        if ( n < stats->erase_min ) stats->erase_min = n;
+        if ( n > stats->erase_max )
+            {
+            stats->erase_max = n;
+            stats->erase_hot = block;
+            }
+        }
+    stats->nskip = dev->nskip;
+    stats->nerase_cmd = tm_nerase;
+    stats->erase_us = tm_erase_us;
+    stats->erase_max_us = tm_erase_max;
+    stats->nprog_cmd = tm_nprog;
+    stats->prog_bytes = tm_prog_bytes;
+    stats->prog_us = tm_prog_us;
+    stats->prog_max_us = tm_prog_max;
+    return 0;
+#else
+    return LFS_ERR_INVAL;
+#endif
+    }
+
+int ffs_pico_wear (const struct lfs_config *cfg, const uint32_t **nerase, const uint32_t **nprog)
+    {
+#if FFS_STATS
+    if ( cfg->erase != ffs_pico_erase ) return LFS_ERR_INVAL;
+    struct ffs_pico_dev *dev = (struct ffs_pico_dev *) cfg->context;
+    *nerase = dev->nerase;
+    *nprog = dev->nprog;
+    return cfg->block_count;
+#else
+    return LFS_ERR_INVAL;
+#endif
+    }
+
+int ffs_pico_histogram (const struct lfs_config *cfg, uint32_t *bins, int nbin, uint32_t width)
+    {
+#if FFS_STATS
+    if (( cfg->erase != ffs_pico_erase ) || ( nbin < 1 ) || ( width < 1 )) return LFS_ERR_INVAL;
+    struct ffs_pico_dev *dev = (struct ffs_pico_dev *) cfg->context;
+    memset (bins, 0, nbin * sizeof (uint32_t));
+    for (lfs_block_t block = 0; block < cfg->block_count; ++block)
+        {
+        uint32_t n = dev->nerase[block] / width;
+        ++bins[( n < nbin ) ? n : nbin - 1];
+        }
+    return 0;
+#else
+    return LFS_ERR_INVAL;
+#endif
+    }
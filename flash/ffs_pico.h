@@ -12,9 +12,13 @@
 #include <lfs.h>
 #include <lfs_util.h>
 
+#ifdef FFS_FLASH_MODEL
+#include "ffs_flash_model.h"
+#else
 #include <hardware/flash.h>
 #include <hardware/sync.h>
 #include <pico/stdlib.h>
+#endif
 
 #ifdef __cplusplus
 extern "C"
@@ -27,24 +31,70 @@ int ffs_pico_createcfg (struct lfs_config *cfg, int offset, int size);
 // Clean up memory associated with block device
 int ffs_pico_destroy (const struct lfs_config *cfg);
 
-// Read a block
-int ffs_pico_read (const struct lfs_config *cfg, lfs_block_t block,
-        lfs_off_t off, void *buffer, lfs_size_t size);
+// The read, program, erase and sync routines are reached through the
+// configuration
 
-// Program a block
+// Erase free blocks in advance, so that littlefs does not have to wait
+// for them to be erased when it next needs them. Call when idle.
 //
-// The block must have previously been erased.
-int ffs_pico_prog (const struct lfs_config *cfg, lfs_block_t block,
-        lfs_off_t off, const void *buffer, lfs_size_t size);
+// At most nmax blocks are erased (0 = all). Returns the number of free
+// blocks still to be erased, or a negative littlefs error code.
+int ffs_pico_preerase (const struct lfs_config *cfg, lfs_t *lfs, int nmax);
 
-// Erase a block
-//
-// A block must be erased before being programmed. The
-// state of an erased block is undefined.
-int ffs_pico_erase (const struct lfs_config *cfg, lfs_block_t block);
+// Keep an IRQ enabled while flash is programmed or erased. Its handler,
+// and everything the handler uses, must be in RAM (__not_in_flash_func),
+// since flash cannot be read until the operation finishes. Other IRQs
+// are masked, rather than all interrupts being disabled.
+void ffs_pico_keep_irq (uint irq, bool keep);
+
+// Statistics for the other core being locked out (PICO_MCLOCK): number
+// of lockouts, total time and longest time locked out in microseconds
+void ffs_pico_lockout_stats (uint32_t *count, uint64_t *total_us, uint32_t *max_us);
+
+// With PICO_MCFLAG defined, the other core keeps running while flash is
+// written, provided it executes from RAM. It must call ffs_pico_xip_enter
+// before running code or reading data in flash, and ffs_pico_xip_exit
+// afterwards. ffs_pico_xip_enter waits while flash is being written.
+void ffs_pico_xip_enter (void);
+void ffs_pico_xip_exit (void);
+
+// XIP cache statistics since the previous call: the number of flash
+// program and erase calls (each of which invalidates the whole XIP
+// cache), and the number of XIP cache hits and accesses
+void ffs_pico_xip_stats (uint32_t *flushes, uint32_t *hits, uint32_t *accesses);
+
+// Flash wear and performance statistics (FFS_STATS). Counts of blocks
+// are for the given flash area, times are for all flash commands
+struct ffs_pico_stats
+    {
+    uint32_t    nerase;         // Blocks erased
+    uint32_t    nskip;          // Erases not needed, block erased in advance
+    uint32_t    nprog;          // littlefs program calls
+    uint32_t    erase_min;      // Fewest erases of any block
+    uint32_t    erase_max;      // Most erases of any block
+    lfs_block_t erase_hot;      // First block with the most erases
+    uint32_t    nerase_cmd;     // Flash erase commands
+    uint64_t    erase_us;       // Total time erasing (microseconds)
+    uint32_t    erase_max_us;   // Longest erase command
+    uint32_t    nprog_cmd;      // Flash program commands
+    uint64_t    prog_bytes;     // Bytes programmed
+    uint64_t    prog_us;        // Total time programming
+    uint32_t    prog_max_us;    // Longest program command
+    };
+
+// Get the statistics for a flash area. Returns zero, or a negative
+// littlefs error code
+int ffs_pico_stats (const struct lfs_config *cfg, struct ffs_pico_stats *stats);
+
+// Point to the counts of erases and program calls for each block.
+// Returns the number of blocks, or a negative littlefs error code
+int ffs_pico_wear (const struct lfs_config *cfg, const uint32_t **nerase, const uint32_t **nprog);
 
-// Sync the block device
-int ffs_pico_sync (const struct lfs_config *cfg);
+// Count the blocks by number of erases: bins[i] is the number of blocks
+// erased between i * width and (i + 1) * width - 1 times. The last bin
+// also counts blocks erased more often. Returns zero, or a negative
+// littlefs error code
+int ffs_pico_histogram (const struct lfs_config *cfg, uint32_t *bins, int nbin, uint32_t width);
 
 #ifdef __cplusplus
 } /* extern "C" */
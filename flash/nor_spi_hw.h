@@ -0,0 +1,40 @@
+/* nor_spi_hw.h - Interface between SPI NOR flash commands and SPI hardware */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// The flash commands in ffs_nor.c only access the chip through these
+// routines. On the Pico they are implemented by nor_spi_pio.c. Defining
+// NOR_SPI_MODEL builds for a host computer, with the routines implemented
+// by the software flash chip model in nor_spi_model.c
+
+#ifndef NOR_SPI_HW_H
+#define NOR_SPI_HW_H
+
+#ifdef NOR_SPI_MODEL
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+typedef unsigned int uint;
+
+// Microsecond clock, from the simulated time of the model
+uint32_t time_us_32 (void);
+#else
+#include "pico.h"
+#include "pico/stdlib.h"
+#endif
+
+// Claim and configure the hardware. Returns true if successful
+bool nor_spi_load (void);
+void nor_spi_unload (void);
+
+// Set SPI clock (kHz), returns the frequency actually selected
+uint nor_spi_freq (uint freq);
+
+void nor_spi_chpsel (bool sel);
+
+// Blocking transfers. Received bytes are discarded while writing, and
+// zeros are sent while reading
+void nor_spi_write (const uint8_t *src, size_t len);
+void nor_spi_read (uint8_t *dst, size_t len);
+
+#endif
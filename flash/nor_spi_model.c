@@ -0,0 +1,235 @@
+/*  nor_spi_model.c - Software model of an SPI NOR flash chip */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Implements the hardware interface of nor_spi_hw.h for a host build, so
+// that the command code in ffs_nor.c can be exercised without a chip.
+// Every byte clocked on the simulated bus advances a simulated clock. The
+// chip decodes the standard single bit commands and is busy for the
+// configured time after each page program or sector erase.
+
+#include <stdlib.h>
+#include <string.h>
+#include "nor_spi_hw.h"
+#include "nor_spi_model.h"
+
+#define NOR_PAGE_SIZE   256
+#define NOR_SECTOR_SIZE 4096
+
+static NOR_MODEL_CONFIG norm_cfg;
+static NOR_MODEL_STATS norm_stats;
+static uint8_t *norm_data = NULL;
+static uint norm_freq = 1000;       // SPI clock (kHz)
+static uint64_t norm_byte_ns;       // Time to clock one byte
+static bool norm_cs = false;        // Chip select
+static bool norm_wel = false;       // Write enable latch
+static uint64_t norm_ready_ns = 0;  // Time the chip stops being busy
+static uint8_t norm_cmd;            // Command being received
+static uint norm_nbyte;             // Bytes received for this command
+static uint32_t norm_addr;          // Address being accessed
+static bool norm_write;             // Program or erase to do at deselect
+static bool norm_loaded = false;    // SPI hardware claimed by nor_spi_load
+
+static bool norm_busy (void)
+    {
+    return norm_stats.time_ns < norm_ready_ns;
+    }
+
+// Process one byte received by the chip, returning the byte sent
+static uint8_t norm_byte (uint8_t mosi)
+    {
+    norm_stats.time_ns += norm_byte_ns;
+    ++norm_stats.bytes;
+    if ( ! norm_cs ) return 0xFF;
+    uint n = norm_nbyte++;
+    if ( n == 0 )
+        {
+        norm_cmd = mosi;
+        norm_addr = 0;
+        norm_write = false;
+        ++norm_stats.ncmd;
+        if (( norm_cmd != 0x05 ) && norm_busy () )
+            {
+            ++norm_stats.nreject;
+            norm_cmd = 0;
+            }
+        else if ( norm_cmd == 0x06 )
+            {
+            norm_wel = true;
+            }
+        return 0xFF;
+        }
+    switch (norm_cmd)
+        {
+        case 0x05:  // Read status register
+            ++norm_stats.nstatus;
+            return ( norm_busy () ? 0x01 : 0x00 ) | ( norm_wel ? 0x02 : 0x00 );
+        case 0x9F:  // JEDEC identifier
+            if ( n > 3 ) return 0xFF;
+            return norm_cfg.jedec >> ( 8 * ( 3 - n ));
+        case 0x03:  // Read
+        case 0x0B:  // Fast read, with a dummy byte after the address
+            if ( n <= 3 )
+                {
+                norm_addr = ( norm_addr << 8 ) | mosi;
+                return 0xFF;
+                }
+            if (( norm_cmd == 0x0B ) && ( n == 4 )) return 0xFF;
+            norm_addr %= norm_cfg.size;
+            return norm_data[norm_addr++];
+        case 0x02:  // Page program, wrapping within the page
+            if ( n <= 3 )
+                {
+                norm_addr = ( norm_addr << 8 ) | mosi;
+                if ( n == 3 )
+                    {
+                    norm_addr %= norm_cfg.size;
+                    norm_write = norm_wel;
+                    if ( ! norm_wel ) ++norm_stats.nreject;
+                    }
+                return 0xFF;
+                }
+            if ( norm_write )
+                {
+                uint8_t *ptr = &norm_data[norm_addr];
+                if ( mosi & ~*ptr ) ++norm_stats.nbits;
+                *ptr &= mosi;
+                norm_addr = ( norm_addr & ~( NOR_PAGE_SIZE - 1 )) | (( norm_addr + 1 ) & ( NOR_PAGE_SIZE - 1 ));
+                }
+            return 0xFF;
+        case 0x20:  // Sector erase
+            if ( n <= 3 )
+                {
+                norm_addr = ( norm_addr << 8 ) | mosi;
+                if ( n == 3 )
+                    {
+                    norm_addr %= norm_cfg.size;
+                    norm_write = norm_wel;
+                    if ( ! norm_wel ) ++norm_stats.nreject;
+                    }
+                }
+            return 0xFF;
+        default:
+            return 0xFF;
+        }
+    }
+
+void nor_model_defaults (NOR_MODEL_CONFIG *cfg)
+    {
+    cfg->size = 16 * 1024 * 1024;
+    cfg->jedec = 0xEF4018;
+    cfg->max_freq = 50000;
+    cfg->xfer_ns = 2000;
+    cfg->page_us = 400;
+    cfg->sector_us = 45000;
+    }
+
+bool nor_model_create (const NOR_MODEL_CONFIG *cfg)
+    {
+    free (norm_data);
+    norm_data = (uint8_t *) malloc (cfg->size);
+    if ( norm_data == NULL ) return false;
+    memset (norm_data, 0xFF, cfg->size);
+    norm_cfg = *cfg;
+    norm_cs = false;
+    norm_wel = false;
+    nor_model_reset_stats ();
+    return true;
+    }
+
+uint8_t *nor_model_data (void)
+    {
+    return norm_data;
+    }
+
+void nor_model_stats (NOR_MODEL_STATS *stats)
+    {
+    *stats = norm_stats;
+    stats->loaded = norm_loaded;
+    }
+
+void nor_model_reset_stats (void)
+    {
+    memset (&norm_stats, 0, sizeof (norm_stats));
+    norm_ready_ns = 0;
+    }
+
+// Hardware interface
+
+bool nor_spi_load (void)
+    {
+    norm_loaded = ( norm_data != NULL );
+    return norm_loaded;
+    }
+
+void nor_spi_unload (void)
+    {
+    norm_loaded = false;
+    }
+
+uint32_t time_us_32 (void)
+    {
+    return norm_stats.time_ns / 1000;
+    }
+
+uint nor_spi_freq (uint freq)
+    {
+    if ( freq > norm_cfg.max_freq ) freq = norm_cfg.max_freq;
+    norm_freq = freq;
+    norm_byte_ns = 8000000ull / norm_freq;
+    return norm_freq;
+    }
+
+void nor_spi_chpsel (bool sel)
+    {
+    if ( sel && ! norm_cs )
+        {
+        norm_nbyte = 0;
+        }
+    else if ( norm_cs && ! sel && norm_write )
+        {
+        // Deselect starts the program or erase
+        if ( norm_cmd == 0x02 )
+            {
+            ++norm_stats.npage;
+            norm_ready_ns = norm_stats.time_ns + 1000ull * norm_cfg.page_us;
+            }
+        else
+            {
+            memset (&norm_data[norm_addr & ~( NOR_SECTOR_SIZE - 1 )], 0xFF, NOR_SECTOR_SIZE);
+            ++norm_stats.nsector;
+            norm_ready_ns = norm_stats.time_ns + 1000ull * norm_cfg.sector_us;
+            }
+        norm_wel = false;
+        norm_write = false;
+        }
+    norm_cs = sel;
+    }
+
+void nor_spi_write (const uint8_t *src, size_t len)
+    {
+    // Transfers after the hardware is released are ignored
+    if ( ! norm_loaded )
+        {
+        ++norm_stats.nreject;
+        return;
+        }
+    norm_stats.time_ns += norm_cfg.xfer_ns;
+    for (size_t i = 0; i < len; ++i) norm_byte (src[i]);
+    }
+
+void nor_spi_read (uint8_t *dst, size_t len)
+    {
+    if ( ! norm_loaded )
+        {
+        ++norm_stats.nreject;
+        memset (dst, 0xFF, len);
+        return;
+        }
+    uint64_t t0 = norm_stats.time_ns;
+    norm_stats.time_ns += norm_cfg.xfer_ns;
+    for (size_t i = 0; i < len; ++i) dst[i] = norm_byte (0x00);
+    // Time spent polling a busy status counts as waiting for the chip
+    if ( norm_cs && ( norm_cmd == 0x05 ) && ( len > 0 ) && ( dst[len-1] & 0x01 ))
+        norm_stats.busy_ns += norm_stats.time_ns - t0;
+    }
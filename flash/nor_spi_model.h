@@ -0,0 +1,46 @@
+/* nor_spi_model.h - Software model of an SPI NOR flash chip */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef NOR_SPI_MODEL_H
+#define NOR_SPI_MODEL_H
+
+#include "nor_spi_hw.h"
+
+typedef struct
+    {
+    uint        size;       // Chip capacity in bytes (multiple of 4KB)
+    uint32_t    jedec;      // JEDEC identifier returned by command 0x9F
+    uint        max_freq;   // Fastest SPI clock (kHz)
+    uint        xfer_ns;    // Software overhead for each transfer started
+    uint        page_us;    // Busy time after a page program
+    uint        sector_us;  // Busy time after a sector erase
+    } NOR_MODEL_CONFIG;
+
+typedef struct
+    {
+    uint64_t    time_ns;    // Simulated elapsed time
+    uint64_t    bytes;      // Bytes clocked on the SPI bus
+    uint64_t    busy_ns;    // Time spent waiting for the chip
+    uint        ncmd;       // Commands received
+    uint        npage;      // Pages programmed
+    uint        nsector;    // Sectors erased
+    uint        nstatus;    // Status register bytes read
+    uint        nbits;      // Attempts to program a 0 bit back to 1
+    uint        nreject;    // Commands ignored: chip busy, not write enabled, or hardware not loaded
+    bool        loaded;     // SPI hardware claimed (nor_spi_load without nor_spi_unload)
+    } NOR_MODEL_STATS;
+
+// Fill a configuration with the defaults: 16MB chip, 25MHz SPI clock
+void nor_model_defaults (NOR_MODEL_CONFIG *cfg);
+
+// Create (or recreate) the simulated chip. The data is initially erased
+bool nor_model_create (const NOR_MODEL_CONFIG *cfg);
+
+// Direct access to the simulated chip contents
+uint8_t *nor_model_data (void);
+
+void nor_model_stats (NOR_MODEL_STATS *stats);
+void nor_model_reset_stats (void);
+
+#endif
@@ -0,0 +1,148 @@
+/*  nor_spi_pio.c - SPI interface to an external NOR flash chip using PIO and DMA */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "pico.h"
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/gpio.h"
+#include "hardware/dma.h"
+#include "nor_spi.pio.h"
+#include "nor_spi_hw.h"
+#include "pico/binary_info.h"
+
+#if ( !defined(NOR_SPI_CLK_PIN)) || ( !defined(NOR_SPI_MOSI_PIN)) || ( !defined(NOR_SPI_MISO_PIN)) \
+    || ( !defined(NOR_SPI_CS_PIN))
+#error NOR flash connections not defined. Define NOR_SPI_CLK_PIN, NOR_SPI_MOSI_PIN, NOR_SPI_MISO_PIN and NOR_SPI_CS_PIN.
+#else
+
+bi_decl (bi_1pin_with_name (NOR_SPI_CS_PIN, "NOR flash chip select"));
+bi_decl (bi_1pin_with_name (NOR_SPI_CLK_PIN, "NOR flash clock"));
+bi_decl (bi_1pin_with_name (NOR_SPI_MOSI_PIN, "NOR flash data in"));
+bi_decl (bi_1pin_with_name (NOR_SPI_MISO_PIN, "NOR flash data out"));
+
+#ifndef NOR_SPI_PIO
+#define NOR_SPI_PIO     pio0
+#endif
+
+#define NOR_SPI_CYCLES  4       // PIO cycles per SPI bit (see nor_spi.pio)
+
+static PIO pio_nor = NOR_SPI_PIO;
+static int nor_sm = -1;
+static uint nor_offset;             // Location of the PIO program
+static int dma_tx = -1;
+static int dma_rx = -1;
+
+// DMA configurations are calculated once when the SM is loaded
+static dma_channel_config cfg_tx_buf;       // Transmit from buffer
+static dma_channel_config cfg_tx_fill;      // Transmit repeated fill byte
+static dma_channel_config cfg_rx_buf;       // Receive into buffer
+static dma_channel_config cfg_rx_drain;     // Receive and discard
+static uint8_t nor_zero = 0;
+static uint8_t nor_drain;
+
+static dma_channel_config nor_spi_dma_config (int chan, bool bRead, bool bWrite, uint dreq)
+    {
+    dma_channel_config c = dma_channel_get_default_config (chan);
+    channel_config_set_transfer_data_size (&c, DMA_SIZE_8);
+    channel_config_set_read_increment (&c, bRead);
+    channel_config_set_write_increment (&c, bWrite);
+    channel_config_set_dreq (&c, dreq);
+    return c;
+    }
+
+bool nor_spi_load (void)
+    {
+    if ( nor_sm >= 0 ) return true;
+    // Claim everything without panicking, releasing what was claimed if
+    // any resource is not available
+    if ( ! pio_can_add_program (pio_nor, &nor_spi_program) ) return false;
+    int sm = pio_claim_unused_sm (pio_nor, false);
+    if ( sm < 0 ) return false;
+    dma_tx = dma_claim_unused_channel (false);
+    dma_rx = ( dma_tx >= 0 ) ? dma_claim_unused_channel (false) : -1;
+    if ( dma_rx < 0 )
+        {
+        if ( dma_tx >= 0 ) dma_channel_unclaim (dma_tx);
+        dma_tx = -1;
+        pio_sm_unclaim (pio_nor, sm);
+        return false;
+        }
+    nor_offset = pio_add_program (pio_nor, &nor_spi_program);
+    nor_sm = sm;
+    gpio_init (NOR_SPI_CS_PIN);
+    gpio_set_dir (NOR_SPI_CS_PIN, GPIO_OUT);
+    gpio_put (NOR_SPI_CS_PIN, 1);
+    gpio_pull_up (NOR_SPI_MISO_PIN);
+    pio_sm_config c = nor_spi_program_get_default_config (nor_offset);
+    sm_config_set_out_pins (&c, NOR_SPI_MOSI_PIN, 1);
+    sm_config_set_in_pins (&c, NOR_SPI_MISO_PIN);
+    sm_config_set_sideset_pins (&c, NOR_SPI_CLK_PIN);
+    sm_config_set_out_shift (&c, false, true, 8);
+    sm_config_set_in_shift (&c, false, true, 8);
+    pio_sm_set_pins_with_mask (pio_nor, nor_sm, 0, (1 << NOR_SPI_CLK_PIN) | (1 << NOR_SPI_MOSI_PIN));
+    pio_sm_set_pindirs_with_mask (pio_nor, nor_sm, (1 << NOR_SPI_CLK_PIN) | (1 << NOR_SPI_MOSI_PIN),
+        (1 << NOR_SPI_CLK_PIN) | (1 << NOR_SPI_MOSI_PIN) | (1 << NOR_SPI_MISO_PIN));
+    pio_gpio_init (pio_nor, NOR_SPI_CLK_PIN);
+    pio_gpio_init (pio_nor, NOR_SPI_MOSI_PIN);
+    pio_gpio_init (pio_nor, NOR_SPI_MISO_PIN);
+    pio_sm_init (pio_nor, nor_sm, nor_offset, &c);
+    pio_sm_set_enabled (pio_nor, nor_sm, true);
+
+    uint dreq_tx = pio_get_dreq (pio_nor, nor_sm, true);
+    uint dreq_rx = pio_get_dreq (pio_nor, nor_sm, false);
+    cfg_tx_buf = nor_spi_dma_config (dma_tx, true, false, dreq_tx);
+    cfg_tx_fill = nor_spi_dma_config (dma_tx, false, false, dreq_tx);
+    cfg_rx_buf = nor_spi_dma_config (dma_rx, false, true, dreq_rx);
+    cfg_rx_drain = nor_spi_dma_config (dma_rx, false, false, dreq_rx);
+    return true;
+    }
+
+void nor_spi_unload (void)
+    {
+    if ( nor_sm < 0 ) return;
+    pio_sm_set_enabled (pio_nor, nor_sm, false);
+    pio_sm_unclaim (pio_nor, nor_sm);
+    pio_remove_program (pio_nor, &nor_spi_program, nor_offset);
+    dma_channel_unclaim (dma_tx);
+    dma_channel_unclaim (dma_rx);
+    nor_sm = -1;
+    dma_tx = -1;
+    dma_rx = -1;
+    }
+
+// Set SPI clock (kHz), returns the frequency actually selected
+uint nor_spi_freq (uint freq)
+    {
+    float div = (float) clock_get_hz (clk_sys) / ( 1000.0f * NOR_SPI_CYCLES * freq );
+    if ( div < 1.0f ) div = 1.0f;
+    pio_sm_set_clkdiv (pio_nor, nor_sm, div);
+    return clock_get_hz (clk_sys) / ( 1000.0f * NOR_SPI_CYCLES * div );
+    }
+
+void nor_spi_chpsel (bool sel)
+    {
+    gpio_put (NOR_SPI_CS_PIN, ! sel);
+    }
+
+// Do 8 bit accesses on FIFO, so that write data is byte-replicated. This
+// gets us the left-justification for free (for MSB-first shift-out)
+void nor_spi_write (const uint8_t *src, size_t len)
+    {
+    io_rw_8 *txfifo = (io_rw_8 *) &pio_nor->txf[nor_sm];
+    io_rw_8 *rxfifo = (io_rw_8 *) &pio_nor->rxf[nor_sm];
+    dma_channel_configure (dma_rx, &cfg_rx_drain, &nor_drain, rxfifo, len, true);
+    dma_channel_configure (dma_tx, &cfg_tx_buf, txfifo, src, len, true);
+    dma_channel_wait_for_finish_blocking (dma_rx);
+    }
+
+void nor_spi_read (uint8_t *dst, size_t len)
+    {
+    io_rw_8 *txfifo = (io_rw_8 *) &pio_nor->txf[nor_sm];
+    io_rw_8 *rxfifo = (io_rw_8 *) &pio_nor->rxf[nor_sm];
+    dma_channel_configure (dma_rx, &cfg_rx_buf, dst, rxfifo, len, true);
+    dma_channel_configure (dma_tx, &cfg_tx_fill, txfifo, &nor_zero, len, true);
+    dma_channel_wait_for_finish_blocking (dma_rx);
+    }
+
+#endif // End of check that NOR flash connections are specified.
@@ -11,6 +11,7 @@
 #include <fcntl.h>
 #include <pfs_private.h>
 #include <lfs.h>
+#include <ffs_pico.h>
 
 #ifndef STATIC
 #define STATIC  static
@@ -62,11 +63,15 @@ STATIC const struct pfs_v_dir ffs_v_dir =
     ffs_closedir,
     };
 
+#define FFS_MAX_FILE_BUFFERS    32  // Size of the file_free bit map
+
 struct ffs_pfs
     {
     const struct pfs_v_pfs *    entry;
     lfs_t                       base;
     struct lfs_config           cfg;
+    uint8_t *                   file_buffers;   // Static file caches (may be NULL)
+    uint32_t                    file_free;      // Bit map of static file caches free
     };
 
 struct ffs_file
@@ -75,6 +80,8 @@ struct ffs_file
     struct ffs_pfs *            ffs;
     const char *                pn;
     lfs_file_t                  ft;
+    int                         nbuf;           // Static file cache used (-1 = heap)
+    struct lfs_file_config      fcfg;
     };
 
 struct ffs_dir
@@ -108,9 +115,22 @@ STATIC struct pfs_file *ffs_open (struct pfs_pfs *pfs, const char *fn, int oflag
     if ( oflag & O_APPEND ) of |= LFS_O_APPEND;
     if ( oflag & O_CREAT )  of |= LFS_O_CREAT;
     if ( oflag & O_TRUNC )  of |= LFS_O_TRUNC;
-    int r = lfs_file_open (&ffs->base, &fd->ft, fn, of);
+    fd->nbuf = -1;
+    memset (&fd->fcfg, 0, sizeof (fd->fcfg));
+    for (int i = 0; i < FFS_MAX_FILE_BUFFERS; ++i)
+        {
+        if ( ffs->file_free & ( 1u << i ) )
+            {
+            ffs->file_free &= ~( 1u << i );
+            fd->nbuf = i;
+            fd->fcfg.buffer = ffs->file_buffers + i * ffs->cfg.cache_size;
+            break;
+            }
+        }
+    int r = lfs_file_opencfg (&ffs->base, &fd->ft, fn, of, &fd->fcfg);
     if ( r >= 0 ) return (struct pfs_file *) fd;
     pfs_error (r);
+    if ( fd->nbuf >= 0 ) ffs->file_free |= 1u << fd->nbuf;
     free (fd);
     return NULL;
     }
@@ -119,7 +139,9 @@ STATIC int ffs_close (struct pfs_file *pfs_fd)
     {
     struct ffs_file *fd = (struct ffs_file *) pfs_fd;
     struct ffs_pfs *ffs = fd->ffs;
-    return pfs_error (lfs_file_close (&ffs->base, &fd->ft));
+    int r = lfs_file_close (&ffs->base, &fd->ft);
+    if ( fd->nbuf >= 0 ) ffs->file_free |= 1u << fd->nbuf;
+    return pfs_error (r);
     }
 
 STATIC int ffs_read (struct pfs_file *pfs_fd, char *buffer, int length)
@@ -244,22 +266,118 @@ STATIC int ffs_chmod (struct pfs_pfs *pfs, const char *pathname, mode_t mode)
     return pfs_error (EINVAL);
     }
 
-struct pfs_pfs *pfs_ffs_create (const struct lfs_config *cfg)
+// Apply the tuning settings to a configuration
+STATIC int ffs_tune (struct ffs_pfs *ffs, const struct pfs_ffs_tuning *tune)
+    {
+    struct lfs_config *cfg = &ffs->cfg;
+    if ( tune->cache_size > 0 )
+        {
+        if (( tune->cache_size % cfg->prog_size != 0 ) || ( cfg->block_size % tune->cache_size != 0 ))
+            return pfs_error (EINVAL);
+        cfg->cache_size = tune->cache_size;
+        }
+    if ( tune->lookahead_size > 0 )
+        {
+        if ( tune->lookahead_size % 8 != 0 ) return pfs_error (EINVAL);
+        cfg->lookahead_size = tune->lookahead_size;
+        }
+    if ( tune->block_cycles != 0 ) cfg->block_cycles = tune->block_cycles;
+    // Limits beyond those littlefs is built for would fail its assertions
+    if ( tune->name_max > 0 )
+        {
+        if ( tune->name_max > LFS_NAME_MAX ) return pfs_error (EINVAL);
+        cfg->name_max = tune->name_max;
+        }
+    if ( tune->file_max > 0 )
+        {
+        if ( (lfs_size_t) tune->file_max > LFS_FILE_MAX ) return pfs_error (EINVAL);
+        cfg->file_max = tune->file_max;
+        }
+    if ( tune->attr_max > 0 )
+        {
+        if ( tune->attr_max > LFS_ATTR_MAX ) return pfs_error (EINVAL);
+        cfg->attr_max = tune->attr_max;
+        }
+    if ( tune->metadata_max > 0 )
+        {
+#if LFS_VERSION >= 0x00020005
+        if (( tune->metadata_max > cfg->block_size ) || ( tune->metadata_max % cfg->prog_size != 0 ))
+            return pfs_error (EINVAL);
+        cfg->metadata_max = tune->metadata_max;
+#else
+        return pfs_error (EINVAL);
+#endif
+        }
+    if ( tune->inline_max != 0 )
+        {
+#if LFS_VERSION >= 0x00020009
+        if ( tune->inline_max > 0 )
+            {
+            lfs_size_t attr_max = ( cfg->attr_max > 0 ) ? cfg->attr_max : LFS_ATTR_MAX;
+            lfs_size_t meta_max = ( cfg->metadata_max > 0 ) ? cfg->metadata_max : cfg->block_size;
+            if (( tune->inline_max > cfg->cache_size ) || ( tune->inline_max > attr_max )
+                || ( tune->inline_max > meta_max / 8 )) return pfs_error (EINVAL);
+            }
+        else if ( tune->inline_max != -1 )
+            {
+            return pfs_error (EINVAL);
+            }
+        cfg->inline_max = tune->inline_max;
+#else
+        return pfs_error (EINVAL);
+#endif
+        }
+    if ( tune->read_buffer != NULL ) cfg->read_buffer = tune->read_buffer;
+    if ( tune->prog_buffer != NULL ) cfg->prog_buffer = tune->prog_buffer;
+    if ( tune->lookahead_buffer != NULL ) cfg->lookahead_buffer = tune->lookahead_buffer;
+    if (( tune->file_buffers != NULL ) && ( tune->nfile > 0 ))
+        {
+        if ( tune->nfile > FFS_MAX_FILE_BUFFERS ) return pfs_error (EINVAL);
+        ffs->file_buffers = (uint8_t *) tune->file_buffers;
+        ffs->file_free = ( tune->nfile < 32 ) ? ( 1u << tune->nfile ) - 1 : 0xFFFFFFFF;
+        }
+    return 0;
+    }
+
+struct pfs_pfs *pfs_ffs_create_ex (const struct lfs_config *cfg, const struct pfs_ffs_tuning *tune)
     {
     struct ffs_pfs *ffs = (struct ffs_pfs *) malloc (sizeof (struct ffs_pfs));
     if ( ffs == NULL ) return NULL;
     ffs->entry = &ffs_v_pfs;
     memcpy (&ffs->cfg, cfg, sizeof (struct lfs_config));
+    ffs->file_buffers = NULL;
+    ffs->file_free = 0;
+    if (( tune != NULL ) && ( ffs_tune (ffs, tune) < 0 ))
+        {
+        free (ffs);
+        return NULL;
+        }
+    // Only a blank or unformatted volume is formatted. Any other error,
+    // such as LFS_ERR_INVAL for a volume written with larger name, file
+    // or attribute limits than the configuration, leaves the data alone
     int r = lfs_mount (&ffs->base, &ffs->cfg);
-    if ( r < 0 )
+    if ( r == LFS_ERR_CORRUPT )
         {
         r = lfs_format (&ffs->base, &ffs->cfg);
         if ( r == 0 ) r = lfs_mount (&ffs->base, &ffs->cfg);
         }
     if ( r < 0 )
         {
+        pfs_error (r);
         free (ffs);
         return NULL;
         }
     return (struct pfs_pfs *) ffs;
     }
+
+struct pfs_pfs *pfs_ffs_create (const struct lfs_config *cfg)
+    {
+    return pfs_ffs_create_ex (cfg, NULL);
+    }
+
+int pfs_ffs_preerase (struct pfs_pfs *pfs, int nmax)
+    {
+    struct ffs_pfs *ffs = (struct ffs_pfs *) pfs;
+    int r = ffs_pico_preerase (&ffs->cfg, &ffs->base, nmax);
+    return ( r >= 0 ) ? r : pfs_error (r);
+    }
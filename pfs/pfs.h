@@ -8,6 +8,7 @@
 struct pfs_pfs;
 struct lfs_config;
 struct pfs_device;
+struct async_context;
 
 #ifdef __cplusplus
 extern "C" {
@@ -69,13 +70,91 @@ int ffs_pico_createcfg (struct lfs_config *cfg, int offset, int size);
 // call has returned.
 struct pfs_pfs *pfs_ffs_create (const struct lfs_config *cfg);
 
-// Creates a pfs_pfs structure which defines an SD card storage volume
-// to mount.
+// Optional littlefs tuning for pfs_ffs_create_ex. Fields left as zero
+// (or NULL) keep the setting from the lfs_config.
+struct pfs_ffs_tuning
+    {
+    int     cache_size;         // Read, program and per-file cache size
+    int     lookahead_size;     // Allocation look ahead (bytes, 8 blocks each)
+    int     block_cycles;       // Erase cycles before metadata moves (-1 = no wear levelling)
+    int     name_max;           // Longest file name
+    int     file_max;           // Largest file
+    int     attr_max;           // Largest custom attribute
+    int     metadata_max;       // Metadata limit within a block (littlefs 2.5 or later)
+    int     inline_max;         // Largest file stored inline, -1 = none (littlefs 2.9 or later)
+    void *  read_buffer;        // Static buffers of cache_size bytes
+    void *  prog_buffer;
+    void *  lookahead_buffer;   // Static buffer of lookahead_size bytes
+    void *  file_buffers;       // Static caches for nfile open files (cache_size bytes each)
+    int     nfile;
+    };
+
+// As pfs_ffs_create, with the littlefs settings modified by tune. The
+// static buffers must persist while the volume is in use. Files opened
+// when all nfile buffers are in use have their cache allocated from the
+// heap. Returns NULL if a setting is invalid or the volume cannot be
+// mounted. Only a blank or unformatted volume is formatted.
+struct pfs_pfs *pfs_ffs_create_ex (const struct lfs_config *cfg, const struct pfs_ffs_tuning *tune);
+
+// Erases free blocks of a flash volume in advance, so that writes do not
+// have to wait for them to be erased. Call when idle. At most nmax blocks
+// are erased (0 = all). Returns the number of free blocks still to be
+// erased, or -1 on error.
+int pfs_ffs_preerase (struct pfs_pfs *pfs, int nmax);
 
-// The FATFS code maintains global state, so it is not currently
-// possible to have multiple FAT volumes.
+// Creates a pfs_pfs structure which defines an SD card storage volume
+// to mount. This uses the first FAT partition found on the card.
 struct pfs_pfs *pfs_fat_create (void);
 
+// Creates a pfs_pfs structure for a specific partition of an SD card.
+// Up to FF_VOLUMES (4) FAT volumes may be created, each of which may
+// be mounted separately.
+
+// *   drive = Physical drive number (currently only 0 is supported).
+// *   part = Partition number (1-4), or 0 for the first FAT partition.
+struct pfs_pfs *pfs_fat_create_part (int drive, int part);
+
+// Formats an SD card as a single FAT32 (up to 32GB) or exFAT volume,
+// with the partition, data area and clusters aligned to the card's
+// allocation units. Any volumes on the card must not be mounted.
+
+// *   drive = Physical drive number (currently only 0 is supported).
+int pfs_fat_format (int drive);
+
+// Unmounts a FAT volume created by pfs_fat_create or pfs_fat_create_part,
+// and frees the structure. All files on the volume must be closed, and it
+// must no longer be mounted in the pfs tree. Returns 0, or -1 on error.
+int pfs_fat_destroy (struct pfs_pfs *pfs);
+
+// Counts the free clusters on a FAT volume, nsect sectors of the FAT at a
+// time, so that the first write or free space query after mounting does
+// not have to scan the whole FAT. nsect = 0 discards the current count,
+// which on FAT32 may come from a stale FSInfo sector, and starts again.
+// Returns 1 when the count is complete, 0 if more remains to scan, or -1
+// on error.
+int pfs_fat_scan (struct pfs_pfs *pfs, int nsect);
+
+// Runs pfs_fat_scan as a background worker on an async_context. The
+// context must run its workers in task context (polled or FreeRTOS),
+// not from an interrupt, since the scan waits for the volume lock. The
+// count always starts afresh.
+// Only available if sdcard_filesystem is built with USE_ASYNC_CONTEXT.
+int pfs_fat_scan_async (struct pfs_pfs *pfs, struct async_context *context);
+
+// Sets the context on which pfs_fat_create and pfs_fat_create_part start
+// the scan for each volume they mount, or NULL (the default) not to.
+void pfs_fat_scan_context (struct async_context *context);
+
+// Creates a pfs_pfs structure for a volume held in RAM, for scratch files
+// which do not need to survive a reboot. All the memory for the volume is
+// allocated by this call.
+
+// *   size = Total memory for the volume (bytes), including the space
+//     used for directory entries and the allocation map.
+
+// Returns NULL if size is too small or there is not enough memory.
+struct pfs_pfs *pfs_ram_create (int size);
+
 // There is only ever one device filesystem. This routine gets
 // the pfs_pfs structure needed to mount the filesystem.
 
@@ -0,0 +1,731 @@
+/* pfs_ram.c - A PFS filesystem held in RAM, for scratch files */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// The whole volume (node and extent tables, block map and data) is one
+// arena allocated when the volume is created, so reads and writes never
+// call malloc. File data is held in blocks of RAM_BLOCK_SIZE bytes. Each
+// file is a list of extents (runs of contiguous blocks), and a file which
+// grows extends its last extent in place whenever the next blocks are free.
+// The contents are lost when the program ends.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pfs_private.h>
+
+#ifndef STATIC
+#define STATIC  static
+#endif
+
+#ifndef RAM_BLOCK_SIZE
+#define RAM_BLOCK_SIZE  256     // Allocation unit for file data (bytes)
+#endif
+#ifndef RAM_NODE_BYTES
+#define RAM_NODE_BYTES  2048    // Arena bytes per file or directory entry
+#endif
+#ifndef RAM_NAME_MAX
+#define RAM_NAME_MAX    31      // Longest file or directory name
+#endif
+#define RAM_MIN_NODES   8
+#define RAM_EXTENTS     4       // Extent table entries per node
+
+#define RAM_FREE        -1      // Parent of an unused node
+#define RAM_UNLINKED    -2      // Parent of a deleted file which is still open
+
+STATIC struct pfs_file *ram_open (struct pfs_pfs *pfs, const char *fn, int oflag);
+STATIC int ram_close (struct pfs_file *pfs_fd);
+STATIC int ram_read (struct pfs_file *pfs_fd, char *buffer, int length);
+STATIC int ram_write (struct pfs_file *pfs_fd, char *buffer, int length);
+STATIC long ram_lseek (struct pfs_file *pfs_fd, long pos, int whence);
+STATIC int ram_fstat (struct pfs_file *pfs_fd, struct stat *buf);
+STATIC int ram_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf);
+STATIC int ram_rename (struct pfs_pfs *pfs, const char *old, const char *new);
+STATIC int ram_delete (struct pfs_pfs *pfs, const char *name);
+STATIC int ram_mkdir (struct pfs_pfs *pfs, const char *pathname, mode_t mode);
+STATIC int ram_rmdir (struct pfs_pfs *pfs, const char *pathname);
+STATIC void *ram_opendir (struct pfs_pfs *pfs, const char *name);
+STATIC struct dirent *ram_readdir (void *dirp);
+STATIC int ram_closedir (void *dirp);
+STATIC int ram_chmod (struct pfs_pfs *pfs, const char *pathname, mode_t mode);
+
+STATIC const struct pfs_v_pfs ram_v_pfs =
+    {
+    ram_open,
+    ram_stat,
+    ram_rename,
+    ram_delete,
+    ram_mkdir,
+    ram_rmdir,
+    ram_opendir,
+    ram_chmod
+    };
+
+STATIC const struct pfs_v_file ram_v_file =
+    {
+    ram_close,
+    ram_read,
+    ram_write,
+    ram_lseek,
+    ram_fstat,
+    NULL,           // isatty
+    NULL            // ioctl
+    };
+
+STATIC const struct pfs_v_dir ram_v_dir =
+    {
+    ram_readdir,
+    ram_closedir,
+    };
+
+struct ram_extent
+    {
+    uint32_t    start;          // First block
+    uint32_t    nblock;         // Number of blocks
+    int         next;           // Next extent of the file (or free list), -1 = none
+    };
+
+struct ram_node
+    {
+    char        name[RAM_NAME_MAX+1];
+    int         parent;         // Directory containing this node, or RAM_FREE or RAM_UNLINKED
+    mode_t      mode;           // File type and permissions
+    int         nopen;          // Number of open handles
+    int         first;          // First and last extents, -1 = none
+    int         last;
+    uint32_t    size;           // File length
+    uint32_t    nblock;         // Blocks allocated
+    uint32_t    gen;            // Incremented when the extents are freed
+    };
+
+struct ram_pfs
+    {
+    const struct pfs_v_pfs *    entry;
+    int                         nnode;
+    int                         nextent;
+    uint32_t                    nblock;
+    uint32_t                    nfree;          // Blocks free
+    int                         ext_free;       // Head of list of unused extents
+    struct ram_node *           node;           // Node 0 is the root directory
+    struct ram_extent *         ext;
+    uint32_t *                  map;            // Bit set for each block in use
+    uint8_t *                   data;
+    };
+
+struct ram_file
+    {
+    const struct pfs_v_file *   entry;
+    struct ram_pfs *            ram;
+    const char *                pn;
+    int                         node;
+    int                         oflag;
+    uint32_t                    pos;
+    int                         ext;            // Extent containing the last byte accessed
+    uint32_t                    base;           // File position of the start of that extent
+    uint32_t                    gen;            // Node generation when ext was found
+    };
+
+struct ram_dir
+    {
+    const struct pfs_v_dir *    entry;
+    struct ram_pfs *            ram;
+    int                         flags;
+    struct pfs_mount *          m;
+    struct dirent               de;
+    int                         dir;            // Node of the directory being listed
+    int                         next;           // Next node to check
+    };
+
+// Block map
+
+STATIC bool ram_used (struct ram_pfs *ram, uint32_t block)
+    {
+    return ( ram->map[block / 32] & ( 1u << ( block % 32 ))) != 0;
+    }
+
+STATIC void ram_mark (struct ram_pfs *ram, uint32_t start, uint32_t nblock, bool bUsed)
+    {
+    for (uint32_t block = start; block < start + nblock; ++block)
+        {
+        if ( bUsed ) ram->map[block / 32] |= 1u << ( block % 32 );
+        else ram->map[block / 32] &= ~( 1u << ( block % 32 ));
+        }
+    if ( bUsed ) ram->nfree -= nblock;
+    else ram->nfree += nblock;
+    }
+
+// Number of free blocks starting at start, up to nmax
+STATIC uint32_t ram_run (struct ram_pfs *ram, uint32_t start, uint32_t nmax)
+    {
+    uint32_t block = start;
+    while (( block < ram->nblock ) && ( block - start < nmax ) && ( ! ram_used (ram, block) )) ++block;
+    return block - start;
+    }
+
+// Find blocks for a new extent of up to nwant blocks. Uses the first free
+// run which is long enough, otherwise the longest. If the run is more than
+// twice as long as needed, the extent starts half way along it, leaving
+// room for the file before it to grow in place. Returns the number of
+// blocks found (0 if none)
+STATIC uint32_t ram_fit (struct ram_pfs *ram, uint32_t nwant, uint32_t *pstart)
+    {
+    uint32_t best_start = 0;
+    uint32_t best_len = 0;
+    uint32_t block = 0;
+    if ( ram->nfree == 0 ) return 0;
+    while ( block < ram->nblock )
+        {
+        if ( ram->map[block / 32] == 0xFFFFFFFF )
+            {
+            block = ( block / 32 + 1 ) * 32;
+            continue;
+            }
+        if ( ram_used (ram, block) )
+            {
+            ++block;
+            continue;
+            }
+        uint32_t len = ram_run (ram, block, ram->nblock);
+        if ( len > best_len )
+            {
+            best_start = block;
+            best_len = len;
+            if ( len >= nwant ) break;
+            }
+        block += len;
+        }
+    if ( best_len == 0 ) return 0;
+    if ( best_len > 2 * nwant ) best_start += best_len / 2;
+    *pstart = best_start;
+    return ( best_len < nwant ) ? best_len : nwant;
+    }
+
+// Add up to nadd blocks to the end of a file, as many as are available
+STATIC void ram_grow (struct ram_pfs *ram, struct ram_node *nd, uint32_t nadd)
+    {
+    while ( nadd > 0 )
+        {
+        uint32_t start;
+        uint32_t got;
+        if ( nd->last >= 0 )
+            {
+            struct ram_extent *ext = &ram->ext[nd->last];
+            start = ext->start + ext->nblock;
+            got = ram_run (ram, start, nadd);
+            if ( got > 0 )
+                {
+                ram_mark (ram, start, got, true);
+                ext->nblock += got;
+                nd->nblock += got;
+                nadd -= got;
+                continue;
+                }
+            }
+        if ( ram->ext_free < 0 ) break;
+        got = ram_fit (ram, nadd, &start);
+        if ( got == 0 ) break;
+        int ie = ram->ext_free;
+        struct ram_extent *ext = &ram->ext[ie];
+        ram->ext_free = ext->next;
+        ext->start = start;
+        ext->nblock = got;
+        ext->next = -1;
+        if ( nd->last >= 0 ) ram->ext[nd->last].next = ie;
+        else nd->first = ie;
+        nd->last = ie;
+        ram_mark (ram, start, got, true);
+        nd->nblock += got;
+        nadd -= got;
+        }
+    }
+
+// Release all the data of a file
+STATIC void ram_truncate (struct ram_pfs *ram, struct ram_node *nd)
+    {
+    int ie = nd->first;
+    while ( ie >= 0 )
+        {
+        struct ram_extent *ext = &ram->ext[ie];
+        int next = ext->next;
+        ram_mark (ram, ext->start, ext->nblock, false);
+        ext->next = ram->ext_free;
+        ram->ext_free = ie;
+        ie = next;
+        }
+    nd->first = -1;
+    nd->last = -1;
+    nd->size = 0;
+    nd->nblock = 0;
+    ++nd->gen;
+    }
+
+// Locate a position (within the blocks allocated) in a file. Returns a
+// pointer to the data, and the number of contiguous bytes from there.
+// Sequential access continues from the extent last used
+STATIC uint8_t *ram_locate (struct ram_file *fd, uint32_t pos, uint32_t *pnbyte)
+    {
+    struct ram_pfs *ram = fd->ram;
+    struct ram_node *nd = &ram->node[fd->node];
+    if (( fd->gen != nd->gen ) || ( fd->ext < 0 ) || ( pos < fd->base ))
+        {
+        fd->gen = nd->gen;
+        fd->ext = nd->first;
+        fd->base = 0;
+        }
+    while ( true )
+        {
+        struct ram_extent *ext = &ram->ext[fd->ext];
+        uint32_t len = ext->nblock * RAM_BLOCK_SIZE;
+        if ( pos - fd->base < len )
+            {
+            *pnbyte = len - ( pos - fd->base );
+            return &ram->data[ext->start * RAM_BLOCK_SIZE + pos - fd->base];
+            }
+        fd->base += len;
+        fd->ext = ext->next;
+        }
+    }
+
+// Copy between a buffer and a file. If buffer is NULL, writes zeros
+STATIC void ram_copy (struct ram_file *fd, uint32_t pos, char *buffer, uint32_t nbyte, bool bWrite)
+    {
+    while ( nbyte > 0 )
+        {
+        uint32_t nrun;
+        uint8_t *ptr = ram_locate (fd, pos, &nrun);
+        if ( nrun > nbyte ) nrun = nbyte;
+        if ( ! bWrite ) memcpy (buffer, ptr, nrun);
+        else if ( buffer != NULL ) memcpy (ptr, buffer, nrun);
+        else memset (ptr, 0, nrun);
+        if ( buffer != NULL ) buffer += nrun;
+        pos += nrun;
+        nbyte -= nrun;
+        }
+    }
+
+// Nodes and path names
+
+STATIC int ram_child (struct ram_pfs *ram, int dir, const char *name, int nlen)
+    {
+    for (int i = 1; i < ram->nnode; ++i)
+        {
+        struct ram_node *nd = &ram->node[i];
+        if (( nd->parent == dir ) && ( strncmp (nd->name, name, nlen) == 0 ) && ( nd->name[nlen] == '\0' ))
+            return i;
+        }
+    return -1;
+    }
+
+// Find the node for a path name. Returns -1 if not found. *pdir is set to
+// the directory which contains (or would contain) the last name in the
+// path, or -1 if the path to it does not exist. *pleaf and *pnlen are set
+// to the last name
+STATIC int ram_find (struct ram_pfs *ram, const char *path, int *pdir, const char **pleaf, int *pnlen)
+    {
+    int node = 0;
+    int dir = -1;
+    *pleaf = NULL;
+    *pnlen = 0;
+    while ( true )
+        {
+        while ( *path == '/' ) ++path;
+        if ( *path == '\0' ) break;
+        if (( node < 0 ) || ( ! S_ISDIR (ram->node[node].mode) ))
+            {
+            dir = -1;
+            node = -1;
+            break;
+            }
+        int nlen = strcspn (path, "/");
+        dir = node;
+        *pleaf = path;
+        *pnlen = nlen;
+        node = ram_child (ram, dir, path, nlen);
+        path += nlen;
+        }
+    *pdir = dir;
+    return node;
+    }
+
+// Create a new node in directory dir. Returns -1 (with errno set) on failure
+STATIC int ram_create (struct ram_pfs *ram, int dir, const char *name, int nlen, mode_t mode)
+    {
+    if ( dir < 0 ) return pfs_error (ENOENT);
+    if ( nlen > RAM_NAME_MAX ) return pfs_error (ENAMETOOLONG);
+    for (int i = 1; i < ram->nnode; ++i)
+        {
+        struct ram_node *nd = &ram->node[i];
+        if ( nd->parent == RAM_FREE )
+            {
+            memset (nd, 0, sizeof (struct ram_node));
+            memcpy (nd->name, name, nlen);
+            nd->name[nlen] = '\0';
+            nd->parent = dir;
+            nd->mode = mode;
+            nd->first = -1;
+            nd->last = -1;
+            return i;
+            }
+        }
+    return pfs_error (ENOSPC);
+    }
+
+STATIC void ram_remove (struct ram_pfs *ram, int node)
+    {
+    struct ram_node *nd = &ram->node[node];
+    if ( nd->nopen > 0 )
+        {
+        // Data kept until the last handle is closed
+        nd->parent = RAM_UNLINKED;
+        return;
+        }
+    ram_truncate (ram, nd);
+    nd->parent = RAM_FREE;
+    }
+
+STATIC void ram_node_stat (struct ram_node *nd, struct stat *buf)
+    {
+    memset (buf, 0, sizeof (struct stat));
+    buf->st_size = nd->size;
+    buf->st_blksize = RAM_BLOCK_SIZE;
+    buf->st_blocks = nd->nblock;
+    buf->st_nlink = 1;
+    buf->st_mode = nd->mode;
+    }
+
+// File operations
+
+STATIC struct pfs_file *ram_open (struct pfs_pfs *pfs, const char *fn, int oflag)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    const char *leaf;
+    int nlen;
+    int dir;
+    int node = ram_find (ram, fn, &dir, &leaf, &nlen);
+    if ( node < 0 )
+        {
+        if ( ! ( oflag & O_CREAT ) )
+            {
+            pfs_error (ENOENT);
+            return NULL;
+            }
+        if (( dir >= 0 ) && ( leaf[nlen] == '/' ))
+            {
+            pfs_error (EISDIR);
+            return NULL;
+            }
+        node = ram_create (ram, dir, leaf, nlen, S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO);
+        if ( node < 0 ) return NULL;
+        }
+    else if (( oflag & O_CREAT ) && ( oflag & O_EXCL ))
+        {
+        pfs_error (EEXIST);
+        return NULL;
+        }
+    else if ( S_ISDIR (ram->node[node].mode) )
+        {
+        pfs_error (EISDIR);
+        return NULL;
+        }
+    struct ram_file *fd = (struct ram_file *) malloc (sizeof (struct ram_file));
+    if ( fd == NULL )
+        {
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    struct ram_node *nd = &ram->node[node];
+    if (( oflag & O_TRUNC ) && (( oflag & O_ACCMODE ) != O_RDONLY )) ram_truncate (ram, nd);
+    ++nd->nopen;
+    fd->entry = &ram_v_file;
+    fd->ram = ram;
+    fd->node = node;
+    fd->oflag = oflag;
+    fd->pos = 0;
+    fd->ext = -1;
+    fd->base = 0;
+    fd->gen = nd->gen;
+    return (struct pfs_file *) fd;
+    }
+
+STATIC int ram_close (struct pfs_file *pfs_fd)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    struct ram_pfs *ram = fd->ram;
+    struct ram_node *nd = &ram->node[fd->node];
+    if (( --nd->nopen == 0 ) && ( nd->parent == RAM_UNLINKED )) ram_remove (ram, fd->node);
+    return 0;
+    }
+
+STATIC int ram_read (struct pfs_file *pfs_fd, char *buffer, int length)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    struct ram_node *nd = &fd->ram->node[fd->node];
+    if (( fd->oflag & O_ACCMODE ) == O_WRONLY ) return pfs_error (EBADF);
+    if (( length <= 0 ) || ( fd->pos >= nd->size )) return 0;
+    if ( length > nd->size - fd->pos ) length = nd->size - fd->pos;
+    ram_copy (fd, fd->pos, buffer, length, false);
+    fd->pos += length;
+    return length;
+    }
+
+STATIC int ram_write (struct pfs_file *pfs_fd, char *buffer, int length)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    struct ram_pfs *ram = fd->ram;
+    struct ram_node *nd = &ram->node[fd->node];
+    if (( fd->oflag & O_ACCMODE ) == O_RDONLY ) return pfs_error (EBADF);
+    if ( fd->oflag & O_APPEND ) fd->pos = nd->size;
+    if ( length <= 0 ) return 0;
+    if ( length > INT32_MAX - fd->pos ) return pfs_error (EFBIG);
+    uint32_t end = fd->pos + length;
+    uint32_t cap = nd->nblock * RAM_BLOCK_SIZE;
+    if ( end > cap )
+        {
+        ram_grow (ram, nd, ( end - cap + RAM_BLOCK_SIZE - 1 ) / RAM_BLOCK_SIZE);
+        cap = nd->nblock * RAM_BLOCK_SIZE;
+        if ( cap <= fd->pos ) return pfs_error (ENOSPC);
+        if ( end > cap ) end = cap;
+        }
+    // Data beyond the old end of the file reads as zero
+    if ( fd->pos > nd->size ) ram_copy (fd, nd->size, NULL, fd->pos - nd->size, true);
+    ram_copy (fd, fd->pos, buffer, end - fd->pos, true);
+    length = end - fd->pos;
+    fd->pos = end;
+    if ( end > nd->size ) nd->size = end;
+    return length;
+    }
+
+STATIC long ram_lseek (struct pfs_file *pfs_fd, long pos, int whence)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    struct ram_node *nd = &fd->ram->node[fd->node];
+    switch (whence)
+        {
+        case SEEK_SET: break;
+        case SEEK_CUR: pos += fd->pos; break;
+        case SEEK_END: pos += nd->size; break;
+        default: return pfs_error (EINVAL);
+        }
+    if (( pos < 0 ) || ( pos > INT32_MAX )) return pfs_error (EINVAL);
+    fd->pos = pos;
+    return pos;
+    }
+
+STATIC int ram_fstat (struct pfs_file *pfs_fd, struct stat *buf)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    ram_node_stat (&fd->ram->node[fd->node], buf);
+    return 0;
+    }
+
+// Volume operations
+
+STATIC int ram_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    const char *leaf;
+    int nlen;
+    int dir;
+    int node = ram_find (ram, name, &dir, &leaf, &nlen);
+    if ( node < 0 ) return pfs_error (ENOENT);
+    ram_node_stat (&ram->node[node], buf);
+    return 0;
+    }
+
+STATIC int ram_rename (struct pfs_pfs *pfs, const char *old, const char *new)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    const char *leaf;
+    int nlen;
+    int dir;
+    int node = ram_find (ram, old, &dir, &leaf, &nlen);
+    if ( node <= 0 ) return pfs_error (( node == 0 ) ? EBUSY : ENOENT);
+    int target = ram_find (ram, new, &dir, &leaf, &nlen);
+    if ( dir < 0 ) return pfs_error (ENOENT);
+    if ( nlen > RAM_NAME_MAX ) return pfs_error (ENAMETOOLONG);
+    if ( target == node ) return 0;
+    // A directory cannot be moved inside itself
+    for (int up = dir; up > 0; up = ram->node[up].parent)
+        {
+        if ( up == node ) return pfs_error (EINVAL);
+        }
+    if ( target >= 0 )
+        {
+        // Replace an existing file
+        if ( S_ISDIR (ram->node[target].mode) || S_ISDIR (ram->node[node].mode) ) return pfs_error (EEXIST);
+        ram_remove (ram, target);
+        }
+    struct ram_node *nd = &ram->node[node];
+    memcpy (nd->name, leaf, nlen);
+    nd->name[nlen] = '\0';
+    nd->parent = dir;
+    return 0;
+    }
+
+STATIC int ram_delete (struct pfs_pfs *pfs, const char *name)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    const char *leaf;
+    int nlen;
+    int dir;
+    int node = ram_find (ram, name, &dir, &leaf, &nlen);
+    if ( node < 0 ) return pfs_error (ENOENT);
+    if ( S_ISDIR (ram->node[node].mode) ) return pfs_error (EISDIR);
+    ram_remove (ram, node);
+    return 0;
+    }
+
+STATIC int ram_mkdir (struct pfs_pfs *pfs, const char *pathname, mode_t mode)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    const char *leaf;
+    int nlen;
+    int dir;
+    int node = ram_find (ram, pathname, &dir, &leaf, &nlen);
+    if ( node >= 0 ) return pfs_error (EEXIST);
+    node = ram_create (ram, dir, leaf, nlen, S_IFDIR | ( mode & ( S_IRWXU | S_IRWXG | S_IRWXO )));
+    return ( node >= 0 ) ? 0 : -1;
+    }
+
+STATIC int ram_rmdir (struct pfs_pfs *pfs, const char *pathname)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    const char *leaf;
+    int nlen;
+    int dir;
+    int node = ram_find (ram, pathname, &dir, &leaf, &nlen);
+    if ( node < 0 ) return pfs_error (ENOENT);
+    if ( node == 0 ) return pfs_error (EBUSY);
+    if ( ! S_ISDIR (ram->node[node].mode) ) return pfs_error (ENOTDIR);
+    for (int i = 1; i < ram->nnode; ++i)
+        {
+        if ( ram->node[i].parent == node ) return pfs_error (ENOTEMPTY);
+        }
+    ram_remove (ram, node);
+    return 0;
+    }
+
+STATIC void *ram_opendir (struct pfs_pfs *pfs, const char *name)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    const char *leaf;
+    int nlen;
+    int dir;
+    int node = ram_find (ram, name, &dir, &leaf, &nlen);
+    if ( node < 0 )
+        {
+        pfs_error (ENOENT);
+        return NULL;
+        }
+    if ( ! S_ISDIR (ram->node[node].mode) )
+        {
+        pfs_error (ENOTDIR);
+        return NULL;
+        }
+    struct ram_dir *dd = (struct ram_dir *) malloc (sizeof (struct ram_dir));
+    if ( dd == NULL )
+        {
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    dd->entry = &ram_v_dir;
+    dd->ram = ram;
+    dd->dir = node;
+    dd->next = 1;
+    return (void *) dd;
+    }
+
+STATIC struct dirent *ram_readdir (void *dirp)
+    {
+    struct ram_dir *dd = (struct ram_dir *) dirp;
+    struct ram_pfs *ram = dd->ram;
+    while ( dd->next < ram->nnode )
+        {
+        struct ram_node *nd = &ram->node[dd->next];
+        ++dd->next;
+        if ( nd->parent == dd->dir )
+            {
+            strcpy (dd->de.d_name, nd->name);
+            return &dd->de;
+            }
+        }
+    return NULL;
+    }
+
+STATIC int ram_closedir (void *dirp)
+    {
+    return 0;
+    }
+
+STATIC int ram_chmod (struct pfs_pfs *pfs, const char *pathname, mode_t mode)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    const char *leaf;
+    int nlen;
+    int dir;
+    int node = ram_find (ram, pathname, &dir, &leaf, &nlen);
+    if ( node < 0 ) return pfs_error (ENOENT);
+    struct ram_node *nd = &ram->node[node];
+    nd->mode = ( nd->mode & S_IFMT ) | ( mode & ( S_IRWXU | S_IRWXG | S_IRWXO ));
+    return 0;
+    }
+
+struct pfs_pfs *pfs_ram_create (int size)
+    {
+    // Divide the arena between the tables and the data blocks
+    int nnode = size / RAM_NODE_BYTES;
+    if ( nnode < RAM_MIN_NODES ) nnode = RAM_MIN_NODES;
+    int nextent = RAM_EXTENTS * nnode;
+    size_t meta = sizeof (struct ram_pfs) + nnode * sizeof (struct ram_node)
+        + nextent * sizeof (struct ram_extent);
+    meta = ( meta + 7 ) & ~7;
+    if (( size < 0 ) || ( (size_t) size < meta + 4 + RAM_BLOCK_SIZE ))
+        {
+        pfs_error (EINVAL);
+        return NULL;
+        }
+    uint32_t nblock = 8 * ( size - meta - 4 ) / ( 8 * RAM_BLOCK_SIZE + 1 );
+    uint32_t nmap = ( nblock + 31 ) / 32;
+    uint8_t *arena = (uint8_t *) malloc (size);
+    if ( arena == NULL )
+        {
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    struct ram_pfs *ram = (struct ram_pfs *) arena;
+    ram->entry = &ram_v_pfs;
+    ram->nnode = nnode;
+    ram->nextent = nextent;
+    ram->nblock = nblock;
+    ram->nfree = nblock;
+    ram->node = (struct ram_node *) ( arena + sizeof (struct ram_pfs) );
+    ram->ext = (struct ram_extent *) &ram->node[nnode];
+    ram->map = (uint32_t *) ( arena + meta );
+    ram->data = (uint8_t *) &ram->map[nmap];
+    memset (ram->node, 0, nnode * sizeof (struct ram_node));
+    for (int i = 0; i < nnode; ++i)
+        {
+        ram->node[i].parent = RAM_FREE;
+        }
+    ram->node[0].parent = 0;       // The root is its own parent
+    ram->node[0].mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
+    ram->node[0].first = -1;
+    ram->node[0].last = -1;
+    for (int i = 0; i < nextent; ++i)
+        {
+        ram->ext[i].next = ( i < nextent - 1 ) ? i + 1 : -1;
+        }
+    ram->ext_free = 0;
+    // Blocks beyond nblock in the last map word are marked used
+    memset (ram->map, 0, nmap * sizeof (uint32_t));
+    for (uint32_t block = nblock; block < 32 * nmap; ++block)
+        {
+        ram->map[block / 32] |= 1u << ( block % 32 );
+        }
+    return (struct pfs_pfs *) ram;
+    }
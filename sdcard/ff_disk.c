@@ -2,15 +2,25 @@
 // Copyright (c) 2023, Memotech-Bill
 // SPDX-License-Identifier: BSD-3-Clause
 
+#ifdef SD_SPI_MODEL
+#include "sd_spi_hw.h"      // Host build, using the SD card model
+#else
 #include <pico.h>
 #include <pico/stdlib.h>
 #include <pico/types.h>
+#include <pico/mutex.h>
 #include <hardware/rtc.h>
+#endif
+#include <string.h>
 #include <../fatfs/ff.h>
 #include <../fatfs/diskio.h>
+#include "ff_disk.h"
 
 #define USE_SPI     // Never managed to make SD card mode from Pico SDK work
-static uint32_t lba_base = 0;
+#ifndef SD_CALIBRATE
+#define SD_CALIBRATE    0   // Number of test reads used to calibrate SD clock (0 = no calibration)
+#endif
+#define SD_MAX_SECTOR   0x100000000ull  // SPI mode commands address at most 2^32 blocks (2TB)
 
 // #define DEBUG
 #ifdef DEBUG
@@ -52,146 +62,579 @@ void hexdump (BYTE *ptr, int n)
 
 static int iStat = STA_NOINIT;
 
+// FatFs locks each volume separately, but volumes on the card share the
+// SPI driver, sector cache and discard queue, so serialise access to them
+auto_init_mutex (sd_mutex);
+
+// Sector cache. FAT and directory sectors (those read into the FatFs volume
+// window) are held separately from file data, so that streaming file data
+// does not evict them.
+
+#ifndef SD_CACHE_META
+#define SD_CACHE_META   4   // Number of cached FAT and directory sectors
+#endif
+#ifndef SD_CACHE_DATA
+#define SD_CACHE_DATA   4   // Number of cached file data sectors
+#endif
+#ifndef SD_CACHE_WBACK
+#define SD_CACHE_WBACK  0   // 0 = Write through, 1 = Write back (until sync or eviction)
+#endif
+
+#define SD_CACHE_SIZE   ( SD_CACHE_META + SD_CACHE_DATA )
+
+#if SD_CACHE_SIZE > 0
+struct sd_cache
+    {
+    LBA_t       sector;
+    uint32_t    stamp;      // Time of last use (0 = empty)
+    bool        dirty;
+    BYTE        data[512];
+    };
+
+static struct sd_cache sd_cache[SD_CACHE_SIZE];    // Metadata entries first
+static uint32_t cache_tick = 0;
+static const BYTE *cache_win[FF_VOLUMES];          // Window buffers of mounted volumes
+static DWORD cache_hits = 0;
+static DWORD cache_misses = 0;
+
+static struct sd_cache *cache_find (LBA_t sector)
+    {
+    for (int i = 0; i < SD_CACHE_SIZE; ++i)
+        {
+        if (( sd_cache[i].stamp != 0 ) && ( sd_cache[i].sector == sector )) return &sd_cache[i];
+        }
+    return NULL;
+    }
+
+static void ra_discard (LBA_t start, LBA_t end);
+
+static bool cache_flush_entry (struct sd_cache *pc)
+    {
+    if ( pc->dirty )
+        {
+        ra_discard (pc->sector, pc->sector + 1);
+        if ( ! sd_spi_write (pc->sector, pc->data) ) return false;
+        pc->dirty = false;
+        }
+    return true;
+    }
+
+static bool cache_flush (void)
+    {
+    bool bOK = true;
+    for (int i = 0; i < SD_CACHE_SIZE; ++i)
+        {
+        if (( sd_cache[i].stamp != 0 ) && ( ! cache_flush_entry (&sd_cache[i]) )) bOK = false;
+        }
+    return bOK;
+    }
+
+static bool cache_is_window (const BYTE *buff)
+    {
+    for (int i = 0; i < FF_VOLUMES; ++i)
+        {
+        if ( buff == cache_win[i] ) return true;
+        }
+    return false;
+    }
+
+// Find the least recently used entry for metadata or file data, writing
+// it back if necessary. Returns NULL if that type of sector is not cached
+static struct sd_cache *cache_victim (const BYTE *buff)
+    {
+    int i1 = 0;
+    int i2 = SD_CACHE_SIZE;
+    if (( SD_CACHE_META > 0 ) && cache_is_window (buff)) i2 = SD_CACHE_META;
+    else if ( SD_CACHE_DATA > 0 ) i1 = SD_CACHE_META;
+    else return NULL;
+    struct sd_cache *pc = &sd_cache[i1];
+    for (int i = i1 + 1; i < i2; ++i)
+        {
+        if ( sd_cache[i].stamp < pc->stamp ) pc = &sd_cache[i];
+        }
+    if (( pc->stamp != 0 ) && ( ! cache_flush_entry (pc) )) return NULL;
+    pc->stamp = 0;
+    return pc;
+    }
+
+static void cache_use (struct sd_cache *pc, LBA_t sector)
+    {
+    pc->sector = sector;
+    pc->stamp = ++cache_tick;
+    }
+
+void disk_cache_window (BYTE pdrv, const BYTE *win, bool bUsed)
+    {
+    mutex_enter_blocking (&sd_mutex);
+    for (int i = 0; i < FF_VOLUMES; ++i)
+        {
+        if ( cache_win[i] == ( bUsed ? NULL : win ))
+            {
+            cache_win[i] = bUsed ? win : NULL;
+            break;
+            }
+        }
+    mutex_exit (&sd_mutex);
+    }
+
+void disk_cache_stats (BYTE pdrv, DWORD *hits, DWORD *misses)
+    {
+    *hits = cache_hits;
+    *misses = cache_misses;
+    }
+#else
+void disk_cache_window (BYTE pdrv, const BYTE *win, bool bUsed)
+    {
+    }
+
+void disk_cache_stats (BYTE pdrv, DWORD *hits, DWORD *misses)
+    {
+    *hits = 0;
+    *misses = 0;
+    }
+#endif
+
+// Read ahead buffers. When a file is being read sequentially, pfs_fat.c
+// asks for the following sectors of the file, which are then fetched with
+// a single multiple block read instead of a command for each sector.
+
+#ifndef SD_READ_AHEAD
+#define SD_READ_AHEAD   8   // Sectors in each read ahead buffer (0 = no read ahead)
+#endif
+#ifndef SD_RA_BUFFERS
+#define SD_RA_BUFFERS   2   // Number of read ahead buffers (files streamed at once)
+#endif
+
+#if SD_READ_AHEAD > 0
+struct sd_ra
+    {
+    LBA_t       start;      // First sector held
+    UINT        count;      // Number of sectors held (0 = empty)
+    uint32_t    stamp;      // Time of last use
+    BYTE        data[SD_READ_AHEAD * 512];
+    };
+
+static struct sd_ra sd_ra[SD_RA_BUFFERS];
+static uint32_t ra_tick = 0;
+static DWORD ra_reads = 0;
+static DWORD ra_hits = 0;
+
+static struct sd_ra *ra_find (LBA_t sector)
+    {
+    for (int i = 0; i < SD_RA_BUFFERS; ++i)
+        {
+        if (( sd_ra[i].count > 0 ) && ( sector >= sd_ra[i].start )
+            && ( sector < sd_ra[i].start + sd_ra[i].count )) return &sd_ra[i];
+        }
+    return NULL;
+    }
+
+// Copy sectors from a read ahead buffer, if they are all held
+static bool ra_copy (BYTE *buff, LBA_t sector, UINT count)
+    {
+    struct sd_ra *pr = ra_find (sector);
+    if (( pr == NULL ) || ( sector + count > pr->start + pr->count )) return false;
+    memcpy (buff, pr->data + 512 * ( sector - pr->start ), 512 * count);
+    pr->stamp = ++ra_tick;
+    ++ra_hits;
+    return true;
+    }
+
+// Forget sectors about to be written or erased
+static void ra_discard (LBA_t start, LBA_t end)
+    {
+    for (int i = 0; i < SD_RA_BUFFERS; ++i)
+        {
+        if (( sd_ra[i].count > 0 ) && ( start < sd_ra[i].start + sd_ra[i].count )
+            && ( end > sd_ra[i].start )) sd_ra[i].count = 0;
+        }
+    }
+
+void disk_read_ahead (BYTE pdrv, LBA_t sector, UINT count)
+    {
+    mutex_enter_blocking (&sd_mutex);
+    // Clip to the end of the card, and to the sectors SPI commands can address
+    QWORD limit = sd_spi_sectors ();
+    if (( limit == 0 ) || ( limit > SD_MAX_SECTOR )) limit = SD_MAX_SECTOR;
+    if ( count > SD_READ_AHEAD ) count = SD_READ_AHEAD;
+    if ( (QWORD) sector >= limit ) count = 0;
+    else if ( (QWORD) sector + count > limit ) count = limit - sector;
+    if (( pdrv == 0 ) && ! ( iStat & STA_NOINIT ) && ( count > 0 ) && ( ra_find (sector) == NULL ))
+        {
+        struct sd_ra *pr = &sd_ra[0];
+        for (int i = 1; i < SD_RA_BUFFERS; ++i)
+            {
+            if ( sd_ra[i].stamp < pr->stamp ) pr = &sd_ra[i];
+            }
+#ifdef DEBUG
+        printf ("Read ahead sectors 0x%04X - 0x%04X\n", (uint) sector, (uint) ( sector + count - 1 ));
+#endif
+        pr->start = sector;
+        pr->count = sd_spi_read_blocks (sector, pr->data, count) ? count : 0;
+        pr->stamp = ++ra_tick;
+        ++ra_reads;
+        }
+    mutex_exit (&sd_mutex);
+    }
+
+void disk_read_ahead_stats (BYTE pdrv, DWORD *reads, DWORD *hits)
+    {
+    *reads = ra_reads;
+    *hits = ra_hits;
+    }
+#else
+static void ra_discard (LBA_t start, LBA_t end)
+    {
+    }
+
+void disk_read_ahead (BYTE pdrv, LBA_t sector, UINT count)
+    {
+    }
+
+void disk_read_ahead_stats (BYTE pdrv, DWORD *reads, DWORD *hits)
+    {
+    *reads = 0;
+    *hits = 0;
+    }
+#endif
+
+// Queue of discarded sector ranges (from FatFs CTRL_TRIM) waiting to be
+// erased. Erasing is deferred so that deleting a large file does not stall,
+// adjacent ranges are merged, and sectors rewritten before the erase is
+// issued are removed from the queue.
+
+#ifndef SD_TRIM_QUEUE
+#define SD_TRIM_QUEUE   8       // Number of queued ranges (0 = erase immediately)
+#endif
+#ifndef SD_TRIM_CHUNK
+#define SD_TRIM_CHUNK   8192    // Maximum sectors erased by one command (4MB)
+#endif
+
+#if SD_TRIM_QUEUE > 0
+struct sd_trim
+    {
+    LBA_t       start;      // First sector
+    LBA_t       end;        // Sector after the last
+    };
+
+static struct sd_trim sd_trim[SD_TRIM_QUEUE];   // Oldest first
+static int trim_count = 0;
+
+static void trim_remove (int i)
+    {
+    --trim_count;
+    memmove (&sd_trim[i], &sd_trim[i + 1], ( trim_count - i ) * sizeof (struct sd_trim));
+    }
+
+// Erase up to nmax sectors from the start of a queued range
+static DWORD trim_issue (int i, DWORD nmax)
+    {
+    LBA_t count = sd_trim[i].end - sd_trim[i].start;
+    if ( count > nmax ) count = nmax;
+    if ( ! sd_spi_erase (sd_trim[i].start, count) )
+        {
+        // Erase is only advisory, so give up on this range
+        trim_remove (i);
+        return count;
+        }
+    sd_trim[i].start += count;
+    if ( sd_trim[i].start >= sd_trim[i].end ) trim_remove (i);
+    return count;
+    }
+
+// Merge any other ranges which overlap or adjoin range i into it
+static void trim_coalesce (int i)
+    {
+    bool bMerged = true;
+    while ( bMerged )
+        {
+        bMerged = false;
+        for (int j = 0; j < trim_count; ++j)
+            {
+            if (( j == i ) || ( sd_trim[j].start > sd_trim[i].end ) || ( sd_trim[j].end < sd_trim[i].start ))
+                continue;
+            if ( sd_trim[j].start < sd_trim[i].start ) sd_trim[i].start = sd_trim[j].start;
+            if ( sd_trim[j].end > sd_trim[i].end ) sd_trim[i].end = sd_trim[j].end;
+            trim_remove (j);
+            if ( j < i ) --i;
+            bMerged = true;
+            break;
+            }
+        }
+    }
+
+static void trim_add (LBA_t start, LBA_t end)
+    {
+    for (int i = 0; i < trim_count; ++i)
+        {
+        if (( start <= sd_trim[i].end ) && ( end >= sd_trim[i].start ))
+            {
+            // Merge with an overlapping or adjacent range
+            if ( start < sd_trim[i].start ) sd_trim[i].start = start;
+            if ( end > sd_trim[i].end ) sd_trim[i].end = end;
+            trim_coalesce (i);
+            return;
+            }
+        }
+    if ( trim_count >= SD_TRIM_QUEUE )
+        {
+        // Queue full. Erasing is only advisory, so rather than stall here
+        // erasing a range, forget the smallest (which may be the new one).
+        // Ranges cannot be widened to merge, as the sectors between them
+        // may be in use
+        int ismall = 0;
+        for (int i = 1; i < trim_count; ++i)
+            {
+            if ( sd_trim[i].end - sd_trim[i].start < sd_trim[ismall].end - sd_trim[ismall].start ) ismall = i;
+            }
+        if ( end - start <= sd_trim[ismall].end - sd_trim[ismall].start ) return;
+        trim_remove (ismall);
+        }
+    sd_trim[trim_count].start = start;
+    sd_trim[trim_count].end = end;
+    ++trim_count;
+    }
+
+// Remove sectors about to be written from the queue
+static void trim_cut (LBA_t start, LBA_t end)
+    {
+    for (int i = trim_count - 1; i >= 0; --i)
+        {
+        struct sd_trim *pt = &sd_trim[i];
+        if (( start >= pt->end ) || ( end <= pt->start )) continue;
+        if (( start <= pt->start ) && ( end >= pt->end ))
+            {
+            trim_remove (i);
+            }
+        else if ( start <= pt->start )
+            {
+            pt->start = end;
+            }
+        else if ( end >= pt->end )
+            {
+            pt->end = start;
+            }
+        else if ( trim_count < SD_TRIM_QUEUE )
+            {
+            // Split the range, the tail goes to the end of the queue
+            sd_trim[trim_count].start = end;
+            sd_trim[trim_count].end = pt->end;
+            ++trim_count;
+            pt->end = start;
+            }
+        else if ( start - pt->start >= pt->end - end )
+            {
+            // No room to split, keep the larger part
+            pt->end = start;
+            }
+        else
+            {
+            pt->start = end;
+            }
+        }
+    }
+
+bool disk_trim_flush (BYTE pdrv, DWORD nmax)
+    {
+    mutex_enter_blocking (&sd_mutex);
+    DWORD ndone = 0;
+    while (( pdrv == 0 ) && ! ( iStat & STA_NOINIT ) && ( trim_count > 0 )
+        && (( nmax == 0 ) || ( ndone < nmax )))
+        {
+        DWORD nsect = SD_TRIM_CHUNK;
+        if (( nmax > 0 ) && ( nmax - ndone < nsect )) nsect = nmax - ndone;
+        ndone += trim_issue (0, nsect);
+        }
+    bool bDone = ( trim_count == 0 );
+    mutex_exit (&sd_mutex);
+    return bDone;
+    }
+#else
+bool disk_trim_flush (BYTE pdrv, DWORD nmax)
+    {
+    return true;
+    }
+#endif
+
 DSTATUS disk_status (BYTE pdrv)
     {
 #ifdef DEBUG
     printf ("disk_status (%d) = 0x%02X\n", pdrv, iStat);
 #endif
+    if ( pdrv != 0 ) return STA_NOINIT;
     return iStat;
     }
 
-DRESULT disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
+static DRESULT sd_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
     {
 #ifdef DEBUG
-    printf ("disk_read (%d, %p, 0x%04X, %d)\n", pdrv, buff, sector, count);
+    printf ("disk_read (%d, %p, 0x%04X, %d)\n", pdrv, buff, (uint) sector, count);
 #endif
-    if ( iStat & STA_NOINIT )
+    if (( pdrv != 0 ) || ( iStat & STA_NOINIT ))
         {
 #ifdef DEBUG
         printf ("Media not ready\n");
 #endif
         return RES_NOTRDY;
         }
-    if (( buff == NULL ) || ( count == 0 ))
+    if (( buff == NULL ) || ( count == 0 ) || ( (QWORD) sector + count > SD_MAX_SECTOR ))
         {
 #ifdef DEBUG
         printf ("Parameter error\n");
 #endif
         return RES_PARERR;
         }
-    sector += lba_base;
-    for (int i = 0; i < count; ++i)
+#if SD_CACHE_SIZE > 0
+    if ( count == 1 )
         {
-#ifdef DEBUG
-        printf ("Read sector 0x%04X\n", sector);
+        struct sd_cache *pc = cache_find (sector);
+        if ( pc != NULL )
+            {
+            ++cache_hits;
+            memcpy (buff, pc->data, 512);
+            cache_use (pc, sector);
+            return RES_OK;
+            }
+#if SD_READ_AHEAD > 0
+        if ( ra_copy (buff, sector, 1) ) return RES_OK;
 #endif
-        if ( ! sd_spi_read (sector, buff) )
+        ++cache_misses;
+        pc = cache_victim (buff);
+        if ( pc != NULL )
             {
 #ifdef DEBUG
-            printf ("Read error\n");
+            printf ("Read sector 0x%04X to cache\n", (uint) sector);
 #endif
-            return RES_ERROR;
+            if ( ! sd_spi_read (sector, pc->data) ) return RES_ERROR;
+            memcpy (buff, pc->data, 512);
+            cache_use (pc, sector);
+            return RES_OK;
             }
+        }
+#endif
 #ifdef DEBUG
-        printf ("Sector 0x%04X: ");
-        hexline (buff, 16);
-        // hexdump (buff, 512);
+    printf ("Read sectors 0x%04X - 0x%04X\n", (uint) sector, (uint) ( sector + count - 1 ));
 #endif
-        ++sector;
-        buff += 512;
+#if SD_READ_AHEAD > 0
+    if ( ! ra_copy (buff, sector, count) )
+#endif
+    if ( ! sd_spi_read_blocks (sector, buff, count) )
+        {
+#ifdef DEBUG
+        printf ("Read error\n");
+#endif
+        return RES_ERROR;
+        }
+#if SD_CACHE_SIZE > 0
+    // Cached copies may be newer than the card
+    for (int i = 0; i < SD_CACHE_SIZE; ++i)
+        {
+        if (( sd_cache[i].stamp != 0 ) && ( sd_cache[i].sector >= sector )
+            && ( sd_cache[i].sector < sector + count ))
+            {
+            memcpy (buff + 512 * ( sd_cache[i].sector - sector ), sd_cache[i].data, 512);
+            }
         }
+#endif
+#ifdef DEBUG
+    printf ("Sector 0x%04X: ", (uint) sector);
+    hexline (buff, 16);
+    // hexdump (buff, 512);
+#endif
     return RES_OK;
     }
 
-DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
+static DRESULT sd_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
     {
 #ifdef DEBUG
-    printf ("disk_write (%d, %p, 0x%04X, %d)\n", pdrv, buff, sector, count);
+    printf ("disk_write (%d, %p, 0x%04X, %d)\n", pdrv, buff, (uint) sector, count);
 #endif
-    if ( iStat & STA_NOINIT )
+    if (( pdrv != 0 ) || ( iStat & STA_NOINIT ))
         {
 #ifdef DEBUG
         printf ("Media not ready\n");
 #endif
         return RES_NOTRDY;
         }
-    if (( buff == NULL ) || ( count == 0 ))
+    if (( buff == NULL ) || ( count == 0 ) || ( (QWORD) sector + count > SD_MAX_SECTOR ))
         {
 #ifdef DEBUG
         printf ("Parameter error\n");
 #endif
         return RES_PARERR;
         }
-    sector += lba_base;
-    for (int i = 0; i < count; ++i)
-        {
-#ifdef DEBUG
-        printf ("Write sector 0x%04X\n", sector);
+    ra_discard (sector, sector + count);
+#if SD_TRIM_QUEUE > 0
+    trim_cut (sector, sector + count);
 #endif
-        if ( ! sd_spi_write (sector, buff) )
+#if SD_CACHE_WBACK && ( SD_CACHE_SIZE > 0 )
+    if ( count == 1 )
+        {
+        struct sd_cache *pc = cache_find (sector);
+        if ( pc == NULL ) pc = cache_victim (buff);
+        if ( pc != NULL )
             {
 #ifdef DEBUG
-            printf ("Write error\n");
+            printf ("Write sector 0x%04X to cache\n", (uint) sector);
 #endif
-            return RES_ERROR;
+            memcpy (pc->data, buff, 512);
+            pc->dirty = true;
+            cache_use (pc, sector);
+            return RES_OK;
             }
-        ++sector;
-        buff += 512;
         }
-    return RES_OK;
-    }
-
-DSTATUS disk_initialize (BYTE pdrv)
-    {
+#endif
 #ifdef DEBUG
-    printf ("disk_initialize (%d)\n", pdrv);
+    printf ("Write sectors 0x%04X - 0x%04X\n", (uint) sector, (uint) ( sector + count - 1 ));
 #endif
-    if ( sd_spi_init () )
+    if ( ! sd_spi_write_blocks (sector, buff, count) )
         {
-        iStat = 0;
-        uint8_t mbr[512];
 #ifdef DEBUG
-        printf ("Reading first sector\n");
+        printf ("Write error\n");
 #endif
-        lba_base = 0;
-        if ( disk_read (0, mbr, 0u, 1) == RES_OK )
+        return RES_ERROR;
+        }
+#if SD_CACHE_SIZE > 0
+    // Keep cached copies up to date
+    for (int i = 0; i < SD_CACHE_SIZE; ++i)
+        {
+        if (( sd_cache[i].stamp != 0 ) && ( sd_cache[i].sector >= sector )
+            && ( sd_cache[i].sector < sector + count ))
             {
-            if (( mbr[0x1FE] == 0x55 ) && ( mbr[0x1FF] == 0xAA ))
-                {
-#ifdef DEBUG
-                printf ("Found partition table\n");
+            memcpy (sd_cache[i].data, buff + 512 * ( sd_cache[i].sector - sector ), 512);
+            sd_cache[i].dirty = false;
+            }
+        }
 #endif
-                for (int iPar = 0; iPar < 4; ++iPar)
-                    {
-                    int iPTA = 0x1BE + ( iPar << 4 );
-                    int iType = mbr[iPTA + 0x04];
+    return RES_OK;
+    }
+
+static DSTATUS sd_initialize (BYTE pdrv)
+    {
 #ifdef DEBUG
-                    printf ("Partition %d type = 0x%02X\n", iPar, iType);
+    printf ("disk_initialize (%d)\n", pdrv);
 #endif
-                    if (( iType == 0x0C ) && ( lba_base == 0 ))
-                        {
-                        lba_base = ( mbr[iPTA + 0x0B] << 24 ) | ( mbr[iPTA + 0x0A] << 16 )
-                            | ( mbr[iPTA + 0x09] << 8 ) | mbr[iPTA + 0x08];
-#ifdef DEBUG
-                        printf ("   Mounting this partition: LBA = 0x%X", lba_base);
+    // Only one card. Partitions are located by FatFs (VolToPart)
+    if ( pdrv != 0 ) return STA_NOINIT;
+    // The card is shared by all volumes mounted from it, so leave it
+    // (and any cached sectors) alone if it is already running
+    if ( ! ( iStat & STA_NOINIT ) ) return iStat;
+#if SD_CACHE_SIZE > 0
+    memset (sd_cache, 0, sizeof (sd_cache));
+    cache_tick = 0;
 #endif
-                        }
-                    }
-                }
-#ifdef DEBUG
-            else
-                {
-                printf ("No partition table - Assuming super-floppy\n");
-                }
+#if SD_TRIM_QUEUE > 0
+    trim_count = 0;
 #endif
-            }
-        else
-            {
-#ifdef DEBUG
-            printf ("Error reading first sector\n");
+#if SD_READ_AHEAD > 0
+    memset (sd_ra, 0, sizeof (sd_ra));
+#endif
+    if ( sd_spi_init () )
+        {
+        iStat = 0;
+#if SD_CALIBRATE > 0
+        sd_spi_calibrate (0, SD_CALIBRATE);
 #endif
-            iStat = STA_NOINIT;
-            }
         }
     else iStat = STA_NOINIT;
 #ifdef DEBUG
@@ -200,6 +643,30 @@ DSTATUS disk_initialize (BYTE pdrv)
     return iStat;
     }
 
+DRESULT disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
+    {
+    mutex_enter_blocking (&sd_mutex);
+    DRESULT res = sd_read (pdrv, buff, sector, count);
+    mutex_exit (&sd_mutex);
+    return res;
+    }
+
+DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
+    {
+    mutex_enter_blocking (&sd_mutex);
+    DRESULT res = sd_write (pdrv, buff, sector, count);
+    mutex_exit (&sd_mutex);
+    return res;
+    }
+
+DSTATUS disk_initialize (BYTE pdrv)
+    {
+    mutex_enter_blocking (&sd_mutex);
+    DSTATUS stat = sd_initialize (pdrv);
+    mutex_exit (&sd_mutex);
+    return stat;
+    }
+
 #else
 #include "pico/sd_card.h"
 
@@ -242,18 +709,8 @@ DSTATUS disk_initialize (BYTE pdrv)
 #ifdef DEBUG
     printf ("disk_initialise: iStat = %d\n", iStat);
 #endif
-    uint8_t mbr[512];
-#ifdef DEBUG
-    printf ("Reading first sector\n");
-#endif
-    int iRes = sd_readblocks_sync((uint32_t *)mbr, 0u, 1u);
-    if (( mbr[510] == 0x55 ) && ( mbr[511] == 0xAA ))
-        {
-        lba_base = ( mbr[457] << 24 ) | ( mbr[456] << 16 ) | ( mbr[455] << 8 ) | mbr[454];
-#ifdef DEBUG
-        printf ("Found partition table: First partition at %d\n", lba_base);
-#endif
-        }
+    // FatFs finds the partitions itself (FF_MULTI_PARTITION), so sector
+    // numbers are absolute
     return disk_status (pdrv);
     }
 
@@ -263,7 +720,6 @@ DRESULT disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
     printf ("disk_read: sector = %d, count = %d\n", sector, count);
 #endif
     int iRes = SD_OK;
-    sector += lba_base;
     while (( count > 0 ) && ( iRes == SD_OK ))
         {
         sleep_ms(1);
@@ -297,7 +753,6 @@ DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
 #ifdef DEBUG
     printf ("disk_write: sector = %d, count = %d\n", sector, count);
 #endif
-    sector += lba_base;
     int iRes = sd_writeblocks_async((const uint32_t *)buff, (uint32_t) sector, count);
     if ( iRes == SD_OK )
         {
@@ -321,14 +776,125 @@ DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
 
 #endif
 
-DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff)
+static DRESULT sd_ioctl (BYTE pdrv, BYTE cmd, void* buff)
     {
-    if ( cmd == CTRL_SYNC ) return RES_OK;
+    if ( cmd == CTRL_SYNC )
+        {
+#if defined (USE_SPI) && ( SD_CACHE_SIZE > 0 )
+        if ( ! cache_flush () ) return RES_ERROR;
+#endif
+        return RES_OK;
+        }
+#ifdef USE_SPI
+    if ( cmd == CTRL_EJECT )
+        {
+        // Release the card, so that the next disk_initialize starts afresh
+        // (for example after the card has been changed)
+        if (( pdrv == 0 ) && ! ( iStat & STA_NOINIT ))
+            {
+#if SD_CACHE_SIZE > 0
+            cache_flush ();
+#endif
+            sd_spi_term ();
+            iStat = STA_NOINIT;
+            }
+        return RES_OK;
+        }
+    if (( pdrv != 0 ) || ( iStat & STA_NOINIT )) return RES_NOTRDY;
+    if ( cmd == GET_SECTOR_COUNT )
+        {
+        LBA_t nsect = sd_spi_sectors ();
+        if ( nsect == 0 ) return RES_ERROR;
+        *((LBA_t *) buff) = nsect;
+        return RES_OK;
+        }
+    if ( cmd == GET_BLOCK_SIZE )
+        {
+        // Erase block (allocation unit) size. FatFs needs a power of two
+        // no larger than 32768, so use the largest that divides the AU
+        DWORD au = sd_spi_au_size ();
+        if ( au == 0 ) au = 8192;
+        au &= - au;
+        if ( au > 32768 ) au = 32768;
+        *((DWORD *) buff) = au;
+        return RES_OK;
+        }
+    if ( cmd == CTRL_TRIM )
+        {
+        // buff points to the first and last sectors to discard
+        LBA_t start = ((LBA_t *) buff)[0];
+        LBA_t end = ((LBA_t *) buff)[1] + 1;
+#ifdef DEBUG
+        printf ("disk_ioctl (%d, CTRL_TRIM, 0x%04X - 0x%04X)\n", pdrv, (uint) start, (uint) ( end - 1 ));
+#endif
+        if (( end <= start ) || ( end > SD_MAX_SECTOR )) return RES_PARERR;
+#if SD_CACHE_SIZE > 0
+        // Cached copies of discarded sectors are no longer wanted
+        for (int i = 0; i < SD_CACHE_SIZE; ++i)
+            {
+            if (( sd_cache[i].stamp != 0 ) && ( sd_cache[i].sector >= start )
+                && ( sd_cache[i].sector < end ))
+                {
+                sd_cache[i].stamp = 0;
+                sd_cache[i].dirty = false;
+                }
+            }
+#endif
+        ra_discard (start, end);
+#if SD_TRIM_QUEUE > 0
+        trim_add (start, end);
+#else
+        while ( start < end )
+            {
+            LBA_t count = end - start;
+            if ( count > SD_TRIM_CHUNK ) count = SD_TRIM_CHUNK;
+            if ( ! sd_spi_erase (start, count) ) return RES_ERROR;
+            start += count;
+            }
+#endif
+        return RES_OK;
+        }
+#endif
     return RES_PARERR;
     }
 
+DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff)
+    {
+#ifdef USE_SPI
+    mutex_enter_blocking (&sd_mutex);
+    DRESULT res = sd_ioctl (pdrv, cmd, buff);
+    mutex_exit (&sd_mutex);
+    return res;
+#else
+    return sd_ioctl (pdrv, cmd, buff);
+#endif
+    }
+
+void disk_lock (BYTE pdrv, bool bLock)
+    {
+#ifdef USE_SPI
+    if ( bLock ) mutex_enter_blocking (&sd_mutex);
+    else mutex_exit (&sd_mutex);
+#endif
+    }
+
+DWORD disk_au_size (BYTE pdrv)
+    {
+#ifdef USE_SPI
+    mutex_enter_blocking (&sd_mutex);
+    DWORD au = (( pdrv == 0 ) && ! ( iStat & STA_NOINIT )) ? sd_spi_au_size () : 0;
+    mutex_exit (&sd_mutex);
+    return au;
+#else
+    return 0;
+#endif
+    }
+
 DWORD get_fattime (void)
     {
+#ifdef SD_SPI_MODEL
+    return ((DWORD) ( 2023 - 1980 ) << 25 ) | ( 1 << 21 ) | ( 1 << 16 );
+#else
     if ( rtc_running () )
         {
         datetime_t  dt;
@@ -352,4 +918,5 @@ DWORD get_fattime (void)
             }
         }
     return 0;
+#endif
     }
@@ -0,0 +1,46 @@
+/* ff_disk.h - Additional media routines for FatFS */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef FF_DISK_H
+#define FF_DISK_H
+
+#include <stdbool.h>
+#include <ff.h>
+
+// Register (bUsed = true) or remove a volume window buffer, so that FAT
+// and directory sectors can be cached separately from file data
+void disk_cache_window (BYTE pdrv, const BYTE *win, bool bUsed);
+
+// Take (bLock = true) or release the lock held by the disk functions, to
+// change the volume table (VolToPart) without a mount reading it. No disk
+// function may be called while the lock is held
+void disk_lock (BYTE pdrv, bool bLock);
+
+// Allocation unit (erase block) size in sectors, as reported by the card,
+// or 0 if not known. Unlike GET_BLOCK_SIZE this need not be a power of two
+DWORD disk_au_size (BYTE pdrv);
+
+// Sector cache hit and miss counts
+void disk_cache_stats (BYTE pdrv, DWORD *hits, DWORD *misses);
+
+// Fetch up to count sectors which a file being read sequentially will
+// need next, with a single multiple block read
+void disk_read_ahead (BYTE pdrv, LBA_t sector, UINT count);
+
+// Number of read ahead transfers, and reads satisfied from them
+void disk_read_ahead_stats (BYTE pdrv, DWORD *reads, DWORD *hits);
+
+// Volume lock statistics (ffsystem.c): the number of times the volume
+// was locked, how many of those had to wait, and requests which timed out
+void ff_lock_stats (BYTE vol, DWORD *grants, DWORD *waits, DWORD *timeouts);
+
+// LFN working buffer statistics (ffsystem.c): buffers taken from the
+// static pool, and blocks which had to be allocated from the heap
+void ff_lfn_stats (DWORD *hits, DWORD *misses);
+
+// Erase sectors discarded by FatFs (CTRL_TRIM), stopping after about nmax
+// sectors (0 = all). Call when idle. Returns true if none remain queued
+bool disk_trim_flush (BYTE pdrv, DWORD nmax);
+
+#endif
@@ -11,12 +11,26 @@
 #include <sys/syslimits.h>
 #include <fcntl.h>
 #include <ff.h>             // Include this before PFS header files to avoid conflicting DIR definitions
+#include <diskio.h>
+#include <ff_disk.h>
 #include <pfs_private.h>
 
 #ifndef STATIC
 #define STATIC  static
 #endif
 
+#ifndef USE_ASYNC_CONTEXT
+#define USE_ASYNC_CONTEXT   0
+#endif
+
+#if USE_ASYNC_CONTEXT
+#include <pico/async_context.h>
+#endif
+
+#define FAT_WORK_SIZE   ( 16 * FF_MAX_SS )      // Work buffer for f_mkfs
+#define FAT_SCAN_STEP   8                       // FAT sectors counted by each background step
+#define FAT_SCAN_MS     1                       // Interval between background steps
+
 STATIC struct pfs_file *fat_open (struct pfs_pfs *pfs, const char *fn, int oflag);
 STATIC int fat_close (struct pfs_file *pfs_fd);
 STATIC int fat_read (struct pfs_file *pfs_fd, char *buffer, int length);
@@ -66,6 +80,12 @@ STATIC struct pfs_v_dir fat_v_dir =
 struct fat_pfs
     {
     const struct pfs_v_pfs *    entry;
+    int                         nvol;   // FatFs logical drive number
+    bool                        mounted;    // Volume mounted, and not a duplicate of another
+#if USE_ASYNC_CONTEXT
+    async_context_t *           ctx;    // Context running the scan, NULL when not scheduled
+    async_at_time_worker_t      scan;   // Background free cluster count
+#endif
     FATFS                       vol;
     };
 
@@ -74,6 +94,7 @@ struct fat_file
     const struct pfs_v_file *   entry;
     struct fat_pfs *            fat;
     const char *                pn;
+    FSIZE_t                     rd_next;    // End of the last read, to detect sequential access
     FIL                         fil;
     };
 
@@ -87,6 +108,14 @@ struct fat_dir
     DIR                         dir;
     };
 
+// Logical drive to physical drive and partition mapping, required by FatFs
+PARTITION VolToPart[FF_VOLUMES];
+STATIC struct fat_pfs *fat_vols[FF_VOLUMES];
+#define FAT_VOL_FORMAT  ((struct fat_pfs *) fat_vols)   // Logical drive in use by pfs_fat_format
+#if USE_ASYNC_CONTEXT
+STATIC async_context_t *fat_scan_ctx = NULL;    // Context to start the scan on at mount
+#endif
+
 STATIC int fat_error (FRESULT r)
     {
     switch (r)
@@ -115,6 +144,22 @@ STATIC int fat_error (FRESULT r)
     return ( r == FR_OK ) ? 0 : -1;
     }
 
+// Prefix a path with the logical drive number of the volume.
+// The result must be freed by the caller
+STATIC char *fat_path (struct fat_pfs *fat, const char *name)
+    {
+    char *pn = (char *) malloc (strlen (name) + 3);
+    if ( pn == NULL )
+        {
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    pn[0] = '0' + fat->nvol;
+    pn[1] = ':';
+    strcpy (&pn[2], name);
+    return pn;
+    }
+
 STATIC struct pfs_file *fat_open (struct pfs_pfs *pfs, const char *fn, int oflag)
     {
     struct fat_pfs *fat = (struct fat_pfs *) pfs;
@@ -126,6 +171,7 @@ STATIC struct pfs_file *fat_open (struct pfs_pfs *pfs, const char *fn, int oflag
         }
     fd->entry = &fat_v_file;
     fd->fat = fat;
+    fd->rd_next = 0;
     unsigned char of = 0;
     switch ( oflag & O_ACCMODE )
         {
@@ -136,7 +182,14 @@ STATIC struct pfs_file *fat_open (struct pfs_pfs *pfs, const char *fn, int oflag
     if ( oflag & O_APPEND ) of |= FA_OPEN_APPEND;
     if ( oflag & O_CREAT )  of |= FA_OPEN_ALWAYS;
     if ( oflag & O_TRUNC )  of |= FA_CREATE_ALWAYS;
-    FRESULT r = f_open (&fd->fil, fn, of);
+    char *pn = fat_path (fat, fn);
+    if ( pn == NULL )
+        {
+        free (fd);
+        return NULL;
+        }
+    FRESULT r = f_open (&fd->fil, pn, of);
+    free (pn);
     if ( r == FR_OK )
         {
         return (struct pfs_file *) fd;
@@ -152,12 +205,46 @@ STATIC int fat_close (struct pfs_file *pfs_fd)
     return fat_error (f_close (&fd->fil));
     }
 
+// Ask for the rest of the current cluster (or of the file if it is
+// contiguous) to be read ahead, starting with the next sector needed. At
+// the end of a cluster, the next one is found from the FAT chain
+STATIC void fat_read_ahead (struct fat_file *fd)
+    {
+    FIL *fp = &fd->fil;
+    FATFS *fs = fp->obj.fs;
+    if (( fp->fptr == 0 ) || ( fp->fptr >= fp->obj.objsize )) return;
+    FSIZE_t isect = ( fp->fptr + FF_MAX_SS - 1 ) / FF_MAX_SS;   // Next sector of the file
+    FSIZE_t iclust = ( fp->fptr - 1 ) / FF_MAX_SS / fs->csize;   // Cluster of the current sector
+    LBA_t sector = fs->database + (LBA_t) fs->csize * ( fp->clust - 2 )
+        + (LBA_t) ( isect - iclust * fs->csize );
+    FSIZE_t nsect = ( fp->obj.objsize + FF_MAX_SS - 1 ) / FF_MAX_SS - isect;
+#if FF_FS_EXFAT
+    if ( fp->obj.stat != 2 )        // Not known to be contiguous
+#endif
+        {
+        FSIZE_t nclust = ( iclust + 1 ) * fs->csize - isect;
+        if ( nclust == 0 )
+            {
+            DWORD clust;
+            if (( f_nextclust (fp, &clust) != FR_OK ) || ( clust == 0 )) return;
+            sector = fs->database + (LBA_t) fs->csize * ( clust - 2 );
+            nclust = fs->csize;
+            }
+        if ( nclust < nsect ) nsect = nclust;
+        }
+    if ( nsect > 0 ) disk_read_ahead (fs->pdrv, sector, ( nsect > 0xFFFF ) ? 0xFFFF : (UINT) nsect);
+    }
+
 STATIC int fat_read (struct pfs_file *pfs_fd, char *buffer, int length)
     {
     struct fat_file *fd = (struct fat_file *) pfs_fd;
     UINT nread;
-    FRESULT r = fat_error (f_read (&fd->fil, buffer, length, &nread));
-    return ( r == FR_OK ) ? nread : fat_error (r);
+    bool bSeq = ( f_tell (&fd->fil) == fd->rd_next );
+    FRESULT r = f_read (&fd->fil, buffer, length, &nread);
+    if ( r != FR_OK ) return fat_error (r);
+    fd->rd_next = f_tell (&fd->fil);
+    if ( bSeq ) fat_read_ahead (fd);
+    return nread;
     }
 
 STATIC int fat_write (struct pfs_file *pfs_fd, char *buffer, int length)
@@ -194,11 +281,14 @@ STATIC int fat_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf)
     {
     struct fat_pfs *fat = (struct fat_pfs *) pfs;
     FILINFO info;
-    FRESULT r = f_stat (name, &info);
+    char *pn = fat_path (fat, name);
+    if ( pn == NULL ) return -1;
+    FRESULT r = f_stat (pn, &info);
+    free (pn);
     if ( r != FR_OK ) return fat_error (r);
     memset (buf, 0, sizeof (struct stat));
     buf->st_size = info.fsize;
-    buf->st_blksize = 512;
+    buf->st_blksize = fat->vol.csize * FF_MAX_SS;     // Cluster size, at most 32768 sectors (16MB)
     buf->st_blocks = info.fsize / 512;
     buf->st_nlink = 1;
     buf->st_mode = S_IRWXU | S_IRWXG | S_IRWXO;
@@ -210,22 +300,38 @@ STATIC int fat_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf)
 
 STATIC int fat_rename (struct pfs_pfs *pfs, const char *old, const char *new)
     {
-    return fat_error (f_rename (old, new));
+    char *pn = fat_path ((struct fat_pfs *) pfs, old);
+    if ( pn == NULL ) return -1;
+    FRESULT r = f_rename (pn, new);
+    free (pn);
+    return fat_error (r);
     }
 
 STATIC int fat_delete (struct pfs_pfs *pfs, const char *name)
     {
-    return fat_error (f_unlink (name));
+    char *pn = fat_path ((struct fat_pfs *) pfs, name);
+    if ( pn == NULL ) return -1;
+    FRESULT r = f_unlink (pn);
+    free (pn);
+    return fat_error (r);
     }
 
 STATIC int fat_mkdir (struct pfs_pfs *pfs, const char *name, mode_t mode)
     {
-    return fat_error (f_mkdir (name));
+    char *pn = fat_path ((struct fat_pfs *) pfs, name);
+    if ( pn == NULL ) return -1;
+    FRESULT r = f_mkdir (pn);
+    free (pn);
+    return fat_error (r);
     }
 
 STATIC int fat_rmdir (struct pfs_pfs *pfs, const char *name)
     {
-    return fat_error (f_unlink (name));
+    char *pn = fat_path ((struct fat_pfs *) pfs, name);
+    if ( pn == NULL ) return -1;
+    FRESULT r = f_unlink (pn);
+    free (pn);
+    return fat_error (r);
     }
 
 STATIC void *fat_opendir (struct pfs_pfs *pfs, const char *name)
@@ -239,7 +345,14 @@ STATIC void *fat_opendir (struct pfs_pfs *pfs, const char *name)
         }
     dd->entry = &fat_v_dir;
     dd->fat = fat;
-    FRESULT r = f_opendir (&dd->dir, name);
+    char *pn = fat_path (fat, name);
+    if ( pn == NULL )
+        {
+        free (dd);
+        return NULL;
+        }
+    FRESULT r = f_opendir (&dd->dir, pn);
+    free (pn);
     if ( r == FR_OK ) return (void *) dd;
     free (dd);
     fat_error (r);
@@ -272,17 +385,228 @@ STATIC int fat_chmod (struct pfs_pfs *pfs, const char *name, mode_t mode)
     return pfs_error (EINVAL);
     }
 
-struct pfs_pfs *pfs_fat_create (void)
+// Claim a free logical drive for a partition, returning its number, or -1
+// if there is none or the partition is already in use. fat may be
+// FAT_VOL_FORMAT to claim the drive for pfs_fat_format, in which case no
+// other volume may be using the physical drive
+STATIC int fat_claim (struct fat_pfs *fat, int drive, int part)
+    {
+    int nvol = -1;
+    int ierr = ENFILE;
+    disk_lock (drive, true);
+    for (int i = 0; i < FF_VOLUMES; ++i)
+        {
+        if ( fat_vols[i] == NULL )
+            {
+            if ( nvol < 0 ) nvol = i;
+            }
+        else if (( VolToPart[i].pd == drive )
+            && (( fat == FAT_VOL_FORMAT ) || ( fat_vols[i] == FAT_VOL_FORMAT ) || ( VolToPart[i].pt == part )))
+            {
+            ierr = EBUSY;
+            nvol = -1;
+            break;
+            }
+        }
+    if ( nvol >= 0 )
+        {
+        fat_vols[nvol] = fat;
+        VolToPart[nvol].pd = drive;
+        VolToPart[nvol].pt = part;
+        }
+    disk_lock (drive, false);
+    if ( nvol < 0 ) pfs_error (ierr);
+    return nvol;
+    }
+
+STATIC void fat_release (int nvol)
+    {
+    BYTE drive = VolToPart[nvol].pd;
+    disk_lock (drive, true);
+    fat_vols[nvol] = NULL;
+    disk_lock (drive, false);
+    }
+
+// Record a volume as mounted, unless another logical drive has already
+// mounted the same one. This catches partition 0 (the first FAT partition)
+// and its actual number
+STATIC bool fat_mounted (struct fat_pfs *fat)
+    {
+    bool bDup = false;
+    BYTE drive = VolToPart[fat->nvol].pd;
+    disk_lock (drive, true);
+    for (int i = 0; i < FF_VOLUMES; ++i)
+        {
+        if (( fat_vols[i] != NULL ) && ( fat_vols[i] != FAT_VOL_FORMAT ) && fat_vols[i]->mounted
+            && ( VolToPart[i].pd == drive ) && ( fat_vols[i]->vol.volbase == fat->vol.volbase ))
+            {
+            bDup = true;
+            break;
+            }
+        }
+    fat->mounted = ! bDup;
+    disk_lock (drive, false);
+    return fat->mounted;
+    }
+
+struct pfs_pfs *pfs_fat_create_part (int drive, int part)
     {
     struct fat_pfs *fat = (struct fat_pfs *) malloc (sizeof (struct fat_pfs));
-    if ( fat == NULL ) return NULL;
+    if ( fat == NULL )
+        {
+        pfs_error (ENOMEM);
+        return NULL;
+        }
     fat->entry = &fat_v_pfs;
-    FRESULT r = f_mount (&fat->vol, "0:", 1);
-    if ( r != FR_OK )
+    fat->mounted = false;
+#if USE_ASYNC_CONTEXT
+    fat->ctx = NULL;
+#endif
+    int nvol = fat_claim (fat, drive, part);
+    if ( nvol < 0 )
         {
         free (fat);
-        fat_error (r);
         return NULL;
         }
+    fat->nvol = nvol;
+    char drv[3] = { '0' + nvol, ':', '\0' };
+    FRESULT r = f_mount (&fat->vol, drv, 1);
+    if (( r != FR_OK ) || ! fat_mounted (fat))
+        {
+        f_unmount (drv);
+        fat_release (nvol);
+        free (fat);
+        if ( r != FR_OK ) fat_error (r);
+        else pfs_error (EBUSY);
+        return NULL;
+        }
+    disk_cache_window (drive, fat->vol.win, true);
+#if USE_ASYNC_CONTEXT
+    if ( fat_scan_ctx != NULL ) pfs_fat_scan_async ((struct pfs_pfs *) fat, fat_scan_ctx);
+#endif
     return (struct pfs_pfs *) fat;
     }
+
+struct pfs_pfs *pfs_fat_create (void)
+    {
+    return pfs_fat_create_part (0, 0);
+    }
+
+int pfs_fat_scan (struct pfs_pfs *pfs, int nsect)
+    {
+    struct fat_pfs *fat = (struct fat_pfs *) pfs;
+    char drv[3] = { '0' + fat->nvol, ':', '\0' };
+    DWORD nfree;
+    FRESULT r = f_scanfree (drv, nsect, &nfree);
+    if ( r != FR_OK ) return fat_error (r);
+    return ( nfree != 0xFFFFFFFF ) ? 1 : 0;
+    }
+
+#if USE_ASYNC_CONTEXT
+STATIC void fat_scan_work (async_context_t *context, struct async_work_on_timeout *timeout)
+    {
+    struct fat_pfs *fat = (struct fat_pfs *) timeout->user_data;
+    if (( pfs_fat_scan ((struct pfs_pfs *) fat, FAT_SCAN_STEP) != 0 )
+        || ( ! async_context_add_at_time_worker_in_ms (context, timeout, FAT_SCAN_MS) ))
+        fat->ctx = NULL;
+    }
+
+int pfs_fat_scan_async (struct pfs_pfs *pfs, struct async_context *context)
+    {
+    struct fat_pfs *fat = (struct fat_pfs *) pfs;
+    if ( fat->ctx != NULL ) return 0;
+    // Count afresh, rather than trust a count read from FSInfo, which is
+    // stale if the card was not cleanly unmounted
+    if ( pfs_fat_scan (pfs, 0) < 0 ) return -1;
+    fat->scan.do_work = fat_scan_work;
+    fat->scan.user_data = fat;
+    fat->ctx = context;
+    if ( ! async_context_add_at_time_worker_in_ms (context, &fat->scan, 0) )
+        {
+        fat->ctx = NULL;
+        return pfs_error (EBUSY);
+        }
+    return 0;
+    }
+
+void pfs_fat_scan_context (struct async_context *context)
+    {
+    fat_scan_ctx = context;
+    }
+#endif
+
+STATIC int fat_format (int nvol, int drive)
+    {
+    if ( disk_initialize (drive) & STA_NOINIT ) return fat_error (FR_NOT_READY);
+    LBA_t nsect;
+    DWORD au;
+    if (( disk_ioctl (drive, GET_SECTOR_COUNT, &nsect) != RES_OK )
+        || ( disk_ioctl (drive, GET_BLOCK_SIZE, &au) != RES_OK )) return fat_error (FR_DISK_ERR);
+    // Start the partition on an allocation unit boundary, at least 1MB in.
+    // Cards with 12, 24 or 48MB allocation units are not a power of two, so
+    // use the true size here. f_mkfs aligns the data area to GET_BLOCK_SIZE,
+    // the largest power of two which divides it
+    LBA_t start = disk_au_size (drive);
+    if ( start == 0 ) start = au;
+    LBA_t step = start;
+    while ( start < 2048 ) start += step;
+    if ( nsect <= 2 * start ) return fat_error (FR_MKFS_ABORTED);
+    BYTE *work = (BYTE *) malloc (FAT_WORK_SIZE);
+    if ( work == NULL ) return pfs_error (ENOMEM);
+    // MBR with a single partition, LBA addressing only
+    memset (work, 0, FF_MAX_SS);
+    BYTE *pte = &work[0x1BE];
+    DWORD size = nsect - start;
+    pte[0x01] = 0xFE;       // Start CHS not used
+    pte[0x02] = 0xFF;
+    pte[0x03] = 0xFF;
+    pte[0x04] = 0x0C;       // Partition type, set by f_mkfs
+    pte[0x05] = 0xFE;       // End CHS not used
+    pte[0x06] = 0xFF;
+    pte[0x07] = 0xFF;
+    for (int i = 0; i < 4; ++i)
+        {
+        pte[0x08 + i] = ( start >> ( 8 * i )) & 0xFF;
+        pte[0x0C + i] = ( size >> ( 8 * i )) & 0xFF;
+        }
+    work[0x1FE] = 0x55;
+    work[0x1FF] = 0xAA;
+    FRESULT r = ( disk_write (drive, work, 0, 1) == RES_OK ) ? FR_OK : FR_DISK_ERR;
+    if ( r == FR_OK )
+        {
+        // Cluster sizes recommended by the SD specification: FAT32 on cards up
+        // to 32GB, exFAT above. FAT12 and FAT16 sizes are left to f_mkfs
+        MKFS_PARM opt = { FM_ANY, 0, 0, 0, 0 };
+        if ( size > 0x40000000 )        opt.au_size = 0x40000;
+        else if ( size >= 0x4000000 )   opt.au_size = 0x20000;
+        else if ( size >= 0x400000 )    opt.au_size = 0x8000;
+        char drv[3] = { '0' + nvol, ':', '\0' };
+        r = f_mkfs (drv, &opt, work, FAT_WORK_SIZE);
+        }
+    free (work);
+    return fat_error (r);
+    }
+
+int pfs_fat_format (int drive)
+    {
+    int nvol = fat_claim (FAT_VOL_FORMAT, drive, 1);
+    if ( nvol < 0 ) return -1;
+    int iRes = fat_format (nvol, drive);
+    fat_release (nvol);
+    return iRes;
+    }
+
+int pfs_fat_destroy (struct pfs_pfs *pfs)
+    {
+    struct fat_pfs *fat = (struct fat_pfs *) pfs;
+#if USE_ASYNC_CONTEXT
+    async_context_t *context = fat->ctx;
+    if ( context != NULL ) async_context_remove_at_time_worker (context, &fat->scan);
+#endif
+    char drv[3] = { '0' + fat->nvol, ':', '\0' };
+    disk_cache_window (VolToPart[fat->nvol].pd, fat->vol.win, false);
+    FRESULT r = f_unmount (drv);
+    fat_release (fat->nvol);
+    free (fat);
+    return fat_error (r);
+    }
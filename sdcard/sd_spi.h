@@ -14,5 +14,13 @@ bool sd_spi_init (void);
 void sd_spi_term (void);
 bool sd_spi_read (uint lba, uint8_t *buff);
 bool sd_spi_write (uint lba, const uint8_t *buff);
+bool sd_spi_read_blocks (uint lba, uint8_t *buff, uint count);
+bool sd_spi_write_blocks (uint lba, const uint8_t *buff, uint count);
+bool sd_spi_erase (uint lba, uint count);
+uint sd_spi_calibrate (uint lba, int nrep);
+uint sd_spi_sectors (void);
+uint sd_spi_au_size (void);
+uint sd_spi_get_freq (void);
+uint sd_spi_crc_count (void);
 
 #endif
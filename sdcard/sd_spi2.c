@@ -2,141 +2,34 @@
 // Copyright (c) 2023, Memotech-Bill
 // SPDX-License-Identifier: BSD-3-Clause
 
-#include "pico.h"
-#include "pico/stdlib.h"
-#include "hardware/clocks.h"
-#include "hardware/gpio.h"
-#include "hardware/dma.h"
-#include "sd_spi.pio.h"
+#include "sd_spi_hw.h"
 #include "sd_spi.h"
-#include "pico/binary_info.h"
 
 // #define DEBUG
 #ifdef DEBUG
 #include <stdio.h>
 #endif
 
-#if ( !defined(PICO_SD_CLK_PIN)) ||  ( !defined(PICO_SD_CMD_PIN)) || ( !defined(PICO_SD_DAT0_PIN))
-#error SD Card connections not defined. Specify a board including SD card.
-#else
+#ifndef SD_MAX_FREQ
+#define SD_MAX_FREQ     50000   // Upper limit for the SD clock (kHz)
+#endif
+#define SD_INIT_FREQ    200     // Clock during card identification (kHz)
+#define SD_DEF_FREQ     25000   // Default speed mode limit (kHz)
+#define SD_HS_FREQ      50000   // High speed mode limit (kHz)
+#define SD_MIN_FREQ     400     // Never step the clock down below this (kHz)
+#define SD_CRC_LIMIT    3       // Consecutive CRC errors before the clock is reduced
+#define SD_RETRY        4       // Attempts to transfer a block before giving up
+#define SD_ERASE_MS     250     // Erase timeout for each allocation unit (ms)
+#define SD_ERASE_AU     8192    // Assumed allocation unit size (sectors)
 
-#ifdef PICO_SD_DAT3_PIN
-#define SD_CS_PIN       PICO_SD_DAT3_PIN
-#else
-#define SD_CS_PIN       ( PICO_SD_DAT0_PIN + 3 * PICO_SD_DAT_PIN_INCREMENT )
-#endif
-#define SD_CLK_PIN      PICO_SD_CLK_PIN
-#define SD_MOSI_PIN     PICO_SD_CMD_PIN
-#define SD_MISO_PIN     PICO_SD_DAT0_PIN
-
-bi_decl (bi_1pin_with_name (SD_CS_PIN, "SD card data 3 (chip select)"));
-bi_decl (bi_1pin_with_name (SD_CLK_PIN, "SD card clock"));
-bi_decl (bi_1pin_with_name (SD_MOSI_PIN, "SD card command (data in)"));
-bi_decl (bi_1pin_with_name (SD_MISO_PIN, "SD card data 0 (data out)"));
-
-#if PICO_SD_DAT_PIN_COUNT > 1
-#define PICO_SD_DAT1_PIN    ( PICO_SD_DAT0_PIN + PICO_SD_DAT_PIN_INCREMENT )
-#define PICO_SD_DAT2_PIN    ( PICO_SD_DAT0_PIN + 2 * PICO_SD_DAT_PIN_INCREMENT )
-bi_decl (bi_1pin_with_name (PICO_SD_DAT1_PIN, "SD card data 1 (unused)"));
-bi_decl (bi_1pin_with_name (PICO_SD_DAT2_PIN, "SD card data 2 (unused)"));
-#endif
-
-static PIO pio_sd = pio1;
-static int sd_sm = -1;
-static int dma_tx = -1;
-static int dma_rx = -1;
 SD_TYPE sd_type = sdtpUnk;
-
-bool sd_spi_load (void)
-    {
-    dma_tx = dma_claim_unused_channel (true);
-    dma_rx = dma_claim_unused_channel (true);
-    if (( dma_tx < 0 ) || ( dma_rx < 0 )) return false;
-    gpio_init (SD_CS_PIN);
-    gpio_set_dir (SD_CS_PIN, GPIO_OUT);
-    gpio_pull_up (SD_MISO_PIN);
-    gpio_put (SD_CS_PIN, 1);
-#if ( PICO_SD_DAT_PIN_COUNT > 1 )
-    // Set the DAT1 and DAT2 pins to input so they don't affect SD card operation
-    gpio_init (PICO_SD_DAT1_PIN);
-    gpio_init (PICO_SD_DAT2_PIN);
-    gpio_pull_up (PICO_SD_DAT1_PIN);
-    gpio_pull_up (PICO_SD_DAT2_PIN);
-#endif
-    uint offset = pio_add_program (pio_sd, &sd_spi_program);
-    sd_sm = pio_claim_unused_sm (pio_sd, true);
-    pio_sm_config c = sd_spi_program_get_default_config (offset);
-    sm_config_set_out_pins (&c, SD_MOSI_PIN, 1);
-    sm_config_set_in_pins (&c, SD_MISO_PIN);
-    sm_config_set_sideset_pins (&c, SD_CLK_PIN);
-    sm_config_set_out_shift (&c, false, true, 8);
-    sm_config_set_in_shift (&c, false, true, 8);
-    pio_sm_set_pins_with_mask(pio_sd, sd_sm, 0, (1 << SD_CLK_PIN) | (1 << SD_MOSI_PIN));
-    pio_sm_set_pindirs_with_mask(pio_sd, sd_sm,  (1 << SD_CLK_PIN) | (1 << SD_MOSI_PIN),
-        (1 << SD_CLK_PIN) | (1 << SD_MOSI_PIN) | (1 << SD_MISO_PIN));
-    pio_gpio_init (pio_sd, SD_CLK_PIN);
-    pio_gpio_init (pio_sd, SD_MOSI_PIN);
-    pio_gpio_init (pio_sd, SD_MISO_PIN);
-    pio_sm_init (pio_sd, sd_sm, offset, &c);
-    pio_sm_set_enabled (pio_sd, sd_sm, true);
-    return true;
-    }
-
-void sd_spi_unload (void)
-    {
-    pio_sm_set_enabled (pio_sd, sd_sm, false);
-    pio_sm_unclaim (pio_sd, sd_sm);
-    dma_channel_unclaim (dma_tx);
-    dma_channel_unclaim (dma_rx);
-    sd_sm = -1;
-    dma_tx = -1;
-    dma_rx = -1;
-    }
-
-void sd_spi_freq (float freq)
-    {
-    float div = clock_get_hz (clk_sys) / ( 4000.0 * freq );
-    pio_sm_set_clkdiv (pio_sd, sd_sm, div);
-    }
-
-void sd_spi_chpsel (bool sel)
-    {
-    gpio_put (SD_CS_PIN, ! sel);
-    }
-
-// Do 8 bit accesses on FIFO, so that write data is byte-replicated. This
-// gets us the left-justification for free (for MSB-first shift-out)
-void sd_spi_xfer (bool bWrite, const uint8_t *src, uint8_t *dst, size_t len)
-    {
-    io_rw_8 *txfifo = (io_rw_8 *) &pio_sd->txf[sd_sm];
-    io_rw_8 *rxfifo = (io_rw_8 *) &pio_sd->rxf[sd_sm];
-    dma_hw->sniff_data = 0;
-    dma_channel_config c = dma_channel_get_default_config (dma_rx);
-    channel_config_set_transfer_data_size (&c, DMA_SIZE_8);
-    channel_config_set_enable (&c, true);
-    channel_config_set_read_increment (&c, false);
-    channel_config_set_write_increment (&c, !bWrite);
-    channel_config_set_dreq (&c, DREQ_PIO1_RX0 + sd_sm);
-    if ( ! bWrite )
-        {
-        channel_config_set_sniff_enable (&c, true);
-        dma_sniffer_enable (dma_rx, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, true);
-        }
-    dma_channel_configure (dma_rx, &c, dst, rxfifo, len, true);
-    c = dma_channel_get_default_config (dma_tx);
-    channel_config_set_transfer_data_size (&c, DMA_SIZE_8);
-    channel_config_set_enable (&c, true);
-    channel_config_set_read_increment (&c, bWrite);
-    channel_config_set_write_increment (&c, false);
-    channel_config_set_dreq (&c, DREQ_PIO1_TX0 + sd_sm);
-    if ( bWrite )
-        {
-        channel_config_set_sniff_enable (&c, true);
-        dma_sniffer_enable (dma_tx, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, true);
-        }
-    dma_channel_configure (dma_tx, &c, txfifo, src, len, true);
-    dma_channel_wait_for_finish_blocking (dma_rx);
-    }
+static uint sd_freq = 0;        // Current SD clock (kHz)
+static uint sd_freq_max = 0;    // Fastest clock found to be usable (kHz)
+static int sd_crc_errs = 0;     // Consecutive CRC errors
+static uint sd_crc_total = 0;   // Total CRC errors since initialisation
+static bool sd_crc_fail;        // Last failure was a CRC error
+static uint sd_sectors = 0;     // Card capacity (512 byte sectors)
+static const uint8_t sd_fill = 0xFF;
 
 uint8_t sd_spi_put (const uint8_t *src, size_t len)
     {
@@ -147,31 +40,7 @@ uint8_t sd_spi_put (const uint8_t *src, size_t len)
 
 void sd_spi_get (uint8_t *dst, size_t len)
     {
-    uint8_t fill = 0xFF;
-    sd_spi_xfer (false, &fill, dst, len);
-    }
-
-uint8_t sd_spi_clk (size_t len)
-    {
-    size_t tx_remain = len;
-    size_t rx_remain = len;
-    uint8_t resp;
-    io_rw_8 *txfifo = (io_rw_8 *) &pio_sd->txf[sd_sm];
-    io_rw_8 *rxfifo = (io_rw_8 *) &pio_sd->rxf[sd_sm];
-    while (tx_remain || rx_remain)
-        {
-        if (tx_remain && !pio_sm_is_tx_fifo_full (pio_sd, sd_sm))
-            {
-            *txfifo = 0xFF;
-            --tx_remain;
-            }
-        if (rx_remain && !pio_sm_is_rx_fifo_empty (pio_sd, sd_sm))
-            {
-            resp = *rxfifo;
-            --rx_remain;
-            }
-        }
-    return resp;
+    sd_spi_xfer (false, &sd_fill, dst, len);
     }
 
 #define SD_R1_OK        0x00
@@ -179,6 +48,8 @@ uint8_t sd_spi_clk (size_t len)
 #define SD_R1_ILLEGAL   0x04
 
 #define SDBT_START	    0xFE	// Start of data token
+#define SDBT_MULTI	    0xFC	// Start of data token for multiple block write
+#define SDBT_STOP	    0xFD	// Stop transmission token for multiple block write
 #define SDBT_ERRMSK	    0xF0	// Mask to select zero bits in error token
 #define SDBT_ERANGE	    0x08	// Out of range error flag
 #define SDBT_EECC	    0x04	// Card ECC failed
@@ -187,9 +58,18 @@ uint8_t sd_spi_clk (size_t len)
 #define SDBT_ECLIP	    0x10	// Value above all error bits
 
 static uint8_t cmd0[]   = { 0xFF, 0x40 |  0, 0x00, 0x00, 0x00, 0x00, 0x95 }; // Go Idle
+static uint8_t cmd6[]   = { 0xFF, 0x40 |  6, 0x00, 0xFF, 0xFF, 0xF1, 0x00 }; // Switch function
 static uint8_t cmd8[]   = { 0xFF, 0x40 |  8, 0x00, 0x00, 0x01, 0xAA, 0x87 }; // Set interface condition
+static uint8_t cmd9[]   = { 0xFF, 0x40 |  9, 0x00, 0x00, 0x00, 0x00, 0xAF }; // Send CSD
+static uint8_t cmd12[]  = { 0xFF, 0x40 | 12, 0x00, 0x00, 0x00, 0x00, 0x61 }; // Stop transmission
+static uint8_t cmd13[]  = { 0xFF, 0x40 | 13, 0x00, 0x00, 0x00, 0x00, 0x0D }; // Send status (SD status after CMD55)
 static uint8_t cmd17[]  = { 0xFF, 0x40 | 17, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Read single block
+static uint8_t cmd18[]  = { 0xFF, 0x40 | 18, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Read multiple blocks
 static uint8_t cmd24[]  = { 0xFF, 0x40 | 24, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Write single block
+static uint8_t cmd25[]  = { 0xFF, 0x40 | 25, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Write multiple blocks
+static uint8_t cmd32[]  = { 0xFF, 0x40 | 32, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Erase start block
+static uint8_t cmd33[]  = { 0xFF, 0x40 | 33, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Erase end block
+static uint8_t cmd38[]  = { 0xFF, 0x40 | 38, 0x00, 0x00, 0x00, 0x00, 0xA5 }; // Erase
 static uint8_t cmd55[]  = { 0xFF, 0x40 | 55, 0x00, 0x00, 0x01, 0xAA, 0x65 }; // Application command follows
 static uint8_t cmd58[]  = { 0xFF, 0x40 | 58, 0x00, 0x00, 0x00, 0x00, 0xFD }; // Read Operating Condition Reg.
 static uint8_t acmd41[] = { 0xFF, 0x40 | 41, 0x40, 0x00, 0x00, 0x00, 0x77 }; // Set operation condition
@@ -205,6 +85,8 @@ uint8_t sd_spi_cmd (uint8_t *src)
     return resp;
     }
 
+void sd_spi_speed (void);
+
 bool sd_spi_init (void)
     {
     uint8_t chk[4];
@@ -212,9 +94,11 @@ bool sd_spi_init (void)
 #ifdef DEBUG
     printf ("sd_spi_init\n");
 #endif
-    if ( sd_sm < 0 ) sd_spi_load ();
+    if ( ! sd_spi_load () ) return false;
     sd_type = sdtpUnk;
-    sd_spi_freq (200);
+    sd_crc_errs = 0;
+    sd_crc_total = 0;
+    sd_freq = sd_spi_freq (SD_INIT_FREQ);
     sd_spi_chpsel (false);
     sd_spi_clk (10);
     for (int i = 0; i < 256; ++i)
@@ -334,7 +218,7 @@ bool sd_spi_init (void)
 #ifdef DEBUG
     printf ("SD Card initialised\n");
 #endif
-    sd_spi_freq (25000);
+    sd_spi_speed ();
     return true;
     }
 
@@ -345,7 +229,7 @@ void sd_spi_term (void)
 #endif
     sd_type = sdtpUnk;
     sd_spi_chpsel (false);
-    sd_spi_freq (200);
+    sd_freq = sd_spi_freq (SD_INIT_FREQ);
     }
 
 void sd_spi_set_crc7 (uint8_t *pcmd)
@@ -378,71 +262,220 @@ void sd_spi_set_lba (uint lba, uint8_t *pcmd)
     sd_spi_set_crc7 (pcmd);
     }
 
-bool sd_spi_read (uint lba, uint8_t *buff)
+// Wait for the start of data token
+bool sd_spi_start_token (void)
     {
-    uint8_t chk[2];
-    sd_spi_set_lba (lba, cmd17);
+    uint32_t t0 = time_us_32 ();
+    while ( time_us_32 () - t0 < 250000 )
+        {
+        uint8_t resp = sd_spi_clk (1);
 #ifdef DEBUG
-    printf ("Read command 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
-        cmd17[1], cmd17[2], cmd17[3], cmd17[4], cmd17[5], cmd17[6]);
+        printf (" 0x%02X", resp);
+#endif
+        if ( resp == SDBT_START ) return true;
+        if ( resp < SDBT_ECLIP )
+            {
+#ifdef DEBUG
+            printf ("\nError\n");
 #endif
-    uint8_t resp = sd_spi_cmd (cmd17);
+            return false;
+            }
+        }
 #ifdef DEBUG
-    printf ("   Resp 0x%02X", resp);
+    printf ("\nTimeout\n");
 #endif
-    if ( resp != SD_R1_OK )
+    return false;
+    }
+
+// Receive a data block and check its CRC
+bool sd_spi_rx_block (uint8_t *buff, size_t len)
+    {
+    sd_crc_fail = false;
+    if ( ! sd_spi_start_token () ) return false;
+#ifdef DEBUG
+    printf ("\n");
+#endif
+    sd_spi_rx_block_start (buff, len);
+    while ( ! sd_spi_block_done (false) )
         {
+        tight_loop_contents ();
+        }
+    uint16_t crc = sd_spi_block_crc ();
 #ifdef DEBUG
-        printf ("\nFailed\n");
+    printf ("CRC residue 0x%04X\n", crc);
 #endif
+    if ( crc != 0 )
+        {
+#ifdef DEBUG
+        printf ("CRC mismatch\n");
+#endif
+        sd_crc_fail = true;
         return false;
         }
-    while (true)
+    return true;
+    }
+
+// Get the data response token following a block write, then wait while busy
+bool sd_spi_data_resp (void)
+    {
+    uint8_t resp;
+#ifdef DEBUG
+    printf ("   Resp");
+#endif
+    bool bResp = false;
+    sd_crc_fail = false;
+    for (int i = 0; i < 100; ++i)
         {
         resp = sd_spi_clk (1);
 #ifdef DEBUG
         printf (" 0x%02X", resp);
 #endif
-        if ( resp == SDBT_START ) break;
-        if ( resp < SDBT_ECLIP )
-            {
+        if (( resp & 0x11 ) == 0x01 ) break;
+        }
+    switch (resp & 0x0E)
+        {
+        case 0x04:
 #ifdef DEBUG
-            printf ("\nError\n");
+            printf (" Data accepted\n");
 #endif
-            return false;
-            }
+            bResp = true;
+            break;
+        case 0x0A:
+#ifdef DEBUG
+            printf (" CRC error\n");
+#endif
+            bResp = false;
+            sd_crc_fail = true;
+            break;
+        case 0x0C:
+#ifdef DEBUG
+            printf (" Write error\n");
+#endif
+            bResp = false;
+            break;
+        default:
+            break;
+        }
+    while ( sd_spi_clk (1) != 0xFF )
+        {
+        }
+    return bResp;
+    }
+
+// Stop a multiple block read
+bool sd_spi_stop (void)
+    {
+    sd_spi_put (cmd12, 7);
+    sd_spi_clk (1);                 // Discard stuff byte
+    uint8_t resp = sd_spi_clk (1);
+    for (int i = 0; i < 100; ++i)
+        {
+        if ( !( resp & 0x80 ) ) break;
+        resp = sd_spi_clk (1);
         }
+    while ( sd_spi_clk (1) != 0xFF )
+        {
+        }
+    return ( resp == SD_R1_OK );
+    }
+
+// One attempt at reading blocks. Reports the number of good blocks read
+bool sd_spi_read_try (uint lba, uint8_t *buff, uint count, uint *pdone)
+    {
+    sd_crc_fail = false;
+    uint8_t *cmd = ( count > 1 ) ? cmd18 : cmd17;
+    sd_spi_set_lba (lba, cmd);
 #ifdef DEBUG
-    printf ("\n");
+    printf ("Read command 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
+        cmd[1], cmd[2], cmd[3], cmd[4], cmd[5], cmd[6]);
 #endif
-    sd_spi_get (buff, 512);
-    uint16_t crc = dma_hw->sniff_data;
-    sd_spi_get (chk, 2);
+    uint8_t resp = sd_spi_cmd (cmd);
 #ifdef DEBUG
-    printf ("Check bytes 0x%02X 0x%02X, checksum 0x%04X\n", chk[0], chk[1], crc);
+    printf ("   Resp 0x%02X", resp);
 #endif
-    if (( chk[0] != ( crc >> 8 )) || (chk[1] != ( crc & 0xFF )))
+    if ( resp != SD_R1_OK )
         {
 #ifdef DEBUG
-        printf ("CRC mismatch\n");
+        printf ("\nFailed\n");
 #endif
         return false;
         }
-    return true;
+    bool bOK = true;
+    for (uint i = 0; i < count; ++i)
+        {
+        if ( ! sd_spi_rx_block (buff, 512) )
+            {
+            bOK = false;
+            break;
+            }
+        ++*pdone;
+        buff += 512;
+        }
+    if ( count > 1 ) bOK = sd_spi_stop () && bOK;
+    return bOK;
     }
 
-bool sd_spi_write (uint lba, const uint8_t *buff)
+// Record a CRC error, reducing the clock if they persist
+void sd_spi_crc_error (void)
+    {
+    ++sd_crc_total;
+    if ( ++sd_crc_errs >= SD_CRC_LIMIT )
+        {
+        uint freq = sd_freq * 7 / 8;
+        if ( freq < SD_MIN_FREQ ) freq = SD_MIN_FREQ;
+        sd_freq_max = sd_freq = sd_spi_freq (freq);
+        sd_crc_errs = 0;
+#ifdef DEBUG
+        printf ("Repeated CRC errors: SD clock reduced to %d kHz\n", sd_freq_max);
+#endif
+        }
+    }
+
+// Read blocks, retrying from the failing block after a CRC error
+bool sd_spi_read_blocks (uint lba, uint8_t *buff, uint count)
+    {
+    int nretry = 0;
+    while (true)
+        {
+        uint ndone = 0;
+        if ( sd_spi_read_try (lba, buff, count, &ndone) )
+            {
+            sd_crc_errs = 0;
+            return true;
+            }
+        if ( ! sd_crc_fail ) return false;
+        sd_spi_crc_error ();
+        if ( ndone > 0 ) nretry = 0;
+        if ( ++nretry >= SD_RETRY ) return false;
+        lba += ndone;
+        buff += 512 * ndone;
+        count -= ndone;
+        }
+    }
+
+bool sd_spi_read (uint lba, uint8_t *buff)
+    {
+    return sd_spi_read_blocks (lba, buff, 1);
+    }
+
+// Write one or more blocks. The CRC of each following block is calculated
+// by DMA while the current block is being clocked out
+bool sd_spi_write_try (uint lba, const uint8_t *buff, uint count, uint *pdone)
     {
-    uint8_t chk[2];
 #ifdef DEBUG
-    printf ("Write block\n");
+    printf ("Write %d blocks\n", count);
 #endif
-    sd_spi_set_lba (lba, cmd24);
+    sd_crc_fail = false;
+    uint8_t *cmd = ( count > 1 ) ? cmd25 : cmd24;
+    uint8_t token = ( count > 1 ) ? SDBT_MULTI : SDBT_START;
+    sd_spi_crc_start (buff, 512);
+    sd_spi_set_lba (lba, cmd);
 #ifdef DEBUG
     printf ("Write command 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
-        cmd24[1], cmd24[2], cmd24[3], cmd24[4], cmd24[5], cmd24[6]);
+        cmd[1], cmd[2], cmd[3], cmd[4], cmd[5], cmd[6]);
 #endif
-    uint8_t resp = sd_spi_cmd (cmd24);
+    uint8_t resp = sd_spi_cmd (cmd);
+    uint16_t crc = sd_spi_crc_result ();
 #ifdef DEBUG
     printf ("   Resp 0x%02X\n", resp);
 #endif
@@ -453,61 +486,246 @@ bool sd_spi_write (uint lba, const uint8_t *buff)
 #endif
         return false;
         }
+    bool bOK = true;
+    for (uint i = 0; i < count; ++i)
+        {
+#ifdef DEBUG
+        printf ("Write data, crc = 0x%04X\n", crc);
+#endif
+        sd_spi_tx_block_start (token, buff, 512, crc);
+        if ( i + 1 < count ) sd_spi_crc_start (buff + 512, 512);
+        while ( ! sd_spi_block_done (true) )
+            {
+            tight_loop_contents ();
+            }
+        if ( i + 1 < count ) crc = sd_spi_crc_result ();
+        if ( ! sd_spi_data_resp () )
+            {
+            bOK = false;
+            break;
+            }
+        ++*pdone;
+        buff += 512;
+        }
+    if ( count > 1 )
+        {
+        resp = SDBT_STOP;
+        sd_spi_put (&resp, 1);
+        sd_spi_clk (1);
+        while ( sd_spi_clk (1) != 0xFF )
+            {
+            }
+        }
+#ifdef DEBUG
+    printf ("\n");
+#endif
+    return bOK;
+    }
+
+// Write blocks, retrying from the failing block after a CRC error
+bool sd_spi_write_blocks (uint lba, const uint8_t *buff, uint count)
+    {
+    int nretry = 0;
+    while (true)
+        {
+        uint ndone = 0;
+        if ( sd_spi_write_try (lba, buff, count, &ndone) )
+            {
+            sd_crc_errs = 0;
+            return true;
+            }
+        if ( ! sd_crc_fail ) return false;
+        sd_spi_crc_error ();
+        if ( ndone > 0 ) nretry = 0;
+        if ( ++nretry >= SD_RETRY ) return false;
+        lba += ndone;
+        buff += 512 * ndone;
+        count -= ndone;
+        }
+    }
+
+bool sd_spi_write (uint lba, const uint8_t *buff)
+    {
+    return sd_spi_write_blocks (lba, buff, 1);
+    }
+
+// Erase (discard) count blocks starting at lba. The card is busy until
+// the erase completes, which may take up to 250ms per allocation unit
+bool sd_spi_erase (uint lba, uint count)
+    {
+    if ( count == 0 ) return true;
 #ifdef DEBUG
-    printf ("Write data\n");
+    printf ("Erase blocks 0x%04X - 0x%04X\n", lba, lba + count - 1);
 #endif
-    resp = SDBT_START;
-    resp = sd_spi_put (&resp, 1);
+    sd_spi_set_lba (lba, cmd32);
+    uint8_t resp = sd_spi_cmd (cmd32);
+    if ( resp == SD_R1_OK )
+        {
+        sd_spi_set_lba (lba + count - 1, cmd33);
+        resp = sd_spi_cmd (cmd33);
+        }
+    if ( resp == SD_R1_OK ) resp = sd_spi_cmd (cmd38);
 #ifdef DEBUG
     printf ("   Resp 0x%02X\n", resp);
 #endif
-    resp = sd_spi_put (buff, 512);
-    uint16_t crc = dma_hw->sniff_data;
+    if ( resp != SD_R1_OK ) return false;
+    uint32_t timeout = SD_ERASE_MS * ( 1 + count / SD_ERASE_AU );
+    uint32_t t0 = time_us_32 ();
+    while ( sd_spi_clk (1) != 0xFF )
+        {
+        if (( time_us_32 () - t0 ) / 1000 > timeout )
+            {
 #ifdef DEBUG
-    printf ("   Resp 0x%02X, crc = 0x%04X\n", resp, crc);
+            printf ("Erase timeout\n");
 #endif
-    chk[0] = crc >> 8;
-    chk[1] = crc & 0xFF;
-    sd_spi_put (chk, 2);
+            return false;
+            }
+        }
+    return true;
+    }
+
+// Decode the maximum transfer rate field of the CSD (kHz)
+uint sd_spi_tran_speed (uint8_t tran)
+    {
+    static const uint unit[] = { 100, 1000, 10000, 100000 };
+    static const uint8_t mult[] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+    if (( tran & 0x07 ) > 3 ) return SD_DEF_FREQ;
+    return unit[tran & 0x07] * mult[( tran >> 3 ) & 0x0F] / 10;
+    }
+
+// Check for (bSet = false) or select (bSet = true) high speed mode,
+// function 1 of function group 1
+bool sd_spi_switch (bool bSet)
+    {
+    uint8_t status[64];
+    cmd6[2] = bSet ? 0x80 : 0x00;
+    sd_spi_set_crc7 (&cmd6[1]);
+    uint8_t resp = sd_spi_cmd (cmd6);
 #ifdef DEBUG
-    printf ("   Resp");
+    printf ("Switch function (%d): Resp 0x%02X\n", bSet, resp);
 #endif
-    bool bResp = false;
-    while (true)
+    if ( resp != SD_R1_OK ) return false;
+    if ( ! sd_spi_rx_block (status, sizeof (status)) ) return false;
+    if ( bSet ) return ( status[16] & 0x0F ) == 0x01;
+    return ( status[13] & 0x02 ) != 0;
+    }
+
+// Card capacity from the CSD
+uint sd_spi_csd_sectors (const uint8_t *csd)
+    {
+    if (( csd[0] >> 6 ) == 1 )
         {
-        resp = sd_spi_clk (1);
+        // CSD version 2: C_SIZE in units of 512KB
+        uint c_size = (( csd[7] & 0x3F ) << 16 ) | ( csd[8] << 8 ) | csd[9];
+        return ( c_size + 1 ) << 10;
+        }
+    // CSD version 1: ( C_SIZE + 1 ) * 2^( C_SIZE_MULT + 2 ) blocks of 2^READ_BL_LEN bytes
+    uint c_size = (( csd[6] & 0x03 ) << 10 ) | ( csd[7] << 2 ) | ( csd[8] >> 6 );
+    uint mult = (( csd[9] & 0x03 ) << 1 ) | ( csd[10] >> 7 );
+    uint bl_len = csd[5] & 0x0F;
+    return ( c_size + 1 ) << ( mult + 2 + bl_len - 9 );
+    }
+
+// Select the fastest clock supported by both the card and the PIO program
+void sd_spi_speed (void)
+    {
+    uint8_t csd[16];
+    uint freq = SD_DEF_FREQ;
+    uint8_t resp = sd_spi_cmd (cmd9);
 #ifdef DEBUG
-        printf (" 0x%02X", resp);
+    printf ("Read CSD: Resp 0x%02X\n", resp);
 #endif
-        switch (resp & 0x0E)
-            {
-            case 0x04:
+    if (( resp == SD_R1_OK ) && sd_spi_rx_block (csd, sizeof (csd)) )
+        {
+        freq = sd_spi_tran_speed (csd[3]);
+        sd_sectors = sd_spi_csd_sectors (csd);
+        int ccc = ( csd[4] << 4 ) | ( csd[5] >> 4 );
 #ifdef DEBUG
-                printf (" Data accepted\n");
+        printf ("   TRAN_SPEED 0x%02X = %d kHz, CCC 0x%03X\n", csd[3], freq, ccc);
 #endif
-                bResp = true;
-                break;
-            case 0xA0:
+        // Only worth switching if the PIO can clock faster than default speed
+        if (( ccc & 0x400 ) && ( freq <= SD_DEF_FREQ ) && ( SD_MAX_FREQ > SD_DEF_FREQ )
+            && ( sd_spi_freq_limit () > SD_DEF_FREQ ))
+            {
+            if ( sd_spi_switch (false) && sd_spi_switch (true) )
+                {
 #ifdef DEBUG
-                printf (" CRC error\n");
+                printf ("   High speed mode selected\n");
 #endif
-                bResp = false;
-                break;
-            case 0xC0:
+                freq = SD_HS_FREQ;
+                }
+            }
+        }
+    if ( freq > SD_MAX_FREQ ) freq = SD_MAX_FREQ;
+    sd_freq_max = sd_freq = sd_spi_freq (freq);
 #ifdef DEBUG
-                printf (" Write error\n");
+    printf ("SD clock %d kHz\n", sd_freq_max);
 #endif
-                bResp = false;
-                break;
-            default:
+    }
+
+// Find the fastest clock at which a block can be read repeatedly without
+// error. Starts from the negotiated clock and steps down by 1/8 each time
+uint sd_spi_calibrate (uint lba, int nrep)
+    {
+    uint8_t buff[512];
+    uint freq = sd_freq_max;
+    while (true)
+        {
+        freq = sd_freq = sd_spi_freq (freq);
+        bool bOK = true;
+        for (int i = 0; i < nrep; ++i)
+            {
+            uint ndone = 0;
+            if ( ! sd_spi_read_try (lba, buff, 1, &ndone) )
+                {
+                bOK = false;
                 break;
+                }
             }
-        if ( resp == 0xFF ) break;
+#ifdef DEBUG
+        printf ("Calibrate %d kHz: %s\n", freq, bOK ? "Pass" : "Fail");
+#endif
+        if ( bOK || ( freq <= SD_MIN_FREQ ) ) break;
+        freq = freq * 7 / 8;
+        if ( freq < SD_MIN_FREQ ) freq = SD_MIN_FREQ;
         }
+    sd_freq_max = freq;
+    sd_crc_errs = 0;
+    return freq;
+    }
+
+uint sd_spi_sectors (void)
+    {
+    return sd_sectors;
+    }
+
+// Allocation unit size (sectors) from the SD status, 0 if not known
+uint sd_spi_au_size (void)
+    {
+    static const uint au_sect[] = { 0, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192,
+                                    16384, 24576, 32768, 49152, 65536, 131072 };
+    uint8_t status[64];
+    sd_spi_cmd (cmd55);
+    uint8_t resp = sd_spi_cmd (cmd13);
 #ifdef DEBUG
-    printf ("\n");
+    printf ("SD status: Resp 0x%02X\n", resp);
 #endif
-    return bResp;
+    if ( resp != SD_R1_OK ) return 0;
+    sd_spi_clk (1);                 // Second byte of R2 response
+    if ( ! sd_spi_rx_block (status, sizeof (status)) ) return 0;
+#ifdef DEBUG
+    printf ("   AU_SIZE %d = %d sectors\n", status[10] >> 4, au_sect[status[10] >> 4]);
+#endif
+    return au_sect[status[10] >> 4];
+    }
+
+uint sd_spi_get_freq (void)
+    {
+    return sd_freq;
+    }
+
+uint sd_spi_crc_count (void)
+    {
+    return sd_crc_total;
     }
 
-#endif // End of check that SD Card connections are specified.
@@ -0,0 +1,73 @@
+/* sd_spi_hw.h - Interface between SD card protocol and SPI hardware */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// The protocol code in sd_spi2.c only accesses the card through these
+// routines. On the Pico they are implemented by sd_spi_pio.c. Defining
+// SD_SPI_MODEL builds the protocol for a host computer, with the routines
+// implemented by the software card model in sd_spi_model.c
+
+#ifndef SD_SPI_HW_H
+#define SD_SPI_HW_H
+
+#ifdef SD_SPI_MODEL
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+typedef unsigned int uint;
+void sleep_ms (uint32_t ms);
+uint32_t time_us_32 (void);
+#define tight_loop_contents()
+
+// Pico SDK mutex, emulated with POSIX threads
+typedef struct
+    {
+    pthread_mutex_t mtx;
+    bool            init;
+    } mutex_t;
+#define auto_init_mutex(name)   static mutex_t name = { PTHREAD_MUTEX_INITIALIZER, true }
+void mutex_init (mutex_t *mtx);
+bool mutex_is_initialized (mutex_t *mtx);
+void mutex_enter_blocking (mutex_t *mtx);
+bool mutex_try_enter (mutex_t *mtx, uint32_t *owner_out);
+bool mutex_enter_timeout_ms (mutex_t *mtx, uint32_t timeout_ms);
+void mutex_exit (mutex_t *mtx);
+#else
+#include "pico.h"
+#include "pico/stdlib.h"
+#endif
+
+// Claim and configure the hardware. Returns true if already loaded
+bool sd_spi_load (void);
+void sd_spi_unload (void);
+
+// Highest SD clock that can be generated (kHz)
+uint sd_spi_freq_limit (void);
+
+// Set SD clock (kHz), returns the frequency actually selected
+uint sd_spi_freq (uint freq);
+
+void sd_spi_chpsel (bool sel);
+
+// Blocking transfers. For writes the received bytes are discarded except
+// the last. For reads, the byte at src is sent repeatedly
+void sd_spi_xfer (bool bWrite, const uint8_t *src, uint8_t *dst, size_t len);
+
+// Clock out len 0xFF bytes, returning the last byte received
+uint8_t sd_spi_clk (size_t len);
+
+// Calculate the CRC16 of a data block in the background
+void sd_spi_crc_start (const uint8_t *buff, size_t len);
+uint16_t sd_spi_crc_result (void);
+
+// Start a data block (plus two CRC bytes) transfer. These return
+// immediately, use sd_spi_block_done to test for completion
+void sd_spi_rx_block_start (uint8_t *buff, size_t len);
+void sd_spi_tx_block_start (uint8_t token, const uint8_t *buff, size_t len, uint16_t crc);
+bool sd_spi_block_done (bool bWrite);
+
+// CRC residue of the last received block, zero if correct
+uint16_t sd_spi_block_crc (void);
+
+#endif
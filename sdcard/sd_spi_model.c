@@ -0,0 +1,568 @@
+/*  sd_spi_model.c - Software model of an SD card in SPI mode */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Implements the hardware interface of sd_spi_hw.h for a host build, so
+// that the protocol code in sd_spi2.c can be exercised without a card.
+// Every byte clocked on the simulated bus advances a simulated clock, as
+// do card latencies, busy periods and a fixed overhead for each transfer
+// started. time_us_32 () and sleep_ms () use the simulated clock.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sd_spi_hw.h"
+#include "sd_spi_model.h"
+
+#define SD_SPI_CYCLES   8       // PIO cycles per SPI bit (as sd_spi.pio)
+#define NQUEUE          1024    // Length of card output queue (must be a power of 2)
+
+typedef enum {smIdle, smRead, smWrToken, smWrData} SDM_STATE;
+
+static SD_MODEL_CONFIG sdm_cfg;
+static SD_MODEL_STATS sdm_stats;
+static uint8_t *sdm_data = NULL;
+static uint8_t *sdm_used = NULL;    // Block written since last erased
+static uint sdm_freq = 200;         // SPI clock (kHz)
+static uint64_t sdm_byte_ns;        // Time to clock one byte
+static bool sdm_cs = false;         // Chip select
+static bool sdm_idle = true;        // Card in idle state
+static bool sdm_app = false;        // Next command is an application command
+static uint sdm_polls;              // ACMD41 polls before ready
+static SDM_STATE sdm_state = smIdle;
+static bool sdm_multi;              // Multiple block transfer
+static uint sdm_lba;                // Next block to transfer
+static uint sdm_erase_start;        // First block to erase
+static uint sdm_erase_end;          // Last block to erase
+static uint64_t sdm_ready_ns;       // Time next read block is available
+static uint64_t sdm_busy_ns;        // Time card stops being busy
+static uint8_t sdm_cmd[6];          // Command being received
+static int sdm_ncmd = 0;
+static uint8_t sdm_blk[514];        // Write block being received
+static int sdm_nblk;
+static uint8_t sdm_queue[NQUEUE];   // Bytes waiting to be sent by the card
+static int sdm_qrd = 0;
+static int sdm_qwr = 0;
+static uint sdm_ncmd_inj;           // Counters for error injection
+static uint sdm_nrd_inj;
+static uint sdm_nwr_inj;
+static uint16_t sdm_crc;            // Result of sd_spi_crc_start
+static uint16_t sdm_residue;        // CRC residue of last received block
+
+static uint16_t sdm_crc16 (uint16_t crc, const uint8_t *buff, size_t len)
+    {
+    while ( len-- > 0 )
+        {
+        crc ^= ((uint16_t) *buff) << 8;
+        ++buff;
+        for (int i = 0; i < 8; ++i)
+            {
+            if ( crc & 0x8000 ) crc = ( crc << 1 ) ^ 0x1021;
+            else crc <<= 1;
+            }
+        }
+    return crc;
+    }
+
+static bool sdm_inject (uint every, uint *count)
+    {
+    if ( every == 0 ) return false;
+    if ( ++*count < every ) return false;
+    *count = 0;
+    return true;
+    }
+
+static void sdm_push (uint8_t b)
+    {
+    sdm_queue[sdm_qwr] = b;
+    sdm_qwr = ( sdm_qwr + 1 ) & ( NQUEUE - 1 );
+    }
+
+static int sdm_queued (void)
+    {
+    return ( sdm_qwr - sdm_qrd ) & ( NQUEUE - 1 );
+    }
+
+// Queue a data block (start token, data, CRC), corrupting it if required
+static void sdm_push_block (const uint8_t *buff, size_t len, bool bCorrupt)
+    {
+    uint16_t crc = sdm_crc16 (0, buff, len);
+    sdm_push (0xFE);
+    for (size_t i = 0; i < len; ++i)
+        {
+        uint8_t b = buff[i];
+        if ( bCorrupt && ( i == len / 2 ) ) b ^= 0x10;
+        sdm_push (b);
+        }
+    sdm_push (crc >> 8);
+    sdm_push (crc & 0xFF);
+    }
+
+static uint8_t sdm_output (void)
+    {
+    if ( sdm_queued () == 0 )
+        {
+        if ( sdm_stats.time_ns < sdm_busy_ns ) return 0x00;
+        if (( sdm_state == smRead ) && ( sdm_stats.time_ns >= sdm_ready_ns ))
+            {
+            bool bCorrupt = ( sdm_freq > sdm_cfg.max_freq ) || sdm_inject (sdm_cfg.err_read, &sdm_nrd_inj);
+            if ( bCorrupt ) ++sdm_stats.nrderr;
+            sdm_push_block (&sdm_data[512 * sdm_lba], 512, bCorrupt);
+            ++sdm_stats.nread;
+            ++sdm_lba;
+            if (( ! sdm_multi ) || ( sdm_lba >= sdm_cfg.nsector )) sdm_state = smIdle;
+            else sdm_ready_ns = sdm_stats.time_ns + 515 * sdm_byte_ns + 1000ull * sdm_cfg.block_us;
+            }
+        if ( sdm_queued () == 0 ) return 0xFF;
+        }
+    uint8_t b = sdm_queue[sdm_qrd];
+    sdm_qrd = ( sdm_qrd + 1 ) & ( NQUEUE - 1 );
+    return b;
+    }
+
+static void sdm_busy (uint us)
+    {
+    sdm_busy_ns = sdm_stats.time_ns + ( sdm_queued () + 1 ) * sdm_byte_ns + 1000ull * us;
+    }
+
+static void sdm_r1 (uint8_t r1)
+    {
+    sdm_push (0xFF);                // Ncr
+    sdm_push (r1);
+    }
+
+static void sdm_command (void)
+    {
+    int cmd = sdm_cmd[0] & 0x3F;
+    uint arg = ( sdm_cmd[1] << 24 ) | ( sdm_cmd[2] << 16 ) | ( sdm_cmd[3] << 8 ) | sdm_cmd[4];
+    uint8_t idle = sdm_idle ? 0x01 : 0x00;
+    bool bApp = sdm_app;
+    sdm_app = false;
+    ++sdm_stats.ncmd;
+    if ( sdm_inject (sdm_cfg.err_cmd, &sdm_ncmd_inj) ) return;
+    if ( bApp && ( cmd == 13 ) )
+        {
+        uint8_t status[64];
+        memset (status, 0, sizeof (status));
+        status[10] = sdm_cfg.au_code << 4;
+        sdm_r1 (idle);
+        sdm_push (0x00);
+        sdm_push_block (status, sizeof (status), false);
+        return;
+        }
+    if ( bApp && ( cmd == 41 ) )
+        {
+        if ( sdm_polls > 0 ) --sdm_polls;
+        else sdm_idle = false;
+        sdm_r1 ( sdm_idle ? 0x01 : 0x00 );
+        return;
+        }
+    switch (cmd)
+        {
+        case 0:
+            sdm_qrd = sdm_qwr;
+            sdm_state = smIdle;
+            sdm_idle = true;
+            sdm_polls = sdm_cfg.init_polls;
+            sdm_r1 (0x01);
+            break;
+        case 6:
+            {
+            uint8_t status[64];
+            memset (status, 0, sizeof (status));
+            status[13] = sdm_cfg.bHighSpeed ? 0x03 : 0x01;
+            status[16] = sdm_cfg.bHighSpeed ? 0x01 : 0x0F;
+            sdm_r1 (idle);
+            sdm_push_block (status, sizeof (status), false);
+            break;
+            }
+        case 8:
+            sdm_r1 (idle);
+            sdm_push (0x00);
+            sdm_push (0x00);
+            sdm_push (0x01);
+            sdm_push (arg & 0xFF);
+            break;
+        case 9:
+            {
+            uint8_t csd[16];
+            memset (csd, 0, sizeof (csd));
+            csd[0] = sdm_cfg.bHighCap ? 0x40 : 0x00;
+            csd[3] = 0x32;                          // 25MHz
+            csd[4] = sdm_cfg.bHighSpeed ? 0x5B : 0x1B;  // CCC including class 10
+            csd[5] = 0x59;                          // READ_BL_LEN = 512
+            if ( sdm_cfg.bHighCap )
+                {
+                uint c_size = sdm_cfg.nsector / 1024 - 1;
+                csd[7] = ( c_size >> 16 ) & 0x3F;
+                csd[8] = ( c_size >> 8 ) & 0xFF;
+                csd[9] = c_size & 0xFF;
+                }
+            else
+                {
+                uint c_size = sdm_cfg.nsector / 512 - 1;    // C_SIZE_MULT = 7
+                csd[6] = ( c_size >> 10 ) & 0x03;
+                csd[7] = ( c_size >> 2 ) & 0xFF;
+                csd[8] = ( c_size & 0x03 ) << 6;
+                csd[9] = 0x03;
+                csd[10] = 0x80;
+                }
+            sdm_r1 (idle);
+            sdm_push_block (csd, sizeof (csd), false);
+            break;
+            }
+        case 12:
+            sdm_qrd = sdm_qwr;
+            sdm_state = smIdle;
+            sdm_push (0xFF);                // Stuff byte
+            sdm_push (idle);
+            sdm_busy (0);
+            break;
+        case 17:
+        case 18:
+        case 24:
+        case 25:
+            {
+            uint lba = sdm_cfg.bHighCap ? arg : arg / 512;
+            if ( lba >= sdm_cfg.nsector )
+                {
+                sdm_r1 (idle | 0x40);       // Parameter error
+                break;
+                }
+            sdm_r1 (idle);
+            sdm_lba = lba;
+            sdm_multi = (( cmd == 18 ) || ( cmd == 25 ));
+            if ( cmd < 24 )
+                {
+                sdm_state = smRead;
+                sdm_ready_ns = sdm_stats.time_ns + 2 * sdm_byte_ns + 1000ull * sdm_cfg.read_us;
+                }
+            else
+                {
+                sdm_state = smWrToken;
+                }
+            break;
+            }
+        case 32:
+        case 33:
+            {
+            uint lba = sdm_cfg.bHighCap ? arg : arg / 512;
+            if ( lba >= sdm_cfg.nsector )
+                {
+                sdm_r1 (idle | 0x40);       // Parameter error
+                break;
+                }
+            if ( cmd == 32 ) sdm_erase_start = lba;
+            else sdm_erase_end = lba;
+            sdm_r1 (idle);
+            break;
+            }
+        case 38:
+            if ( sdm_erase_end < sdm_erase_start )
+                {
+                sdm_r1 (idle | 0x10);       // Erase sequence error
+                break;
+                }
+            sdm_r1 (idle);
+            memset (&sdm_data[512 * sdm_erase_start], 0, 512 * ( sdm_erase_end - sdm_erase_start + 1 ));
+            memset (&sdm_used[sdm_erase_start], 0, sdm_erase_end - sdm_erase_start + 1);
+            sdm_stats.nerase += sdm_erase_end - sdm_erase_start + 1;
+            sdm_busy (sdm_cfg.erase_us);
+            break;
+        case 55:
+            sdm_app = true;
+            sdm_r1 (idle);
+            break;
+        case 58:
+            sdm_r1 (idle);
+            sdm_push (0x80 | ( sdm_cfg.bHighCap ? 0x40 : 0x00 ));
+            sdm_push (0xFF);
+            sdm_push (0x80);
+            sdm_push (0x00);
+            break;
+        default:
+            sdm_r1 (idle | 0x04);           // Illegal command
+            break;
+        }
+    }
+
+static void sdm_write_block (void)
+    {
+    uint16_t crc = sdm_crc16 (0, sdm_blk, 512);
+    bool bBad = ( crc != (( sdm_blk[512] << 8 ) | sdm_blk[513] ))
+        || ( sdm_freq > sdm_cfg.max_freq ) || sdm_inject (sdm_cfg.err_write, &sdm_nwr_inj);
+    bool bGC = false;
+    if ( bBad )
+        {
+        ++sdm_stats.nwrerr;
+        sdm_push (0x0B);
+        }
+    else
+        {
+        memcpy (&sdm_data[512 * sdm_lba], sdm_blk, 512);
+        bGC = sdm_used[sdm_lba];
+        sdm_used[sdm_lba] = 1;
+        ++sdm_stats.nwrite;
+        ++sdm_lba;
+        sdm_push (0x05);
+        }
+    sdm_busy (sdm_cfg.busy_us + ( bGC ? sdm_cfg.gc_us : 0 ));
+    sdm_state = ( sdm_multi && ( sdm_lba < sdm_cfg.nsector ) ) ? smWrToken : smIdle;
+    }
+
+static void sdm_input (uint8_t b)
+    {
+    switch (sdm_state)
+        {
+        case smWrToken:
+            if ( b == 0xFF ) return;
+            if ( sdm_multi && ( b == 0xFD ) )
+                {
+                sdm_push (0xFF);
+                sdm_busy (sdm_cfg.busy_us);
+                sdm_state = smIdle;
+                return;
+                }
+            if ( b == ( sdm_multi ? 0xFC : 0xFE ) )
+                {
+                sdm_nblk = 0;
+                sdm_state = smWrData;
+                return;
+                }
+            sdm_state = smIdle;
+            break;
+        case smWrData:
+            sdm_blk[sdm_nblk] = b;
+            if ( ++sdm_nblk == sizeof (sdm_blk) ) sdm_write_block ();
+            return;
+        default:
+            break;
+        }
+    if (( sdm_ncmd == 0 ) && (( b & 0xC0 ) != 0x40 )) return;
+    sdm_cmd[sdm_ncmd] = b;
+    if ( ++sdm_ncmd == sizeof (sdm_cmd) )
+        {
+        sdm_ncmd = 0;
+        sdm_command ();
+        }
+    }
+
+// Exchange one byte on the simulated bus
+static uint8_t sdm_byte (uint8_t mosi)
+    {
+    ++sdm_stats.bytes;
+    sdm_stats.time_ns += sdm_byte_ns;
+    if ( ! sdm_cs ) return 0xFF;
+    uint8_t miso = sdm_output ();
+    sdm_input (mosi);
+    return miso;
+    }
+
+void sd_model_defaults (SD_MODEL_CONFIG *cfg)
+    {
+    cfg->nsector = 131072;
+    cfg->bHighCap = true;
+    cfg->bHighSpeed = true;
+    cfg->sys_khz = 125000;
+    cfg->init_polls = 10;
+    cfg->read_us = 250;
+    cfg->block_us = 20;
+    cfg->busy_us = 400;
+    cfg->gc_us = 0;
+    cfg->erase_us = 2000;
+    cfg->xfer_ns = 2000;
+    cfg->max_freq = 50000;
+    cfg->au_code = 7;
+    cfg->err_read = 0;
+    cfg->err_write = 0;
+    cfg->err_cmd = 0;
+    }
+
+void sd_model_config (const SD_MODEL_CONFIG *cfg)
+    {
+    uint nsector = sdm_cfg.nsector;
+    sdm_cfg = *cfg;
+    sdm_cfg.nsector = nsector;
+    sdm_ncmd_inj = 0;
+    sdm_nrd_inj = 0;
+    sdm_nwr_inj = 0;
+    }
+
+bool sd_model_create (const SD_MODEL_CONFIG *cfg)
+    {
+    free (sdm_data);
+    free (sdm_used);
+    sdm_data = (uint8_t *) calloc (cfg->nsector, 512);
+    sdm_used = (uint8_t *) calloc (cfg->nsector, 1);
+    if (( sdm_data == NULL ) || ( sdm_used == NULL ))
+        {
+        free (sdm_data);
+        free (sdm_used);
+        sdm_data = sdm_used = NULL;
+        return false;
+        }
+    sdm_cfg = *cfg;
+    sd_model_config (cfg);
+    sdm_idle = true;
+    sdm_app = false;
+    sdm_state = smIdle;
+    sdm_ncmd = 0;
+    sdm_qrd = sdm_qwr = 0;
+    sdm_busy_ns = 0;
+    sd_model_reset_stats ();
+    return true;
+    }
+
+uint8_t *sd_model_data (void)
+    {
+    return sdm_data;
+    }
+
+void sd_model_stats (SD_MODEL_STATS *stats)
+    {
+    *stats = sdm_stats;
+    }
+
+void sd_model_reset_stats (void)
+    {
+    memset (&sdm_stats, 0, sizeof (sdm_stats));
+    sdm_busy_ns = 0;
+    sdm_ready_ns = 0;
+    }
+
+// Hardware interface
+
+void sleep_ms (uint32_t ms)
+    {
+    sdm_stats.time_ns += 1000000ull * ms;
+    }
+
+uint32_t time_us_32 (void)
+    {
+    return (uint32_t) ( sdm_stats.time_ns / 1000 );
+    }
+
+void mutex_init (mutex_t *mtx)
+    {
+    pthread_mutex_init (&mtx->mtx, NULL);
+    mtx->init = true;
+    }
+
+bool mutex_is_initialized (mutex_t *mtx)
+    {
+    return mtx->init;
+    }
+
+void mutex_enter_blocking (mutex_t *mtx)
+    {
+    pthread_mutex_lock (&mtx->mtx);
+    }
+
+bool mutex_try_enter (mutex_t *mtx, uint32_t *owner_out)
+    {
+    return ( pthread_mutex_trylock (&mtx->mtx) == 0 );
+    }
+
+bool mutex_enter_timeout_ms (mutex_t *mtx, uint32_t timeout_ms)
+    {
+    struct timespec ts;
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += ( timeout_ms % 1000 ) * 1000000;
+    if ( ts.tv_nsec >= 1000000000 )
+        {
+        ++ts.tv_sec;
+        ts.tv_nsec -= 1000000000;
+        }
+    return ( pthread_mutex_timedlock (&mtx->mtx, &ts) == 0 );
+    }
+
+void mutex_exit (mutex_t *mtx)
+    {
+    pthread_mutex_unlock (&mtx->mtx);
+    }
+
+bool sd_spi_load (void)
+    {
+    return ( sdm_data != NULL );
+    }
+
+void sd_spi_unload (void)
+    {
+    }
+
+uint sd_spi_freq_limit (void)
+    {
+    return sdm_cfg.sys_khz / SD_SPI_CYCLES;
+    }
+
+uint sd_spi_freq (uint freq)
+    {
+    float div = (float) sdm_cfg.sys_khz / ( SD_SPI_CYCLES * freq );
+    if ( div < 1.0f ) div = 1.0f;
+    sdm_freq = sdm_cfg.sys_khz / ( SD_SPI_CYCLES * div );
+    sdm_byte_ns = 8000000ull / sdm_freq;
+    return sdm_freq;
+    }
+
+void sd_spi_chpsel (bool sel)
+    {
+    sdm_cs = sel;
+    }
+
+void sd_spi_xfer (bool bWrite, const uint8_t *src, uint8_t *dst, size_t len)
+    {
+    sdm_stats.time_ns += sdm_cfg.xfer_ns;
+    for (size_t i = 0; i < len; ++i)
+        {
+        uint8_t b = sdm_byte ( bWrite ? src[i] : *src );
+        if ( bWrite ) *dst = b;
+        else dst[i] = b;
+        }
+    }
+
+uint8_t sd_spi_clk (size_t len)
+    {
+    uint8_t resp = 0xFF;
+    while ( len-- > 0 ) resp = sdm_byte (0xFF);
+    return resp;
+    }
+
+void sd_spi_crc_start (const uint8_t *buff, size_t len)
+    {
+    sdm_crc = sdm_crc16 (0, buff, len);
+    }
+
+uint16_t sd_spi_crc_result (void)
+    {
+    return sdm_crc;
+    }
+
+void sd_spi_rx_block_start (uint8_t *buff, size_t len)
+    {
+    uint8_t chk[2];
+    sdm_stats.time_ns += sdm_cfg.xfer_ns;
+    for (size_t i = 0; i < len; ++i) buff[i] = sdm_byte (0xFF);
+    chk[0] = sdm_byte (0xFF);
+    chk[1] = sdm_byte (0xFF);
+    sdm_residue = sdm_crc16 (sdm_crc16 (0, buff, len), chk, 2);
+    }
+
+void sd_spi_tx_block_start (uint8_t token, const uint8_t *buff, size_t len, uint16_t crc)
+    {
+    sdm_stats.time_ns += sdm_cfg.xfer_ns;
+    sdm_byte (token);
+    for (size_t i = 0; i < len; ++i) sdm_byte (buff[i]);
+    sdm_byte (crc >> 8);
+    sdm_byte (crc & 0xFF);
+    }
+
+bool sd_spi_block_done (bool bWrite)
+    {
+    return true;
+    }
+
+uint16_t sd_spi_block_crc (void)
+    {
+    return sdm_residue;
+    }
@@ -0,0 +1,57 @@
+/* sd_spi_model.h - Software model of an SD card in SPI mode */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef SD_SPI_MODEL_H
+#define SD_SPI_MODEL_H
+
+#include "sd_spi_hw.h"
+
+typedef struct
+    {
+    uint    nsector;        // Card capacity in 512 byte sectors
+    bool    bHighCap;       // Block addressed (SDHC / SDXC) card
+    bool    bHighSpeed;     // Card supports high speed mode (CMD6)
+    uint    sys_khz;        // Simulated Pico system clock (kHz)
+    uint    init_polls;     // ACMD41 polls before the card leaves idle
+    uint    read_us;        // Latency from read command to first start token
+    uint    block_us;       // Latency between blocks of a multiple block read
+    uint    busy_us;        // Busy time after each block written
+    uint    gc_us;          // Extra busy time writing a block not erased since last written
+    uint    erase_us;       // Busy time for an erase command
+    uint    xfer_ns;        // Software overhead for each transfer started
+    uint    max_freq;       // Fastest reliable SPI clock for the wiring (kHz)
+    uint    au_code;        // AU_SIZE field of the SD status (7 = 1MB)
+    uint    err_read;       // Corrupt one read block in every err_read (0 = never)
+    uint    err_write;      // Report CRC error on one block in every err_write
+    uint    err_cmd;        // Ignore one command in every err_cmd
+    } SD_MODEL_CONFIG;
+
+typedef struct
+    {
+    uint64_t    time_ns;    // Simulated elapsed time
+    uint64_t    bytes;      // Bytes clocked on the SPI bus
+    uint        ncmd;       // Commands received
+    uint        nread;      // Blocks read
+    uint        nwrite;     // Blocks written
+    uint        nrderr;     // Read blocks sent with a bad CRC
+    uint        nwrerr;     // Written blocks rejected with CRC error
+    uint        nerase;     // Blocks erased
+    } SD_MODEL_STATS;
+
+// Fill a configuration with the defaults: 64MB SDHC card, 125MHz system clock
+void sd_model_defaults (SD_MODEL_CONFIG *cfg);
+
+// Create (or recreate) the simulated card. The data is initially zero
+bool sd_model_create (const SD_MODEL_CONFIG *cfg);
+
+// Change the timing and error injection settings, keeping the data
+void sd_model_config (const SD_MODEL_CONFIG *cfg);
+
+// Direct access to the simulated card contents
+uint8_t *sd_model_data (void);
+
+void sd_model_stats (SD_MODEL_STATS *stats);
+void sd_model_reset_stats (void);
+
+#endif
@@ -0,0 +1,278 @@
+/*  sd_spi_pio.c - SPI interface to SD card using PIO and DMA */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "pico.h"
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/gpio.h"
+#include "hardware/dma.h"
+#include "sd_spi.pio.h"
+#include "sd_spi_hw.h"
+#include "pico/binary_info.h"
+
+#if ( !defined(PICO_SD_CLK_PIN)) ||  ( !defined(PICO_SD_CMD_PIN)) || ( !defined(PICO_SD_DAT0_PIN))
+#error SD Card connections not defined. Specify a board including SD card.
+#else
+
+#ifdef PICO_SD_DAT3_PIN
+#define SD_CS_PIN       PICO_SD_DAT3_PIN
+#else
+#define SD_CS_PIN       ( PICO_SD_DAT0_PIN + 3 * PICO_SD_DAT_PIN_INCREMENT )
+#endif
+#define SD_CLK_PIN      PICO_SD_CLK_PIN
+#define SD_MOSI_PIN     PICO_SD_CMD_PIN
+#define SD_MISO_PIN     PICO_SD_DAT0_PIN
+
+bi_decl (bi_1pin_with_name (SD_CS_PIN, "SD card data 3 (chip select)"));
+bi_decl (bi_1pin_with_name (SD_CLK_PIN, "SD card clock"));
+bi_decl (bi_1pin_with_name (SD_MOSI_PIN, "SD card command (data in)"));
+bi_decl (bi_1pin_with_name (SD_MISO_PIN, "SD card data 0 (data out)"));
+
+#if PICO_SD_DAT_PIN_COUNT > 1
+#define PICO_SD_DAT1_PIN    ( PICO_SD_DAT0_PIN + PICO_SD_DAT_PIN_INCREMENT )
+#define PICO_SD_DAT2_PIN    ( PICO_SD_DAT0_PIN + 2 * PICO_SD_DAT_PIN_INCREMENT )
+bi_decl (bi_1pin_with_name (PICO_SD_DAT1_PIN, "SD card data 1 (unused)"));
+bi_decl (bi_1pin_with_name (PICO_SD_DAT2_PIN, "SD card data 2 (unused)"));
+#endif
+
+#define SD_SPI_CYCLES   8       // PIO cycles per SPI bit (see sd_spi.pio)
+
+static PIO pio_sd = pio1;
+static int sd_sm = -1;
+static int dma_tx = -1;
+static int dma_rx = -1;
+static int dma_cb = -1;     // Control block channel: reloads dma_rx or dma_tx for chained transfers
+static int dma_crc = -1;    // Memory to memory channel used to calculate write CRCs
+
+// DMA configurations are calculated once when the SM is loaded
+static dma_channel_config cfg_tx_buf;       // Transmit from buffer
+static dma_channel_config cfg_tx_fill;      // Transmit repeated fill byte
+static dma_channel_config cfg_tx_block;     // Transmit chained blocks
+static dma_channel_config cfg_rx_buf;       // Receive into buffer
+static dma_channel_config cfg_rx_drain;     // Receive and discard
+static dma_channel_config cfg_rx_block;     // Receive chained blocks with CRC sniffer
+static dma_channel_config cfg_cb;           // Control block loader
+static dma_channel_config cfg_crc;          // Memory to sniffer CRC calculation
+
+// Control blocks. For receive these are { write_addr, trans_count } pairs,
+// for transmit { trans_count, read_addr } pairs, terminated by a null trigger
+static uint32_t __attribute__((aligned(8))) sd_cb[8];
+static uint8_t sd_ones = 0xFF;
+static uint8_t sd_token;
+static uint8_t sd_chk[2];
+static uint8_t sd_drain;
+static uint8_t sd_crc_sink;
+
+static dma_channel_config sd_spi_dma_config (int chan, bool bRead, bool bWrite, uint dreq)
+    {
+    dma_channel_config c = dma_channel_get_default_config (chan);
+    channel_config_set_transfer_data_size (&c, DMA_SIZE_8);
+    channel_config_set_read_increment (&c, bRead);
+    channel_config_set_write_increment (&c, bWrite);
+    channel_config_set_dreq (&c, dreq);
+    return c;
+    }
+
+bool sd_spi_load (void)
+    {
+    if ( sd_sm >= 0 ) return true;
+    dma_tx = dma_claim_unused_channel (true);
+    dma_rx = dma_claim_unused_channel (true);
+    dma_cb = dma_claim_unused_channel (true);
+    dma_crc = dma_claim_unused_channel (true);
+    if (( dma_tx < 0 ) || ( dma_rx < 0 ) || ( dma_cb < 0 ) || ( dma_crc < 0 )) return false;
+    gpio_init (SD_CS_PIN);
+    gpio_set_dir (SD_CS_PIN, GPIO_OUT);
+    gpio_pull_up (SD_MISO_PIN);
+    gpio_put (SD_CS_PIN, 1);
+#if ( PICO_SD_DAT_PIN_COUNT > 1 )
+    // Set the DAT1 and DAT2 pins to input so they don't affect SD card operation
+    gpio_init (PICO_SD_DAT1_PIN);
+    gpio_init (PICO_SD_DAT2_PIN);
+    gpio_pull_up (PICO_SD_DAT1_PIN);
+    gpio_pull_up (PICO_SD_DAT2_PIN);
+#endif
+    uint offset = pio_add_program (pio_sd, &sd_spi_program);
+    sd_sm = pio_claim_unused_sm (pio_sd, true);
+    pio_sm_config c = sd_spi_program_get_default_config (offset);
+    sm_config_set_out_pins (&c, SD_MOSI_PIN, 1);
+    sm_config_set_in_pins (&c, SD_MISO_PIN);
+    sm_config_set_sideset_pins (&c, SD_CLK_PIN);
+    sm_config_set_out_shift (&c, false, true, 8);
+    sm_config_set_in_shift (&c, false, true, 8);
+    pio_sm_set_pins_with_mask(pio_sd, sd_sm, 0, (1 << SD_CLK_PIN) | (1 << SD_MOSI_PIN));
+    pio_sm_set_pindirs_with_mask(pio_sd, sd_sm,  (1 << SD_CLK_PIN) | (1 << SD_MOSI_PIN),
+        (1 << SD_CLK_PIN) | (1 << SD_MOSI_PIN) | (1 << SD_MISO_PIN));
+    pio_gpio_init (pio_sd, SD_CLK_PIN);
+    pio_gpio_init (pio_sd, SD_MOSI_PIN);
+    pio_gpio_init (pio_sd, SD_MISO_PIN);
+    pio_sm_init (pio_sd, sd_sm, offset, &c);
+    pio_sm_set_enabled (pio_sd, sd_sm, true);
+
+    uint dreq_tx = pio_get_dreq (pio_sd, sd_sm, true);
+    uint dreq_rx = pio_get_dreq (pio_sd, sd_sm, false);
+    cfg_tx_buf = sd_spi_dma_config (dma_tx, true, false, dreq_tx);
+    cfg_tx_fill = sd_spi_dma_config (dma_tx, false, false, dreq_tx);
+    cfg_tx_block = cfg_tx_buf;
+    channel_config_set_chain_to (&cfg_tx_block, dma_cb);
+    channel_config_set_irq_quiet (&cfg_tx_block, true);
+    cfg_rx_buf = sd_spi_dma_config (dma_rx, false, true, dreq_rx);
+    cfg_rx_drain = sd_spi_dma_config (dma_rx, false, false, dreq_rx);
+    cfg_rx_block = cfg_rx_buf;
+    channel_config_set_chain_to (&cfg_rx_block, dma_cb);
+    channel_config_set_irq_quiet (&cfg_rx_block, true);
+    channel_config_set_sniff_enable (&cfg_rx_block, true);
+    cfg_cb = dma_channel_get_default_config (dma_cb);
+    channel_config_set_transfer_data_size (&cfg_cb, DMA_SIZE_32);
+    channel_config_set_read_increment (&cfg_cb, true);
+    channel_config_set_write_increment (&cfg_cb, true);
+    channel_config_set_ring (&cfg_cb, true, 3);
+    cfg_crc = sd_spi_dma_config (dma_crc, true, false, DREQ_FORCE);
+    channel_config_set_sniff_enable (&cfg_crc, true);
+    return true;
+    }
+
+void sd_spi_unload (void)
+    {
+    pio_sm_set_enabled (pio_sd, sd_sm, false);
+    pio_sm_unclaim (pio_sd, sd_sm);
+    dma_channel_unclaim (dma_tx);
+    dma_channel_unclaim (dma_rx);
+    dma_channel_unclaim (dma_cb);
+    dma_channel_unclaim (dma_crc);
+    sd_sm = -1;
+    dma_tx = -1;
+    dma_rx = -1;
+    dma_cb = -1;
+    dma_crc = -1;
+    }
+
+// Highest SD clock the PIO program can generate (kHz)
+uint sd_spi_freq_limit (void)
+    {
+    return clock_get_hz (clk_sys) / ( 1000 * SD_SPI_CYCLES );
+    }
+
+// Set SD clock (kHz), returns the frequency actually selected
+uint sd_spi_freq (uint freq)
+    {
+    float div = (float) clock_get_hz (clk_sys) / ( 1000.0f * SD_SPI_CYCLES * freq );
+    if ( div < 1.0f ) div = 1.0f;
+    pio_sm_set_clkdiv (pio_sd, sd_sm, div);
+    return clock_get_hz (clk_sys) / ( 1000.0f * SD_SPI_CYCLES * div );
+    }
+
+void sd_spi_chpsel (bool sel)
+    {
+    gpio_put (SD_CS_PIN, ! sel);
+    }
+
+// Do 8 bit accesses on FIFO, so that write data is byte-replicated. This
+// gets us the left-justification for free (for MSB-first shift-out)
+void sd_spi_xfer (bool bWrite, const uint8_t *src, uint8_t *dst, size_t len)
+    {
+    io_rw_8 *txfifo = (io_rw_8 *) &pio_sd->txf[sd_sm];
+    io_rw_8 *rxfifo = (io_rw_8 *) &pio_sd->rxf[sd_sm];
+    dma_channel_configure (dma_rx, bWrite ? &cfg_rx_drain : &cfg_rx_buf, dst, rxfifo, len, true);
+    dma_channel_configure (dma_tx, bWrite ? &cfg_tx_buf : &cfg_tx_fill, txfifo, src, len, true);
+    dma_channel_wait_for_finish_blocking (dma_rx);
+    }
+
+uint8_t sd_spi_clk (size_t len)
+    {
+    size_t tx_remain = len;
+    size_t rx_remain = len;
+    uint8_t resp;
+    io_rw_8 *txfifo = (io_rw_8 *) &pio_sd->txf[sd_sm];
+    io_rw_8 *rxfifo = (io_rw_8 *) &pio_sd->rxf[sd_sm];
+    while (tx_remain || rx_remain)
+        {
+        if (tx_remain && !pio_sm_is_tx_fifo_full (pio_sd, sd_sm))
+            {
+            *txfifo = 0xFF;
+            --tx_remain;
+            }
+        if (rx_remain && !pio_sm_is_rx_fifo_empty (pio_sd, sd_sm))
+            {
+            resp = *rxfifo;
+            --rx_remain;
+            }
+        }
+    return resp;
+    }
+
+// Start calculating the CRC of a data block, using the DMA sniffer on a
+// memory to memory transfer. This runs at bus speed, so the result is
+// available long before the previous block has been clocked out
+void sd_spi_crc_start (const uint8_t *buff, size_t len)
+    {
+    dma_hw->sniff_data = 0;
+    dma_sniffer_enable (dma_crc, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, false);
+    dma_channel_configure (dma_crc, &cfg_crc, &sd_crc_sink, buff, len, true);
+    }
+
+uint16_t sd_spi_crc_result (void)
+    {
+    dma_channel_wait_for_finish_blocking (dma_crc);
+    return dma_hw->sniff_data;
+    }
+
+// Start receiving a data block followed by its two CRC bytes. The control
+// channel reloads dma_rx for the CRC bytes, so the sniffer sees data and
+// CRC as one stream and leaves a zero residue if the block is good
+void sd_spi_rx_block_start (uint8_t *buff, size_t len)
+    {
+    io_rw_8 *txfifo = (io_rw_8 *) &pio_sd->txf[sd_sm];
+    io_rw_8 *rxfifo = (io_rw_8 *) &pio_sd->rxf[sd_sm];
+    sd_cb[0] = (uint32_t) buff;
+    sd_cb[1] = len;
+    sd_cb[2] = (uint32_t) sd_chk;
+    sd_cb[3] = 2;
+    sd_cb[4] = 0;
+    sd_cb[5] = 0;
+    dma_hw->sniff_data = 0;
+    dma_sniffer_enable (dma_rx, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, false);
+    dma_hw->intr = 1u << dma_rx;
+    dma_channel_set_config (dma_rx, &cfg_rx_block, false);
+    dma_channel_set_read_addr (dma_rx, rxfifo, false);
+    dma_channel_configure (dma_cb, &cfg_cb, &dma_hw->ch[dma_rx].al1_write_addr, sd_cb, 2, true);
+    dma_channel_configure (dma_tx, &cfg_tx_fill, txfifo, &sd_ones, len + 2, true);
+    }
+
+// Start transmitting start token, data block and CRC as one chained transfer
+void sd_spi_tx_block_start (uint8_t token, const uint8_t *buff, size_t len, uint16_t crc)
+    {
+    io_rw_8 *txfifo = (io_rw_8 *) &pio_sd->txf[sd_sm];
+    io_rw_8 *rxfifo = (io_rw_8 *) &pio_sd->rxf[sd_sm];
+    sd_token = token;
+    sd_chk[0] = crc >> 8;
+    sd_chk[1] = crc & 0xFF;
+    sd_cb[0] = 1;
+    sd_cb[1] = (uint32_t) &sd_token;
+    sd_cb[2] = len;
+    sd_cb[3] = (uint32_t) buff;
+    sd_cb[4] = 2;
+    sd_cb[5] = (uint32_t) sd_chk;
+    sd_cb[6] = 0;
+    sd_cb[7] = 0;
+    dma_channel_configure (dma_rx, &cfg_rx_drain, &sd_drain, rxfifo, len + 3, true);
+    dma_channel_set_config (dma_tx, &cfg_tx_block, false);
+    dma_channel_set_write_addr (dma_tx, txfifo, false);
+    dma_channel_configure (dma_cb, &cfg_cb, &dma_hw->ch[dma_tx].al3_transfer_count, sd_cb, 2, true);
+    }
+
+// Non-blocking test for completion of a block transfer
+bool sd_spi_block_done (bool bWrite)
+    {
+    if ( bWrite ) return ! dma_channel_is_busy (dma_rx);
+    return ( dma_hw->intr & ( 1u << dma_rx ) ) != 0;
+    }
+
+// Returns the sniffer residue after a received block, zero if the CRC matched
+uint16_t sd_spi_block_crc (void)
+    {
+    return dma_hw->sniff_data;
+    }
+
+#endif // End of check that SD Card connections are specified.
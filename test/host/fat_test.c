@@ -0,0 +1,279 @@
+// fat_test.c - Exercise the FAT filesystem and SD card media layer against the card model
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sd_spi_model.h>
+#include <ff.h>
+#include <diskio.h>
+#include <ff_disk.h>
+#include <pfs_private.h>
+#include <pfs.h>
+#include "test_util.h"
+
+#define NDATA   ( 200 * 1024 )
+#define NTHREAD 4
+#define NTDATA  ( 16 * 1024 )
+#define NTLOOP  20
+
+static char wbuf[NDATA];
+static char rbuf[NDATA];
+
+static uint get_dword (const uint8_t *p)
+    {
+    return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( p[3] << 24 );
+    }
+
+// Mount the first partition on a spare logical drive to inspect the layout
+static bool layout (uint au, BYTE *fs_type, WORD *csize)
+    {
+    FATFS fs;
+    VolToPart[FF_VOLUMES - 1].pd = 0;
+    VolToPart[FF_VOLUMES - 1].pt = 1;
+    bool bOK = ( f_mount (&fs, "3:", 1) == FR_OK );
+    if ( bOK )
+        {
+        printf ("  FAT type %d, cluster %d sectors, partition at %d, data at %d\n",
+            fs.fs_type, fs.csize, (int) fs.volbase, (int) fs.database);
+        bOK = ( fs.volbase % au == 0 ) && ( fs.database % au == 0 );
+        *fs_type = fs.fs_type;
+        *csize = fs.csize;
+        }
+    f_unmount ("3:");
+    return bOK;
+    }
+
+// Count the free clusters with a full FAT scan, using a spare logical drive
+static DWORD ref_free (void)
+    {
+    FATFS fs;
+    FATFS *pfs;
+    DWORD nfree = 0;
+    VolToPart[FF_VOLUMES - 1].pd = 0;
+    VolToPart[FF_VOLUMES - 1].pt = 1;
+    if (( f_mount (&fs, "3:", 1) != FR_OK ) || ( f_getfree ("3:", &nfree, &pfs) != FR_OK )) nfree = 0;
+    f_unmount ("3:");
+    return nfree;
+    }
+
+// Repeatedly write and read back a file, concurrently with other threads
+struct worker
+    {
+    pthread_t           thread;
+    struct pfs_pfs *    pfs;
+    int                 id;
+    int                 nfail;
+    char                wbuf[NTDATA];
+    char                rbuf[NTDATA];
+    };
+
+static void *worker (void *arg)
+    {
+    struct worker *pw = (struct worker *) arg;
+    char sName[16];
+    sprintf (sName, "/thread%d.dat", pw->id);
+    for (int iLoop = 0; iLoop < NTLOOP; ++iLoop)
+        {
+        for (int i = 0; i < NTDATA; ++i) pw->wbuf[i] = pw->id + iLoop + i;
+        struct pfs_file *f = pw->pfs->entry->open (pw->pfs, sName, O_CREAT | O_TRUNC | O_WRONLY);
+        if ( f == NULL )
+            {
+            ++pw->nfail;
+            continue;
+            }
+        if ( f->entry->write (f, pw->wbuf, NTDATA) != NTDATA ) ++pw->nfail;
+        if ( f->entry->close (f) != 0 ) ++pw->nfail;
+        free (f);
+        f = pw->pfs->entry->open (pw->pfs, sName, O_RDONLY);
+        if ( f == NULL )
+            {
+            ++pw->nfail;
+            continue;
+            }
+        if (( f->entry->read (f, pw->rbuf, NTDATA) != NTDATA )
+            || ( memcmp (pw->wbuf, pw->rbuf, NTDATA) != 0 )) ++pw->nfail;
+        if ( f->entry->close (f) != 0 ) ++pw->nfail;
+        free (f);
+        }
+    return NULL;
+    }
+
+int main (int argc, char *argv[])
+    {
+    SD_MODEL_CONFIG cfg;
+    SD_MODEL_STATS st;
+    BYTE fs_type = 0;
+    WORD csize = 0;
+    struct stat sbuf;
+    DWORD hits, misses;
+
+    printf ("Format 64MB card, 1MB allocation units\n");
+    sd_model_defaults (&cfg);
+    cfg.au_code = 7;
+    check (sd_model_create (&cfg), "Create card model");
+    check (pfs_fat_format (0) == 0, "Format card");
+    const uint8_t *mbr = sd_model_data ();
+    check (( mbr[0x1FE] == 0x55 ) && ( mbr[0x1FF] == 0xAA ) && ( get_dword (&mbr[0x1C6]) == 2048 ),
+        "Partition at first allocation unit");
+    check (layout (2048, &fs_type, &csize), "Data area aligned to allocation units");
+
+    printf ("File operations\n");
+    struct pfs_pfs *pfs = pfs_fat_create ();
+    check (pfs != NULL, "Mount volume");
+    fill (wbuf, NDATA, 1);
+    check (write_file (pfs, "/test.dat", wbuf, NDATA), "Write file");
+    check (read_file (pfs, "/test.dat", wbuf, NDATA), "Read file");
+    check (( pfs->entry->stat (pfs, "/test.dat", &sbuf) == 0 ) && ( sbuf.st_size == NDATA ), "File size");
+    check (pfs->entry->mkdir (pfs, "/dir", 0777) == 0, "Make directory");
+    check (pfs->entry->rename (pfs, "/test.dat", "/dir/moved.dat") == 0, "Rename file");
+    check (read_file (pfs, "/dir/moved.dat", wbuf, NDATA), "Read renamed file");
+    disk_cache_stats (0, &hits, &misses);
+    printf ("  Sector cache: %d hits, %d misses\n", (int) hits, (int) misses);
+    check (hits > 0, "Sector cache used");
+
+    printf ("Sequential read ahead\n");
+    struct pfs_file *f = pfs->entry->open (pfs, "/dir/moved.dat", O_RDONLY);
+    check (f != NULL, "Open file");
+    sd_model_reset_stats ();
+    int nread = 0;
+    int nchunk;
+    memset (rbuf, 0, NDATA);
+    while (( nchunk = f->entry->read (f, rbuf + nread, 100) ) > 0 ) nread += nchunk;
+    sd_model_stats (&st);
+    check (( f->entry->close (f) == 0 ) && ( nread == NDATA ) && ( memcmp (wbuf, rbuf, NDATA) == 0 ),
+        "Read file in small pieces");
+    free (f);
+    DWORD ra_reads, ra_hits;
+    disk_read_ahead_stats (0, &ra_reads, &ra_hits);
+    printf ("  %d sectors read with %d commands, %d read ahead, %d hits\n",
+        st.nread, st.ncmd, (int) ra_reads, (int) ra_hits);
+    check (st.ncmd < NDATA / 512 / 2, "Sectors read ahead");
+    check (ra_hits + csize >= NDATA / 512, "Read ahead across clusters");
+    sd_model_reset_stats ();
+    disk_read_ahead (0, cfg.nsector, 8);
+    disk_read_ahead (0, 0x100000000ull, 8);
+    disk_read_ahead (0, 0x1000000FFull, 8);
+    sd_model_stats (&st);
+    DWORD ra_reads2;
+    disk_read_ahead_stats (0, &ra_reads2, &ra_hits);
+    check (( st.ncmd == 0 ) && ( ra_reads2 == ra_reads ), "No read ahead beyond the card");
+    disk_read_ahead (0, cfg.nsector - 2, 8);
+    sd_model_stats (&st);
+    check (st.nread == 2, "Read ahead clipped at the end of the card");
+
+    printf ("Background free cluster count\n");
+    int nstep = 1;
+    check (pfs_fat_scan (pfs, 4) == 0, "Scan started");
+    fill (wbuf, NDATA, 2);
+    check (write_file (pfs, "/scan1.dat", wbuf, NDATA), "Write file during scan");
+    nstep += ( pfs_fat_scan (pfs, 4) == 0 );
+    nstep += ( pfs_fat_scan (pfs, 4) == 0 );
+    check (pfs->entry->delete (pfs, "/scan1.dat") == 0, "Delete file during scan");
+    check (write_file (pfs, "/scan2.dat", wbuf, NDATA / 2), "Write file during scan");
+    int iScan;
+    while (( iScan = pfs_fat_scan (pfs, 4) ) == 0 ) ++nstep;
+    check (iScan == 1, "Scan completed");
+    printf ("  Scan took %d steps\n", nstep);
+    FATFS *pvol;
+    DWORD nfree = 0;
+    check (f_getfree ("0:", &nfree, &pvol) == FR_OK, "Get free clusters");
+    DWORD nref = ref_free ();
+    printf ("  %d clusters free, %d by full scan\n", (int) nfree, (int) nref);
+    check (( nfree == nref ) && ( nref > 0 ), "Count matches full scan");
+    check (pfs->entry->delete (pfs, "/scan2.dat") == 0, "Delete file");
+    check (( f_getfree ("0:", &nfree, &pvol) == FR_OK ) && ( nfree == ref_free () ), "Count tracks deletion");
+
+    printf ("Concurrent access from %d threads\n", NTHREAD);
+    DWORD lfn_hits, lfn_misses, lfn_heap;
+    ff_lfn_stats (&lfn_hits, &lfn_heap);
+    static struct worker work[NTHREAD];
+    for (int i = 0; i < NTHREAD; ++i)
+        {
+        work[i].pfs = pfs;
+        work[i].id = i;
+        work[i].nfail = 0;
+        pthread_create (&work[i].thread, NULL, worker, &work[i]);
+        }
+    int nterr = 0;
+    for (int i = 0; i < NTHREAD; ++i)
+        {
+        pthread_join (work[i].thread, NULL);
+        nterr += work[i].nfail;
+        }
+    check (nterr == 0, "All files written and read back");
+    DWORD grants, waits, timeouts;
+    ff_lock_stats (0, &grants, &waits, &timeouts);
+    printf ("  Volume locked %d times, %d waits, %d timeouts\n", (int) grants, (int) waits, (int) timeouts);
+    check (( grants > 0 ) && ( timeouts == 0 ), "Volume lock statistics");
+    ff_lfn_stats (&lfn_hits, &lfn_misses);
+    printf ("  LFN buffers: %d from pool, %d from heap\n", (int) lfn_hits, (int) lfn_misses);
+    check (lfn_misses == lfn_heap, "No heap allocation for file names");
+
+    printf ("Discard deleted file\n");
+    disk_trim_flush (0, 0);
+    sd_model_reset_stats ();
+    check (pfs->entry->delete (pfs, "/dir/moved.dat") == 0, "Delete file");
+    sd_model_stats (&st);
+    check (st.nerase == 0, "Erase deferred");
+    check (disk_trim_flush (0, 0), "Flush discard queue");
+    sd_model_stats (&st);
+    printf ("  %d sectors erased\n", st.nerase);
+    check (st.nerase >= NDATA / 512, "Freed clusters erased");
+    check (( pfs->entry->stat (pfs, "/dir/moved.dat", &sbuf) != 0 ) && ( errno == ENOENT ), "File gone");
+    check (pfs->entry->rmdir (pfs, "/dir") == 0, "Remove directory");
+
+    printf ("Volume in use\n");
+    check (( pfs_fat_create_part (0, 0) == NULL ) && ( errno == EBUSY ), "Mount same partition fails");
+    check (( pfs_fat_create_part (0, 1) == NULL ) && ( errno == EBUSY ), "Mount same partition by number fails");
+    check (( pfs_fat_format (0) == -1 ) && ( errno == EBUSY ), "Format mounted card fails");
+    check (pfs_fat_destroy (pfs) == 0, "Unmount volume");
+    pfs = pfs_fat_create_part (0, 1);
+    check (pfs != NULL, "Mount partition by number");
+    check (pfs_fat_destroy (pfs) == 0, "Unmount volume");
+
+    printf ("Format 256MB card, 12MB allocation units\n");
+    check (disk_ioctl (0, CTRL_EJECT, NULL) == RES_OK, "Release card");
+    cfg.nsector = 512 * 1024;
+    cfg.au_code = 11;
+    check (sd_model_create (&cfg), "Create card model");
+    check (pfs_fat_format (0) == 0, "Format card");
+    mbr = sd_model_data ();
+    check (get_dword (&mbr[0x1C6]) == 24576, "Partition at first allocation unit");
+    check (layout (8192, &fs_type, &csize), "Data area aligned to 4MB");
+
+    printf ("Format 2.5GB card, 4MB allocation units\n");
+    check (disk_ioctl (0, CTRL_EJECT, NULL) == RES_OK, "Release card");
+    cfg.nsector = 5 * 1024 * 1024;
+    cfg.au_code = 9;
+    check (sd_model_create (&cfg), "Create card model");
+    check (pfs_fat_format (0) == 0, "Format card");
+    check (layout (8192, &fs_type, &csize), "Data area aligned to allocation units");
+    check (( fs_type == FS_FAT32 ) && ( csize == 64 ), "FAT32 with 32KB clusters");
+
+    printf ("Stale FSInfo free count\n");
+    check (disk_ioctl (0, CTRL_EJECT, NULL) == RES_OK, "Release card");
+    uint8_t *boot = (uint8_t *) sd_model_data () + 8192 * 512;
+    uint8_t *fsi = boot + ( boot[48] | ( boot[49] << 8 )) * 512;
+    check (get_dword (fsi) == 0x41615252, "FSInfo sector found");
+    DWORD ntrue = get_dword (&fsi[488]);
+    DWORD nstale = ntrue - 1000;
+    for (int i = 0; i < 4; ++i) fsi[488 + i] = ( nstale >> ( 8 * i )) & 0xFF;
+    pfs = pfs_fat_create ();
+    check (pfs != NULL, "Mount volume");
+    check (pfs_fat_scan (pfs, 4) == 1, "FSInfo count used by default");
+    check (( f_getfree ("0:", &nfree, &pvol) == FR_OK ) && ( nfree == nstale ), "Stale count reported");
+    check (pfs_fat_scan (pfs, 0) == 0, "Restart count");
+    nstep = 0;
+    while (( iScan = pfs_fat_scan (pfs, 64) ) == 0 ) ++nstep;
+    printf ("  Recount took %d steps\n", nstep);
+    check (iScan == 1, "Recount completed");
+    check (( f_getfree ("0:", &nfree, &pvol) == FR_OK ) && ( nfree == ntrue ), "Recount corrects FSInfo value");
+    check (pfs_fat_destroy (pfs) == 0, "Unmount volume");
+
+    return test_result ();
+    }
@@ -0,0 +1,117 @@
+// ffs_test.c - Exercise littlefs and the flash block device against the flash model
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ffs_flash_model.h>
+#include <lfs.h>
+#include <ffs_pico.h>
+#include <pfs_private.h>
+#include <pfs.h>
+#include "test_util.h"
+
+#define NVOLUME ( 1024 * 1024 )
+#define NDATA   ( 64 * 1024 )
+
+static char wbuf[NDATA];
+
+static uint64_t write_time (struct pfs_pfs *pfs, const char *psName, const char *data, int nbyte)
+    {
+    FFS_MODEL_STATS st;
+    ffs_model_reset_stats ();
+    bool bOK = write_file (pfs, psName, data, nbyte);
+    ffs_model_stats (&st);
+    return bOK ? st.time_ns / 1000 : 0;
+    }
+
+int main (int argc, char *argv[])
+    {
+    FFS_MODEL_CONFIG mcfg;
+    FFS_MODEL_STATS st;
+    struct lfs_config cfg;
+    static char wbuf2[NDATA];
+
+    printf ("Format 1MB flash volume\n");
+    ffs_model_defaults (&mcfg);
+    check (ffs_model_create (&mcfg), "Create flash model");
+    check (ffs_pico_createcfg (&cfg, 0, NVOLUME) == 0, "Create configuration");
+    struct pfs_pfs *pfs = pfs_ffs_create (&cfg);
+    check (pfs != NULL, "Format and mount volume");
+
+    printf ("File operations\n");
+    fill (wbuf, NDATA, 1);
+    uint64_t t_first = write_time (pfs, "/test.dat", wbuf, NDATA);
+    check (t_first > 0, "Write file");
+    check (read_file (pfs, "/test.dat", wbuf, NDATA), "Read file");
+    struct stat sbuf;
+    check (( pfs->entry->stat (pfs, "/test.dat", &sbuf) == 0 ) && ( sbuf.st_size == NDATA ), "File size");
+    ffs_model_stats (&st);
+    check (( st.nbits == 0 ) && ( st.nalign == 0 ), "Flash programmed only when erased");
+    printf ("  Write took %d ms\n", (int) ( t_first / 1000 ));
+
+    printf ("Erase free blocks in advance\n");
+    check (pfs->entry->delete (pfs, "/test.dat") == 0, "Delete file");
+    int nleft = pfs_ffs_preerase (pfs, 1);
+    check (nleft > 0, "One block erased");
+    while ( nleft > 0 ) nleft = pfs_ffs_preerase (pfs, 8);
+    check (nleft == 0, "All free blocks erased");
+    uint64_t t_again = write_time (pfs, "/test.dat", wbuf, NDATA);
+    printf ("  Write took %d ms\n", (int) ( t_again / 1000 ));
+    check (( t_again > 0 ) && ( t_again < t_first / 2 ), "Write faster after erasing in advance");
+    check (read_file (pfs, "/test.dat", wbuf, NDATA), "Read file");
+
+    printf ("Statistics\n");
+    struct ffs_pico_stats fst;
+    check (ffs_pico_stats (&cfg, &fst) == 0, "Get statistics");
+    printf ("  %d erases (%d skipped), %d programs, wear %d to %d\n", (int) fst.nerase, (int) fst.nskip,
+        (int) fst.nprog, (int) fst.erase_min, (int) fst.erase_max);
+    printf ("  %d erase commands, average %d us, longest %d us\n", (int) fst.nerase_cmd,
+        (int) ( fst.erase_us / fst.nerase_cmd ), (int) fst.erase_max_us);
+    check (( fst.nerase > 0 ) && ( fst.nskip > 0 ) && ( fst.nprog > 0 ), "Operations counted");
+    uint32_t bins[4];
+    check (( ffs_pico_histogram (&cfg, bins, 4, 1) == 0 )
+        && ( bins[0] + bins[1] + bins[2] + bins[3] == cfg.block_count ), "Wear histogram");
+
+    printf ("Power cut while rewriting a file\n");
+    check (write_file (pfs, "/other.dat", wbuf, 1000), "Write second file");
+    fill (wbuf2, NDATA, 2);
+    int ncut = 0;
+    int nold = 0;
+    int nnew = 0;
+    int nbad = 0;
+    for (uint cut = 1; ; ++cut)
+        {
+        mcfg.cut_after = cut;
+        mcfg.seed = cut;
+        ffs_model_config (&mcfg);
+        write_file (pfs, "/test.dat", ( cut & 1 ) ? wbuf2 : wbuf, NDATA);
+        ffs_model_stats (&st);
+        if ( ! st.bCut ) break;
+        ++ncut;
+        // Restart: the block device state in RAM is lost
+        ffs_pico_destroy (&cfg);
+        free (pfs);
+        ffs_model_power_on ();
+        ffs_pico_createcfg (&cfg, 0, NVOLUME);
+        pfs = pfs_ffs_create (&cfg);
+        if (( pfs == NULL ) || ( ! read_file (pfs, "/other.dat", wbuf, 1000) ))
+            {
+            ++nbad;
+            break;
+            }
+        if ( read_file (pfs, "/test.dat", ( cut & 1 ) ? wbuf : wbuf2, NDATA) ) ++nold;
+        else if ( read_file (pfs, "/test.dat", ( cut & 1 ) ? wbuf2 : wbuf, NDATA) ) ++nnew;
+        else ++nbad;
+        // Leave the file as the next iteration expects
+        if ( ! write_file (pfs, "/test.dat", ( cut & 1 ) ? wbuf2 : wbuf, NDATA) ) ++nbad;
+        }
+    printf ("  %d power cuts, %d old file, %d new file, %d damaged\n", ncut, nold, nnew, nbad);
+    check ( ncut > 0, "Power cut at every flash command");
+    check ( nbad == 0, "Filesystem intact after every power cut");
+
+    return test_result ();
+    }
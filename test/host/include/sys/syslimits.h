@@ -0,0 +1,3 @@
+/* syslimits.h - Host substitute for the NEWLIB header used by the Pico SDK */
+
+#include <limits.h>
@@ -0,0 +1,101 @@
+// nor_test.c - Exercise littlefs and the SPI NOR block device against the NOR chip model
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <nor_spi_model.h>
+#include <lfs.h>
+#include <ffs_nor.h>
+#include <pfs_private.h>
+#include <pfs.h>
+#include "test_util.h"
+
+#define NOFFSET ( 64 * 1024 )
+#define NVOLUME ( 1024 * 1024 )
+#define NDATA   ( 64 * 1024 )
+
+static char wbuf[NDATA];
+
+int main (int argc, char *argv[])
+    {
+    NOR_MODEL_CONFIG mcfg;
+    NOR_MODEL_STATS st;
+    struct lfs_config cfg;
+
+    printf ("Identify chip\n");
+    nor_model_defaults (&mcfg);
+    check (nor_model_create (&mcfg), "Create NOR chip model");
+    check (ffs_nor_id () == mcfg.jedec, "JEDEC identifier");
+    check (ffs_nor_createcfg (&cfg, 1000, NVOLUME) != 0, "Reject unaligned volume");
+    check (ffs_nor_createcfg (&cfg, 15 * NVOLUME, 2 * NVOLUME) != 0, "Reject volume beyond 16MB");
+
+    printf ("Format 1MB volume at 64KB\n");
+    check (ffs_nor_createcfg (&cfg, NOFFSET, NVOLUME) == 0, "Create configuration");
+    struct pfs_pfs *pfs = pfs_ffs_create (&cfg);
+    check (pfs != NULL, "Format and mount volume");
+
+    printf ("File operations\n");
+    fill (wbuf, NDATA, 1);
+    nor_model_reset_stats ();
+    check (write_file (pfs, "/test.dat", wbuf, NDATA), "Write file");
+    nor_model_stats (&st);
+    printf ("  Write took %d ms, %d ms waiting for the chip\n", (int) ( st.time_ns / 1000000 ),
+        (int) ( st.busy_ns / 1000000 ));
+    check (read_file (pfs, "/test.dat", wbuf, NDATA), "Read file");
+    struct stat sbuf;
+    check (( pfs->entry->stat (pfs, "/test.dat", &sbuf) == 0 ) && ( sbuf.st_size == NDATA ), "File size");
+    nor_model_stats (&st);
+    check (( st.nbits == 0 ) && ( st.nreject == 0 ), "Commands valid and flash programmed only when erased");
+    uint8_t *data = nor_model_data ();
+    bool bOutside = true;
+    for (int i = 0; i < NOFFSET; ++i)
+        {
+        if ( data[i] != 0xFF ) bOutside = false;
+        }
+    for (int i = NOFFSET + NVOLUME; i < mcfg.size; ++i)
+        {
+        if ( data[i] != 0xFF ) bOutside = false;
+        }
+    check (bOutside, "Flash outside volume untouched");
+
+    printf ("Remount\n");
+    check (ffs_nor_destroy (&cfg) == 0, "Release block device");
+    free (pfs);
+    check (ffs_nor_createcfg (&cfg, NOFFSET, NVOLUME) == 0, "Create configuration");
+    pfs = pfs_ffs_create (&cfg);
+    check (pfs != NULL, "Mount volume");
+    check (( pfs != NULL ) && read_file (pfs, "/test.dat", wbuf, NDATA), "Read file");
+
+    printf ("Volumes sharing the chip\n");
+    struct lfs_config cfg2;
+    check (ffs_nor_createcfg (&cfg2, NOFFSET + NVOLUME, NVOLUME) == 0, "Create second configuration");
+    check (ffs_nor_destroy (&cfg2) == 0, "Release second block device");
+    nor_model_reset_stats ();
+    check (( pfs != NULL ) && read_file (pfs, "/test.dat", wbuf, NDATA), "First volume still readable");
+    nor_model_stats (&st);
+    check (st.loaded && ( st.nreject == 0 ), "Hardware kept for first volume");
+    check (ffs_nor_destroy (&cfg) == 0, "Release last block device");
+    nor_model_stats (&st);
+    check (! st.loaded, "Hardware released");
+    free (pfs);
+
+    printf ("Chip capacity\n");
+    mcfg.size = 2 * 1024 * 1024;
+    mcfg.jedec = 0xEF4015;
+    check (nor_model_create (&mcfg), "Create 2MB chip model");
+    check (ffs_nor_createcfg (&cfg, NOFFSET, 2 * NVOLUME) != 0, "Reject volume beyond chip capacity");
+    check (ffs_nor_createcfg (&cfg, NOFFSET, NVOLUME) == 0, "Create configuration within capacity");
+
+    printf ("Chip stuck busy\n");
+    mcfg.sector_us = 5000000;
+    check (nor_model_create (&mcfg), "Create slow chip model");
+    check (cfg.erase (&cfg, 0) == 0, "Start erase");
+    check (cfg.sync (&cfg) == LFS_ERR_IO, "Wait times out");
+    check (ffs_nor_destroy (&cfg) == -1, "Release reports busy chip");
+
+    return test_result ();
+    }
@@ -0,0 +1,167 @@
+// ram_test.c - Exercise the RAM filesystem
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pfs_private.h>
+#include <pfs.h>
+#include "test_util.h"
+
+#define NVOLUME ( 64 * 1024 )
+#define NDATA   ( 16 * 1024 )
+
+static char wbuf[NDATA];
+static char wbuf2[NDATA];
+static char rbuf[NDATA];
+
+static int count_dir (struct pfs_pfs *pfs, const char *psDir)
+    {
+    struct pfs_dir *d = (struct pfs_dir *) pfs->entry->opendir (pfs, psDir);
+    if ( d == NULL ) return -1;
+    int n = 0;
+    while ( d->entry->readdir (d) != NULL ) ++n;
+    d->entry->closedir (d);
+    free (d);
+    return n;
+    }
+
+// Write as much as will fit, returning the number of bytes
+static int fill_volume (struct pfs_pfs *pfs, const char *psName)
+    {
+    struct pfs_file *f = pfs->entry->open (pfs, psName, O_CREAT | O_TRUNC | O_WRONLY);
+    if ( f == NULL ) return -1;
+    int ntotal = 0;
+    int n;
+    while (( n = f->entry->write (f, wbuf, 1000) ) > 0 ) ntotal += n;
+    f->entry->close (f);
+    free (f);
+    return ntotal;
+    }
+
+int main (int argc, char *argv[])
+    {
+    struct stat sbuf;
+    struct pfs_file *f;
+    struct pfs_file *f2;
+
+    printf ("Create 64KB RAM volume\n");
+    check (pfs_ram_create (100) == NULL, "Reject volume too small");
+    struct pfs_pfs *pfs = pfs_ram_create (NVOLUME);
+    check (pfs != NULL, "Create volume");
+    check (( pfs->entry->stat (pfs, "/", &sbuf) == 0 ) && S_ISDIR (sbuf.st_mode), "Root directory");
+
+    printf ("File operations\n");
+    fill (wbuf, NDATA, 1);
+    fill (wbuf2, NDATA, 2);
+    check (write_file (pfs, "/test.dat", wbuf, NDATA), "Write file");
+    check (read_file (pfs, "/test.dat", wbuf, NDATA), "Read file");
+    check (( pfs->entry->stat (pfs, "/test.dat", &sbuf) == 0 ) && ( sbuf.st_size == NDATA )
+        && S_ISREG (sbuf.st_mode), "File size");
+    check ((( f = pfs->entry->open (pfs, "/test.dat", O_CREAT | O_EXCL | O_WRONLY) ) == NULL )
+        && ( errno == EEXIST ), "Exclusive create of existing file fails");
+    check ((( f = pfs->entry->open (pfs, "/none.dat", O_RDONLY) ) == NULL ) && ( errno == ENOENT ),
+        "Open missing file fails");
+
+    f = pfs->entry->open (pfs, "/test.dat", O_RDWR);
+    check (( f != NULL ) && ( f->entry->lseek (f, 1000, SEEK_SET) == 1000 )
+        && ( f->entry->write (f, wbuf2, 10) == 10 ), "Overwrite within file");
+    check (( f->entry->lseek (f, -10, SEEK_CUR) == 1000 ) && ( f->entry->read (f, rbuf, 20) == 20 )
+        && ( memcmp (rbuf, wbuf2, 10) == 0 ) && ( memcmp (rbuf + 10, wbuf + 1010, 10) == 0 ), "Read back overwrite");
+    check (( f->entry->lseek (f, 0, SEEK_END) == NDATA ) && ( f->entry->read (f, rbuf, 10) == 0 ), "Read at end of file");
+    check (( f->entry->lseek (f, NDATA + 1000, SEEK_SET) == NDATA + 1000 )
+        && ( f->entry->write (f, wbuf, 10) == 10 ), "Write beyond end of file");
+    memset (rbuf, 0xAA, 1000);
+    f->entry->lseek (f, NDATA, SEEK_SET);
+    bool bZero = ( f->entry->read (f, rbuf, 1000) == 1000 );
+    for (int i = 0; i < 1000; ++i)
+        {
+        if ( rbuf[i] != 0 ) bZero = false;
+        }
+    check (bZero, "Gap reads as zeros");
+    check (( f->entry->fstat (f, &sbuf) == 0 ) && ( sbuf.st_size == NDATA + 1010 ), "File extended");
+    f->entry->close (f);
+    free (f);
+
+    f = pfs->entry->open (pfs, "/log.txt", O_CREAT | O_WRONLY | O_APPEND);
+    f2 = pfs->entry->open (pfs, "/log.txt", O_WRONLY | O_APPEND);
+    check (( f != NULL ) && ( f2 != NULL ) && ( f->entry->write (f, "abc", 3) == 3 )
+        && ( f2->entry->write (f2, "def", 3) == 3 ) && ( f->entry->write (f, "ghi", 3) == 3 ), "Append from two handles");
+    f->entry->close (f);
+    f2->entry->close (f2);
+    free (f);
+    free (f2);
+    check (read_file (pfs, "/log.txt", "abcdefghi", 9), "Appended data in order");
+    check ((( f = pfs->entry->open (pfs, "/log.txt", O_RDONLY) ) != NULL )
+        && ( f->entry->write (f, "x", 1) == -1 ) && ( errno == EBADF ), "Write to read only file fails");
+    f->entry->close (f);
+    free (f);
+
+    printf ("Interleaved writes to two files\n");
+    f = pfs->entry->open (pfs, "/a.dat", O_CREAT | O_WRONLY);
+    f2 = pfs->entry->open (pfs, "/b.dat", O_CREAT | O_WRONLY);
+    for (int i = 0; i < NDATA; i += 100)
+        {
+        int n = ( NDATA - i < 100 ) ? NDATA - i : 100;
+        f->entry->write (f, wbuf + i, n);
+        f2->entry->write (f2, wbuf2 + i, n);
+        }
+    f->entry->close (f);
+    f2->entry->close (f2);
+    free (f);
+    free (f2);
+    check (read_file (pfs, "/a.dat", wbuf, NDATA), "Read first file");
+    check (read_file (pfs, "/b.dat", wbuf2, NDATA), "Read second file");
+
+    printf ("Directories\n");
+    check (pfs->entry->mkdir (pfs, "/tmp", 0777) == 0, "Make directory");
+    check (( pfs->entry->mkdir (pfs, "/tmp", 0777) == -1 ) && ( errno == EEXIST ), "Make existing directory fails");
+    check (( pfs->entry->mkdir (pfs, "/x/y", 0777) == -1 ) && ( errno == ENOENT ), "Make directory in missing directory fails");
+    check (write_file (pfs, "/tmp/one", wbuf, 100), "Write file in directory");
+    check (write_file (pfs, "/tmp/two", wbuf2, 200), "Write second file in directory");
+    check (count_dir (pfs, "/tmp") == 2, "List directory");
+    check (count_dir (pfs, "/") == 5, "List root directory");
+    check (( pfs->entry->rmdir (pfs, "/tmp") == -1 ) && ( errno == ENOTEMPTY ), "Remove non-empty directory fails");
+    check (( pfs->entry->delete (pfs, "/tmp") == -1 ) && ( errno == EISDIR ), "Delete directory as file fails");
+    check (write_file (pfs, "/tmp/a_very_long_name_which_will_not_fit", wbuf, 10) == false
+        && ( errno == ENAMETOOLONG ), "Name too long fails");
+
+    printf ("Rename\n");
+    check (pfs->entry->rename (pfs, "/tmp/one", "/one.dat") == 0, "Move file to another directory");
+    check (read_file (pfs, "/one.dat", wbuf, 100) && ( count_dir (pfs, "/tmp") == 1 ), "Moved file readable");
+    check (pfs->entry->rename (pfs, "/tmp/two", "/one.dat") == 0, "Rename over existing file");
+    check (read_file (pfs, "/one.dat", wbuf2, 200), "Replaced file has new contents");
+    check (pfs->entry->mkdir (pfs, "/tmp/sub", 0777) == 0, "Make subdirectory");
+    check (( pfs->entry->rename (pfs, "/tmp", "/tmp/sub/tmp") == -1 ) && ( errno == EINVAL ),
+        "Move directory inside itself fails");
+    check (pfs->entry->rename (pfs, "/tmp", "/scratch") == 0, "Rename directory");
+    check (( pfs->entry->stat (pfs, "/scratch/sub", &sbuf) == 0 ) && S_ISDIR (sbuf.st_mode), "Subdirectory moved");
+    check (( pfs->entry->rmdir (pfs, "/scratch/sub") == 0 ) && ( pfs->entry->rmdir (pfs, "/scratch") == 0 ),
+        "Remove empty directories");
+
+    printf ("Delete open file\n");
+    f = pfs->entry->open (pfs, "/a.dat", O_RDONLY);
+    check (pfs->entry->delete (pfs, "/a.dat") == 0, "Delete file");
+    check (pfs->entry->stat (pfs, "/a.dat", &sbuf) == -1, "Deleted file not found");
+    check (( f != NULL ) && ( f->entry->read (f, rbuf, NDATA) == NDATA ) && ( memcmp (rbuf, wbuf, NDATA) == 0 ),
+        "Open handle still reads data");
+    f->entry->close (f);
+    free (f);
+
+    printf ("Full volume\n");
+    const char *files[] = { "/test.dat", "/log.txt", "/b.dat", "/one.dat" };
+    for (int i = 0; i < sizeof (files) / sizeof (files[0]); ++i) pfs->entry->delete (pfs, files[i]);
+    check (count_dir (pfs, "/") == 0, "All files deleted");
+    int nfull = fill_volume (pfs, "/big.dat");
+    printf ("  %d bytes written\n", nfull);
+    check (( nfull > NVOLUME * 9 / 10 ) && ( errno == ENOSPC ), "Volume fills with little overhead");
+    check (write_file (pfs, "/more.dat", wbuf, 10) == false, "No more space");
+    check (pfs->entry->delete (pfs, "/big.dat") == 0, "Delete file");
+    check (fill_volume (pfs, "/big.dat") == nfull, "All space recovered");
+
+    return test_result ();
+    }
@@ -0,0 +1,124 @@
+// sd_bench.c - Exercise the SD card SPI protocol against the software card model
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sd_spi_model.h>
+#include <sd_spi.h>
+#include "test_util.h"
+
+#define NSECT   64
+
+static uint8_t wbuf[NSECT * 512];
+static uint8_t rbuf[NSECT * 512];
+static void report (const char *psMsg, uint nsect)
+    {
+    SD_MODEL_STATS st;
+    sd_model_stats (&st);
+    double us = st.time_ns / 1000.0;
+    printf ("  %-24s %6d sectors %10.0f us %8.1f kB/s %6d cmds\n", psMsg, nsect, us,
+        ( us > 0 ) ? nsect * 512 * 1000.0 / us : 0.0, st.ncmd);
+    }
+
+static void bench (const char *psMode, bool bMulti)
+    {
+    bool bOK = true;
+    fill ((char *) wbuf, sizeof (wbuf), bMulti ? 1 : 2);
+    sd_model_reset_stats ();
+    if ( bMulti ) bOK = sd_spi_write_blocks (100, wbuf, NSECT);
+    else for (int i = 0; i < NSECT; ++i) bOK = bOK && sd_spi_write (100 + i, wbuf + 512 * i);
+    char sMsg[64];
+    sprintf (sMsg, "%s write", psMode);
+    report (sMsg, NSECT);
+    check (bOK, sMsg);
+    memset (rbuf, 0, sizeof (rbuf));
+    sd_model_reset_stats ();
+    if ( bMulti ) bOK = sd_spi_read_blocks (100, rbuf, NSECT);
+    else for (int i = 0; i < NSECT; ++i) bOK = bOK && sd_spi_read (100 + i, rbuf + 512 * i);
+    sprintf (sMsg, "%s read", psMode);
+    report (sMsg, NSECT);
+    check (bOK && ( memcmp (wbuf, rbuf, sizeof (wbuf)) == 0 ), sMsg);
+    }
+
+int main (int argc, char *argv[])
+    {
+    SD_MODEL_CONFIG cfg;
+    sd_model_defaults (&cfg);
+    printf ("Default card, 125MHz system clock\n");
+    check (sd_model_create (&cfg), "Create card model");
+    check (sd_spi_init (), "Initialise card");
+    check (sd_type == sdtpHigh, "High capacity card detected");
+    check (sd_spi_sectors () == cfg.nsector, "Capacity read from CSD");
+    check (sd_spi_au_size () == 2048, "Allocation unit read from SD status");
+    printf ("  SD clock %d kHz\n", sd_spi_get_freq ());
+    check (sd_spi_get_freq () == cfg.sys_khz / 8, "Clock at PIO limit");
+    bench ("Single block", false);
+    bench ("Multiple block", true);
+
+    printf ("Read and write CRC errors\n");
+    cfg.err_read = 5;
+    cfg.err_write = 7;
+    sd_model_config (&cfg);
+    bench ("Retried", true);
+    printf ("  CRC errors %d, SD clock %d kHz\n", sd_spi_crc_count (), sd_spi_get_freq ());
+    check (sd_spi_crc_count () > 0, "CRC errors detected and retried");
+
+    printf ("Overclocked system, marginal wiring\n");
+    sd_model_defaults (&cfg);
+    cfg.sys_khz = 250000;
+    cfg.max_freq = 20000;
+    check (sd_model_create (&cfg), "Create card model");
+    check (sd_spi_init (), "Initialise card");
+    printf ("  SD clock %d kHz\n", sd_spi_get_freq ());
+    check (sd_spi_get_freq () > 25000, "High speed mode negotiated");
+    uint freq = sd_spi_calibrate (0, 4);
+    printf ("  Calibrated clock %d kHz\n", freq);
+    check (( freq <= cfg.max_freq ) && ( freq > cfg.max_freq * 3 / 4 ), "Calibrated below wiring limit");
+    bench ("Calibrated", true);
+
+    printf ("Stepping down on persistent CRC errors\n");
+    check (sd_spi_init (), "Initialise card");
+    printf ("  SD clock %d kHz\n", sd_spi_get_freq ());
+    for (int i = 0; i < 8; ++i) sd_spi_read_blocks (100, rbuf, NSECT);
+    printf ("  SD clock %d kHz\n", sd_spi_get_freq ());
+    check (sd_spi_get_freq () <= cfg.max_freq, "Clock reduced below wiring limit");
+    memset (rbuf, 0, sizeof (rbuf));
+    check (sd_spi_read_blocks (100, rbuf, NSECT) && ( memcmp (wbuf, rbuf, sizeof (wbuf)) == 0 ),
+        "Data intact after step down");
+
+    printf ("Erase, card with garbage collection overhead\n");
+    sd_model_defaults (&cfg);
+    cfg.gc_us = 1500;
+    check (sd_model_create (&cfg), "Create card model");
+    check (sd_spi_init (), "Initialise card");
+    fill ((char *) wbuf, sizeof (wbuf), 3);
+    check (sd_spi_write_blocks (100, wbuf, NSECT) && sd_spi_write (99, wbuf)
+        && sd_spi_write (100 + NSECT, wbuf + 512), "Write blocks");
+    sd_model_reset_stats ();
+    sd_spi_write_blocks (100, wbuf, NSECT);
+    SD_MODEL_STATS st;
+    sd_model_stats (&st);
+    uint64_t t_rewrite = st.time_ns;
+    report ("Rewrite", NSECT);
+    sd_model_reset_stats ();
+    check (sd_spi_erase (100, NSECT), "Erase blocks");
+    sd_model_stats (&st);
+    check (st.nerase == NSECT, "Erased block count");
+    memset (rbuf, 0xAA, sizeof (rbuf));
+    sd_spi_read_blocks (100, rbuf, NSECT);
+    bool bZero = true;
+    for (int i = 0; i < sizeof (rbuf); ++i) if ( rbuf[i] != 0 ) bZero = false;
+    check (bZero, "Erased blocks read as zero");
+    sd_spi_read_blocks (99, rbuf, 1);
+    sd_spi_read_blocks (100 + NSECT, rbuf + 512, 1);
+    check ( memcmp (rbuf, wbuf, 1024) == 0, "Neighbouring blocks intact");
+    sd_model_reset_stats ();
+    sd_spi_write_blocks (100, wbuf, NSECT);
+    sd_model_stats (&st);
+    report ("Write after erase", NSECT);
+    check (st.time_ns < t_rewrite, "Erased blocks written faster");
+
+    return test_result ();
+    }
@@ -0,0 +1,69 @@
+// test_util.c - Checks and file helpers shared by the host tests
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pfs_private.h>
+#include "test_util.h"
+
+static int nfail = 0;
+
+// Normally provided by pfs_base.c
+int pfs_error (int ierr)
+    {
+    errno = ierr;
+    return ( ierr != 0 ) ? -1 : 0;
+    }
+
+void check (bool bOK, const char *psMsg)
+    {
+    printf ("  %-48s %s\n", psMsg, bOK ? "OK" : "FAILED");
+    if ( ! bOK ) ++nfail;
+    }
+
+int test_result (void)
+    {
+    printf ("%s\n", ( nfail == 0 ) ? "All tests passed" : "Tests FAILED");
+    return ( nfail == 0 ) ? 0 : 1;
+    }
+
+void fill (char *buf, int nbyte, unsigned int seed)
+    {
+    for (int i = 0; i < nbyte; ++i)
+        {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+        }
+    }
+
+bool write_file (struct pfs_pfs *pfs, const char *psName, const char *data, int nbyte)
+    {
+    struct pfs_file *f = pfs->entry->open (pfs, psName, O_CREAT | O_TRUNC | O_WRONLY);
+    if ( f == NULL ) return false;
+    bool bOK = ( f->entry->write (f, (char *) data, nbyte) == nbyte );
+    bOK = ( f->entry->close (f) == 0 ) && bOK;
+    free (f);
+    return bOK;
+    }
+
+bool read_file (struct pfs_pfs *pfs, const char *psName, const char *data, int nbyte)
+    {
+    // Ask for one byte more than expected, to check the file length
+    char *rbuf = (char *) calloc (nbyte + 1, 1);
+    if ( rbuf == NULL ) return false;
+    struct pfs_file *f = pfs->entry->open (pfs, psName, O_RDONLY);
+    bool bOK = ( f != NULL );
+    if ( bOK )
+        {
+        bOK = ( f->entry->read (f, rbuf, nbyte + 1) == nbyte );
+        bOK = ( f->entry->close (f) == 0 ) && bOK;
+        free (f);
+        }
+    bOK = bOK && ( memcmp (data, rbuf, nbyte) == 0 );
+    free (rbuf);
+    return bOK;
+    }
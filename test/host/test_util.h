@@ -0,0 +1,27 @@
+// test_util.h - Checks and file helpers shared by the host tests
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <stdbool.h>
+
+struct pfs_pfs;
+
+// Report a check, counting the failures
+void check (bool bOK, const char *psMsg);
+
+// Report the outcome of the checks, returning the exit status
+int test_result (void);
+
+// Fill a buffer with pseudo-random data
+void fill (char *buf, int nbyte, unsigned int seed);
+
+// Write a file
+bool write_file (struct pfs_pfs *pfs, const char *psName, const char *data, int nbyte);
+
+// Read a file back, checking that it holds exactly the data given
+bool read_file (struct pfs_pfs *pfs, const char *psName, const char *data, int nbyte);
+
+#endif